@@ -30,6 +30,8 @@ local find,match = string.find,string.match
 local iopen = io.open
 
 local bzip2 = require"larc.bzip2"
+local readline,linesiter = bzip2.readline,bzip2.lines
+local choose_bufsize = bzip2.bufsize
 
 module"larc.bz2file"
 
@@ -38,108 +40,114 @@ module"larc.bz2file"
 local bz2_reader = {}
 local bz2_writer = {}
 
---[[Support the "*line" read argument.
+--[[Decompress the next chunk of the file.
+    Returns nil at the end of the file.
   ]]
-local function read_line(bz2)
-  if bz2._eof and #bz2._buffer == 0 then
+local function read_chunk(bz2)
+  if bz2._eof then
     return nil
   end
-  local handle, process = bz2._handle, bz2._process
-  local buffer = {}
-  local outbuf = bz2._buffer
-  local buflen = #outbuf
-  local pos = find(outbuf, "\n", 1, true)
-  while not pos and not bz2._eof do
-    buffer[#buffer+1] = outbuf
-    local inbuf = handle:read(1024)
-    if not inbuf then
+  local readahead = bz2._readahead
+  if readahead then
+    local outbuf,errmsg,errnum = readahead:read()
+    if not outbuf then
+      assert(not errmsg, errmsg, errnum)
       bz2._eof = true
-      break
     end
-    local errmsg,errnum
-    outbuf,errmsg,errnum = process(inbuf)
-    assert(errnum>=0, errmsg, errnum)
-    if errnum == bzip2.BZ_STREAM_END then
-      bz2._eof = true
-    end
-    buflen = buflen + #outbuf
-    pos = find(outbuf, "\n", 1, true)
+    return outbuf
   end
-  if buflen == 0 then
+  local inbuf = bz2._handle:read(bz2._bufsize)
+  if not inbuf then
+    bz2._eof = true
     return nil
   end
-  if pos then
-    bz2._buffer = sub(outbuf, pos+1)
-    bz2._pos = bz2._pos + buflen + pos - #outbuf
-    buffer[#buffer+1] = sub(outbuf, 1, pos-1)
-  else
-    bz2._buffer = ""
-    bz2._pos = bz2._pos + buflen
-    buffer[#buffer+1] = outbuf
+  local outbuf,used,errnum = bz2._process(inbuf)
+  assert(errnum>=0, used, errnum)
+  -- A flushed file is a series of streams, read as one.
+  -- Anything after a stream that is not another stream
+  -- is ignored.
+  while errnum == bzip2.BZ_STREAM_END do
+    inbuf = sub(inbuf, used+1)
+    if #inbuf < 3 then
+      inbuf = inbuf .. (bz2._handle:read(bz2._bufsize) or "")
+    end
+    if sub(inbuf, 1, 3) ~= "BZh" then
+      bz2._eof = true
+      break
+    end
+    bz2._process = bzip2.decompressor()
+    local more
+    more,used,errnum = bz2._process(inbuf)
+    assert(errnum>=0, used, errnum)
+    outbuf = outbuf .. more
   end
-  return concat(buffer)
+  return outbuf
+end
+
+--[[Drop the part of the buffer already returned
+    by read_line.
+  ]]
+local function trim_buffer(bz2)
+  if bz2._offset > 0 then
+    bz2._buffer = sub(bz2._buffer, bz2._offset+1)
+    bz2._offset = 0
+  end
+end
+
+--[[Support the "*line" read argument.
+    The line is found in the buffer by readline without
+    copying the rest of the buffer.
+  ]]
+local function read_line(bz2)
+  return readline(bz2, read_chunk)
 end
 
 --[[Support the "*all" read argument.
   ]]
 local function read_all(bz2)
+  trim_buffer(bz2)
   if bz2._eof and #bz2._buffer == 0 then
     return ""
   end
-  local handle, process = bz2._handle, bz2._process
   local buffer = { bz2._buffer }
   local buflen = #buffer[1]
   bz2._buffer = ""
-  while not bz2._eof do
-    local inbuf = handle:read(1024)
-    if not inbuf then
-      bz2._eof = true
-      break
-    end
-    local outbuf,errmsg,errnum = process(inbuf)
-    assert(errnum>=0, errmsg, errnum)
-    if errnum == bzip2.BZ_STREAM_END then
-      bz2._eof = true
-    end
+  local outbuf = read_chunk(bz2)
+  while outbuf do
     buflen = buflen + #outbuf
     buffer[#buffer+1] = outbuf
+    outbuf = read_chunk(bz2)
   end
   bz2._pos = bz2._pos + buflen
-  buffer = concat(buffer)
-  return buffer
+  return concat(buffer)
 end
 
 --[[Read up to ''size'' bytes from a bz2file.
   ]]
 local function read_bytes(bz2, size)
+  trim_buffer(bz2)
   if bz2._eof and #bz2._buffer == 0 then
     return nil
   end
   if size <= 0 then
     return ""
   end
-  local handle, process = bz2._handle, bz2._process
   local buffer = {}
   local outbuf = bz2._buffer
   local buflen = #outbuf
-  while buflen < size and not bz2._eof do
-    buffer[#buffer+1] = outbuf
-    local inbuf = handle:read(1024)
-    if not inbuf then
-      bz2._eof = true
+  while buflen < size do
+    local chunk = read_chunk(bz2)
+    if not chunk then
       break
     end
-    local errmsg,errnum
-    outbuf,errmsg,errnum = process(inbuf)
-    assert(errnum>=0, errmsg, errnum)
-    if errnum == bzip2.BZ_STREAM_END then
-      bz2._eof = true
-    end
+    buffer[#buffer+1] = outbuf
+    outbuf = chunk
     buflen = buflen + #outbuf
   end
   if buflen == 0 then
     return nil
   end
+  -- pos is the offset from the end of the buffer
   local pos = size - buflen
   bz2._buffer = sub(outbuf, #outbuf+pos+1)
   bz2._pos = bz2._pos + buflen + pos
@@ -170,29 +178,30 @@ function bz2_reader:read(size)
   return read_bytes(self, tonumber(size))
 end
 
+--[[Standard file handle lines method.
+  ]]
+function bz2_reader:lines()
+  assert(self._handle, "attempt to read from a closed file")
+  return linesiter(self, read_chunk)
+end
+
 --[[Skip ahead in the file.
     Basically the same as read_bytes but just 
     discards the bytes.
   ]]
 local function read_skip(bz2, size)
+  trim_buffer(bz2)
   if size <= 0 or (bz2._eof and #bz2._buffer == 0) then
     return bz2._pos
   end
-  local handle, process = bz2._handle, bz2._process
   local outbuf = bz2._buffer
   local bytesread = #outbuf
-  while bytesread < size and not bz2._eof do
-    local inbuf = handle:read(1024)
-    if not inbuf then
-      bz2._eof = true
+  while bytesread < size do
+    local chunk = read_chunk(bz2)
+    if not chunk then
       break
     end
-    local errmsg,errnum
-    outbuf,errmsg,errnum = process(inbuf)
-    assert(errnum>=0, errmsg, errnum)
-    if errnum == bzip2.BZ_STREAM_END then
-      bz2._eof = true
-    end
+    outbuf = chunk
     bytesread = bytesread + #outbuf
   end
   -- pos is the offset from the end of the buffer
@@ -207,13 +216,22 @@ end
     support seeking.
   ]]
 local function read_rewind(bz2, newpos)
+  -- Stop the readahead before moving the file.
+  local readahead = bz2._readahead
+  if readahead then
+    readahead:close()
+  end
   -- Return to the start of the compressed stream.
   assert(bz2._bzstreamstart and
       bz2._handle:seek("set",bz2._bzstreamstart), "file handle cannot seek backwards")
   bz2._eof = false
   bz2._pos = 0
   bz2._buffer = ""
+  bz2._offset = 0
   bz2._process = bzip2.decompressor()
+  if readahead then
+    bz2._readahead = bzip2.readahead(bz2._handle, {bufsize=bz2._bufsize})
+  end
   return read_skip(bz2, newpos)
 end
 
@@ -246,6 +264,10 @@ end
     for a bz2file in read mode.
   ]]
 function bz2_reader:close()
+  if self._readahead then
+    self._readahead:close()
+    self._readahead = nil
+  end
   if self._ownhandle then
     self._handle:close()
     self._ownhandle = nil
@@ -254,22 +276,48 @@ function bz2_reader:close()
   return true
 end
 
---[[Convert values to strings and write to
-    a bz2file.
+--[[Pass the buffered values through the compressor
+    and write the result to the file. With ''sync'', the
+    compressor is flushed so all of it can be read back.
   ]]
-local function write_values(bz2, val, ...)
-  if not val then
+local function write_pending(bz2, sync)
+  if bz2._pendinglen == 0 and not (sync and bz2._unflushed) then
     return bz2
   end
-  local outbuf,errnum = bz2._process(tostring(val))
+  local str = concat(bz2._pending)
+  bz2._pending = {}
+  bz2._pendinglen = 0
+  local outbuf,errmsg,errnum = bz2._process(str, sync)
   if errnum < 0 then
-    return nil,errnum
+    return nil,errmsg,errnum
   end
+  bz2._unflushed = not sync
   local res,message = bz2._handle:write(outbuf)
   if not res then
-    return res,message
+    return nil,message
+  end
+  return bz2
+end
+
+--[[Convert values to strings and add them to the
+    write buffer. The buffer is compressed when it
+    holds at least ''_bufsize'' bytes.
+  ]]
+local function write_values(bz2, val, ...)
+  if not val then
+    return bz2
   end
+  val = tostring(val)
+  local pending = bz2._pending
+  pending[#pending+1] = val
+  bz2._pendinglen = bz2._pendinglen + #val
   bz2._size = bz2._size + #val
+  if bz2._pendinglen >= bz2._bufsize then
+    local res,errmsg,errnum = write_pending(bz2)
+    if not res then
+      return nil,errmsg,errnum
+    end
+  end
   return write_values(bz2, ...)
 end
 
@@ -280,19 +328,41 @@ function bz2_writer:write(...)
   return write_values(self, ...)
 end
 
+--[[Standard flush method.
+    Compresses the buffered data, ends the current block
+    and flushes the file handle, so everything written so
+    far can be read from the file.
+  ]]
+function bz2_writer:flush()
+  assert(self._handle, "attempt to write to a closed file")
+  local res,errmsg,errnum = write_pending(self, true)
+  if not res then
+    return nil,errmsg,errnum
+  end
+  if self._handle.flush then
+    self._handle:flush()
+  end
+  return self
+end
+
 --[[Standard file handle seek.
     Can only seek forward while writing a gzfile.
   ]]
 function bz2_writer:seek(whence, newpos)
   whence = whence or "cur"
   newpos = newpos or 0
+  local res,errmsg,errnum = write_pending(self)
+  if not res then
+    return nil,errmsg,errnum
+  end
+  local bufsize = self._bufsize
   if whence == "set" then
     newpos = newpos - self._size
   end
   assert(newpos>=0, "attempt to seek backwards while writing a bz2file")
-  if newpos > 1024 then
-    local str = strrep('\0', 1024)
-    while newpos >= 1024 do
+  if newpos > bufsize then
+    local str = strrep('\0', bufsize)
+    while newpos >= bufsize do
       local outbuf,errmsg,errnum = self._process(str)
       if errnum < 0 then
         return nil,errmsg,errnum
@@ -301,8 +371,8 @@ function bz2_writer:seek(whence, newpos)
       if not res then
         return nil,message
       end
-      self._size = self._size + 1024
-      newpos = newpos - 1024
+      self._size = self._size + bufsize
+      newpos = newpos - bufsize
     end
   end
   if newpos > 0 then
@@ -325,7 +395,12 @@ end
   ]]
 function bz2_writer:close()
   if self._handle then
-    local outbuf,errmsg,errnum = self._process(nil)
+    local res,errmsg,errnum = write_pending(self)
+    if not res then
+      return nil,errmsg,errnum
+    end
+    local outbuf
+    outbuf,errmsg,errnum = self._process(nil)
     if outbuf then
       self._handle:write(outbuf)
     end
@@ -356,23 +431,38 @@ local bz2_write_mt = { __index=bz2_writer, __newindex=bz2_mt_newindex }
     If ''ownhandle'' is set, then the file
     handle will be closed with the bz2file.
   ]]
-local function bz2file_open(handle, ownhandle)
-  local bz2 = { _handle=handle, _ownhandle=ownhandle }
+local function bz2file_open(handle, ownhandle, bufsize, pipelined)
+  local bz2 = { _handle=handle, _ownhandle=ownhandle,
+      _bufsize=bufsize or choose_bufsize(handle) }
   bz2._process = bzip2.decompressor()
   if handle.seek then -- Disregard if seeking isn't possible.
     bz2._bzstreamstart = handle:seek("cur",0)
   end
-  local data,message,errnum = handle:read(10) -- the smallest bz2 stream
-  if not data then
-    return nil,message
+  local data,message,errnum
+  if pipelined then
+    bz2._readahead = bzip2.readahead(handle, {bufsize=bz2._bufsize})
   end
-  data,message,errnum = bz2._process(data)
-  if errnum < 0 then
-    return nil,message
+  if bz2._readahead then
+    data,message,errnum = bz2._readahead:read()
+    if message then
+      return nil,message
+    end
+    bz2._eof = not data
+    data = data or ""
+  else
+    data,message,errnum = handle:read(10) -- the smallest bz2 stream
+    if not data then
+      return nil,message
+    end
+    data,message,errnum = bz2._process(data)
+    if errnum < 0 then
+      return nil,message
+    end
+    bz2._eof = errnum == bzip2.BZ_STREAM_END
   end
-  bz2._eof = errnum == bzip2.BZ_STREAM_END
   bz2._buffer = data
   bz2._pos = 0
+  bz2._offset = 0
   return setmetatable(bz2, bz2_read_mt)
 end
 
@@ -380,11 +470,15 @@ end
     If ''ownhandle'' is set, then the file
     handle will be closed with the bz2file.
   ]]
-local function bz2file_create(handle, ownhandle, level)
+local function bz2file_create(handle, ownhandle, level, bufsize)
   local bz2 = {
     _handle=handle,
     _ownhandle=ownhandle,
-    _size=0
+    _bufsize=bufsize or 65536,
+    _pending={},
+    _pendinglen=0,
+    _size=0,
+    _unflushed=false
   }
   bz2._process = bzip2.compressor{blocksize=level}
   return setmetatable(bz2, bz2_write_mt)
@@ -395,16 +489,29 @@ end
     have "b". (A bz2file is always in binary mode.)
     When writing a bz2file, the ''level'' option
     is a number in the range [1,9].
+    ''bufsize'' is the size of the chunks read from
+    the file. By default it is chosen from the size
+    of the file. When writing, up to ''bufsize'' bytes
+    are collected before they are compressed, or until
+    the flush method is called.
+    With "p" in the read mode, the file is decompressed
+    ahead in a background thread while it is being read.
+    This needs an io library file on a regular file;
+    other handles are read normally.
   ]]
-function open(file, mode, level)
+function open(file, mode, level, bufsize)
   mode = mode or "r"
+  bufsize = tonumber(bufsize)
+  assert(not bufsize or bufsize > 0, "invalid buffer size")
   do
     local tn = type(file)
     assert(tn=='string' or ((
         tn=='table' or tn=='userdata') and type(file.seek)=='function'))
     assert(type(mode)=='string')
   end
+  local pipelined
   if match(mode,'^b?rb?') then
+    pipelined = find(mode,'p',1,true) ~= nil
     mode = "rb"
   elseif match(mode,'b?wb?') then
     mode = "wb"
@@ -424,8 +531,8 @@ function open(file, mode, level)
     handle = file
   end
   if mode == "rb" then
-    return bz2file_open(handle, ownhandle)
+    return bz2file_open(handle, ownhandle, bufsize, pipelined)
   else
-    return bz2file_create(handle, ownhandle, level)
+    return bz2file_create(handle, ownhandle, level, bufsize)
   end
 end
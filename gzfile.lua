@@ -28,10 +28,12 @@ local setmetatable = setmetatable
 local sub,concat,strrep = string.sub,table.concat,string.rep
 local find,match,strbyte,strchar = string.find,string.match,string.byte,string.char
 local iopen = io.open
-local modf = math.modf
+local modf,floor,max = math.modf,math.floor,math.max
 local unpack = unpack or table.unpack
 
 local zlib = require"larc.zlib"
+local readline,linesiter = zlib.readline,zlib.lines
+local choose_bufsize = zlib.bufsize
 
 module"larc.gzfile"
 
@@ -140,93 +142,212 @@ end
   ]]
 local function readextrafields(buf)
   local function _xtra(t, i)
-    if i+4 > #buf then
+    if i+3 > #buf then
       return t
     end
-    local tag,len = sub(buf,1,2),sub(buf,3,4)
+    local tag,len = sub(buf,i,i+1),sub(buf,i+2,i+3)
     len = bytestonumber(len)
-    t[tag] = sub(buf,5,len+4)
-    return _xtra(t, len+5)
+    t[tag] = sub(buf,i+4,i+len+3)
+    return _xtra(t, i+len+4)
   end
   return _xtra({}, 1)
 end
 
+--[[Sizes for BGZF files. A block holds up to 65280
+    bytes, and a virtual offset is the offset of a block
+    in the file times 65536 plus an offset in its data.
+    Blocks are decompressed on four threads when a BGZF
+    file is opened with "p". The threads are kept in a
+    bgzf_pool with the file until it is closed.
+  ]]
+local bgzf_blocksize = 65280
+local bgzf_voffset = 65536
+local bgzf_threads = 4
+
+--[[Decoder checkpoints. While a gzfile is read, a copy of
+    the decoder is kept about every 4 MB, so that seeking
+    backward resumes from the closest copy instead of the
+    start of the stream. The 16 most recently used copies,
+    of about 40 KB each, are kept. A checkpoint in a BGZF
+    file is only the offset of a block.
+  ]]
+local checkpoint_interval = 4194304
+local checkpoint_count = 16
+
 --[[Method tables for gzfile.
   ]]
 local gz_reader = {}
 local gz_writer = {}
 
---[[Support the "*line" read argument.
+--[[Keep a checkpoint at a chunk boundary, dropping the
+    least recently used one when there are too many.
   ]]
-local function read_line(gz)
-  if gz._eof and #gz._buffer == 0 then
-    return nil
+local function add_checkpoint(gz, coffset, upos, process)
+  local checkpoints = gz._checkpoints
+  gz._nextcheckpoint = upos + checkpoint_interval
+  local oldest
+  for i=1,#checkpoints do
+    local cp = checkpoints[i]
+    if cp.upos == upos then
+      return
+    end
+    if not oldest or cp.used < checkpoints[oldest].used then
+      oldest = i
+    end
   end
-  local handle, process = gz._handle, gz._process
-  local buffer = {}
-  local outbuf = gz._buffer
-  local buflen = #outbuf
-  local pos = find(outbuf, "\n", 1, true)
-  while not pos and not gz._eof do
-    buffer[#buffer+1] = outbuf
-    local inbuf = handle:read(1024)
+  gz._clock = gz._clock + 1
+  local cp = { coffset=coffset, upos=upos, process=process, used=gz._clock }
+  if #checkpoints < checkpoint_count then
+    checkpoints[#checkpoints+1] = cp
+  else
+    checkpoints[oldest] = cp
+  end
+end
+
+--[[Find the last checkpoint at or before ''pos''.
+  ]]
+local function find_checkpoint(gz, pos)
+  local checkpoints = gz._checkpoints
+  local best
+  for i=1,#checkpoints do
+    local cp = checkpoints[i]
+    if cp.upos <= pos and (not best or cp.upos > best.upos) then
+      best = cp
+    end
+  end
+  return best
+end
+
+--[[Add the compressed and uncompressed sizes from
+    bgzf_decompress to the list of block offsets. The
+    list ends with the block that will be read next, and
+    blocks that end before the read position are dropped.
+  ]]
+local function record_blocks(gz, sizes)
+  local blocks = gz._blocks
+  local n = #blocks
+  local first = 1
+  while first+2 < n and blocks[first+3] <= gz._pos do
+    first = first + 2
+  end
+  local kept = {}
+  for i=first,n-2 do
+    kept[#kept+1] = blocks[i]
+  end
+  local coffset,ustart = blocks[n-1],blocks[n]
+  for i=1,#sizes,2 do
+    kept[#kept+1] = coffset
+    kept[#kept+1] = ustart
+    coffset = coffset + sizes[i]
+    ustart = ustart + sizes[i+1]
+  end
+  kept[#kept+1] = coffset
+  kept[#kept+1] = ustart
+  gz._blocks = kept
+end
+
+--[[Decompress the next whole blocks of a BGZF file.
+    A partial block is kept until the rest of it is read.
+  ]]
+local function read_blocks(gz)
+  local outbuf,used,sizes
+  repeat
+    local inbuf = gz._handle:read(gz._bufsize)
     if not inbuf then
+      -- a truncated block ends the file quietly
       gz._eof = true
-      break
+      return nil
+    end
+    local data = gz._bgzfpending
+    if #data > 0 then
+      data = data .. inbuf
+    else
+      data = inbuf
     end
-    local errmsg,errnum
-    outbuf,errmsg,errnum = process(inbuf)
-    assert(errnum>=0, errmsg, errnum)
-    if errnum == zlib.Z_STREAM_END then
-      -- FIXME should probably check the footer bytes or something
+    outbuf,used,sizes = zlib.bgzf_decompress(data, {pool=gz._pool})
+    assert(outbuf, used)
+    gz._bgzfpending = sub(data, used+1)
+    record_blocks(gz, sizes)
+    local blocks = gz._blocks
+    if blocks[#blocks] >= gz._nextcheckpoint and not gz._vseeked then
+      add_checkpoint(gz, blocks[#blocks-1], blocks[#blocks])
+    end
+  until #outbuf > 0
+  return outbuf
+end
+
+--[[Decompress the next chunk of the file.
+    Returns nil at the end of the file.
+  ]]
+local function read_chunk(gz)
+  if gz._eof then
+    return nil
+  end
+  if gz._bgzf then
+    return read_blocks(gz)
+  end
+  local readahead = gz._readahead
+  if readahead then
+    local outbuf,errmsg,errnum = readahead:read()
+    if not outbuf then
+      assert(not errmsg, errmsg, errnum)
       gz._eof = true
     end
-    buflen = buflen + #outbuf
-    pos = find(outbuf, "\n", skip, true)
+    return outbuf
   end
-  if buflen == 0 then
+  local inbuf = gz._handle:read(gz._bufsize)
+  if not inbuf then
+    gz._eof = true
     return nil
   end
-  if pos then
-    gz._buffer = sub(outbuf, pos+1)
-    gz._pos = gz._pos + buflen + pos - #outbuf
-    buffer[#buffer+1] = sub(outbuf, 1, pos-1)
-  else
-    gz._buffer = ""
-    gz._pos = gz._pos + buflen
-    buffer[#buffer+1] = outbuf
+  local outbuf,errmsg,errnum = gz._process(inbuf)
+  assert(errnum>=0, errmsg, errnum)
+  if errnum == zlib.Z_STREAM_END then
+    -- FIXME should probably check the footer bytes or something
+    gz._eof = true
+  end
+  -- The decoder has used all of the input.
+  gz._zout = gz._zout + #outbuf
+  if gz._zout >= gz._nextcheckpoint and not gz._eof and gz._zstreamstart then
+    add_checkpoint(gz, gz._handle:seek("cur",0), gz._zout, zlib.copy(gz._process))
+  end
+  return outbuf
+end
+
+--[[Drop the part of the buffer already returned
+    by read_line.
+  ]]
+local function trim_buffer(gz)
+  if gz._offset > 0 then
+    gz._buffer = sub(gz._buffer, gz._offset+1)
+    gz._offset = 0
   end
-  return concat(buffer)
+end
+
+--[[Support the "*line" read argument.
+    The line is found in the buffer by readline without
+    copying the rest of the buffer.
+  ]]
+local function read_line(gz)
+  return readline(gz, read_chunk)
 end
 
 --[[Support the "*all" read argument.
   ]]
 local function read_all(gz)
+  trim_buffer(gz)
   if gz._eof and #gz._buffer == 0 then
     return ""
   end
-  local handle, process = gz._handle, gz._process
   local buffer = { gz._buffer }
   local buflen = #buffer[1]
   gz._buffer = ""
-  while not gz._eof do
-    local inbuf = handle:read(1024)
-    if not inbuf then
-      gz._eof = true
-      break
-    end
-    local outbuf,errmsg,errnum = process(inbuf)
-    assert(errnum>=0, errmsg, errnum)
-    if errnum == zlib.Z_STREAM_END then
-      -- FIXME should probably check the footer bytes or something
-      gz._eof = true
-    end
+  local outbuf = read_chunk(gz)
+  while outbuf do
     buflen = buflen + #outbuf
     buffer[#buffer+1] = outbuf
+    outbuf = read_chunk(gz)
   end
-  --if buflen == 0 then
-  --  return nil
-  --end
   gz._pos = gz._pos + buflen
   return concat(buffer)
 end
@@ -234,30 +355,23 @@ end
 --[[Read up to ''size'' bytes from a gzfile.
   ]]
 local function read_bytes(gz, size)
+  trim_buffer(gz)
   if gz._eof and #gz._buffer == 0 then
     return nil
   end
   if size <= 0 then
     return ""
   end
-  local handle, process = gz._handle, gz._process
   local buffer = {}
   local outbuf = gz._buffer
   local buflen = #outbuf
-  while buflen < size and not gz._eof do
-    buffer[#buffer+1] = outbuf
-    local inbuf = handle:read(1024)
-    if not inbuf then
-      gz._eof = true
+  while buflen < size do
+    local chunk = read_chunk(gz)
+    if not chunk then
       break
     end
-    local errmsg,errnum
-    outbuf,errmsg,errnum = process(inbuf)
-    assert(errnum>=0, errmsg, errnum)
-    if errnum == zlib.Z_STREAM_END then
-      -- FIXME should probably check the footer bytes or something
-      gz._eof = true
-    end
+    buffer[#buffer+1] = outbuf
+    outbuf = chunk
     buflen = buflen + #outbuf
   end
   if buflen == 0 then
@@ -294,30 +408,30 @@ function gz_reader:read(size)
   return read_bytes(self, tonumber(size))
 end
 
+--[[Standard file handle lines method.
+  ]]
+function gz_reader:lines()
+  assert(self._handle, "attempt to read from a closed file")
+  return linesiter(self, read_chunk)
+end
+
 --[[Skip ahead in the file.
     Basically the same as read_bytes but just 
     discards the bytes.
   ]]
 local function read_skip(gz, size)
+  trim_buffer(gz)
   if size <= 0 or (gz._eof and #gz._buffer == 0) then
     return gz._pos
   end
-  local handle, process = gz._handle, gz._process
   local outbuf = gz._buffer
   local bytesread = #outbuf
-  while bytesread < size and not gz._eof do
-    local inbuf = handle:read(1024)
-    if not inbuf then
-      gz._eof = true
+  while bytesread < size do
+    local chunk = read_chunk(gz)
+    if not chunk then
       break
     end
-    local errmsg,errnum
-    outbuf,errmsg,errnum = process(inbuf)
-    assert(errnum>=0, errmsg, errnum)
-    if errnum == zlib.Z_STREAM_END then
-      -- FIXME should probably check the footer bytes or something
-      gz._eof = true
-    end
+    outbuf = chunk
     bytesread = bytesread + #outbuf
   end
   -- pos is the offset from the end of the buffer
@@ -327,18 +441,64 @@ local function read_skip(gz, size)
   return gz._pos
 end
 
+--[[Resume decoding from a checkpoint. The checkpoint
+    is copied so it can be used again.
+  ]]
+local function restore_checkpoint(gz, cp)
+  assert(gz._handle:seek("set",cp.coffset), "file handle cannot seek backwards")
+  gz._clock = gz._clock + 1
+  cp.used = gz._clock
+  gz._eof = false
+  gz._pos = cp.upos
+  gz._buffer = ""
+  gz._offset = 0
+  gz._nextcheckpoint = cp.upos + checkpoint_interval
+  if gz._bgzf then
+    gz._bgzfpending = ""
+    gz._blocks = { cp.coffset, cp.upos }
+    gz._vseeked = false
+  else
+    gz._process = zlib.copy(cp.process)
+    gz._zout = cp.upos
+  end
+end
+
 --[[Rewind the file then skip to a new position.
+    Decoding starts from the closest checkpoint, or
+    from the start of the stream.
     Fails if the underlying file handle doesn't 
     support seeking.
   ]]
 local function read_rewind(gz, newpos)
+  local cp = find_checkpoint(gz, newpos)
+  if cp then
+    restore_checkpoint(gz, cp)
+    return read_skip(gz, newpos - cp.upos)
+  end
+  -- Stop the readahead before moving the file.
+  local readahead = gz._readahead
+  if readahead then
+    readahead:close()
+  end
   -- Return to the start of the compressed stream.
   assert(gz._zstreamstart and
       gz._handle:seek("set",gz._zstreamstart), "file handle cannot seek backwards")
   gz._eof = false
   gz._pos = 0
   gz._buffer = ""
+  gz._offset = 0
+  gz._nextcheckpoint = checkpoint_interval
+  if gz._bgzf then
+    gz._bgzfpending = ""
+    gz._blocks = { gz._zstreamstart, 0 }
+    gz._vseeked = false
+    return read_skip(gz, newpos)
+  end
   gz._process = zlib.decompressor{wbits=-15}
+  gz._zout = 0
+  if readahead then
+    gz._readahead = zlib.readahead(gz._handle, {wbits=-15, bufsize=gz._bufsize})
+  end
   return read_skip(gz, newpos)
 end
 
@@ -346,8 +506,11 @@ end
     for a gzfile in read mode.
     Seeking forward is possible by decompressing 
     and discarding bytes. To seek backward, the 
-    stream must be completely rewound and read from the 
-    beginning.
+    stream is rewound to the closest checkpoint and read
+    from there.
+    After vseek to a block outside the recently decoded
+    data, the position in the file is unknown and only
+    "set" can be used.
   ]]
 function gz_reader:seek(whence, newpos)
   whence = whence or "cur"
@@ -355,10 +518,24 @@ function gz_reader:seek(whence, newpos)
   if whence == "end" then
     error("cannot seek from end of a gzfile")
   end
+  if self._vseeked then
+    if whence ~= "set" then
+      return nil, "position is unknown after vseek"
+    end
+    return read_rewind(self, newpos)
+  end
   if whence == "set" then
     newpos = newpos - self._pos
   end
   if newpos > 0 then
+    -- Skip the decoding up to a checkpoint if there is one ahead.
+    local cp = find_checkpoint(self, self._pos + newpos)
+    local decoded = self._bgzf and self._blocks[#self._blocks] or self._zout
+    if cp and cp.upos > decoded then
+      newpos = self._pos + newpos
+      restore_checkpoint(self, cp)
+      return read_skip(self, newpos - cp.upos)
+    end
     return read_skip(self, newpos)
   elseif newpos < 0 then
     return read_rewind(self, self._pos + newpos)
@@ -367,10 +544,65 @@ function gz_reader:seek(whence, newpos)
   return self._pos
 end
 
+--[[Get the virtual offset of the read position
+    in a BGZF file.
+  ]]
+function gz_reader:vtell()
+  assert(self._handle, "attempt to read from a closed file")
+  assert(self._bgzf, "not a BGZF file")
+  local blocks,pos = self._blocks,self._pos
+  local i = #blocks - 1
+  while i > 1 and blocks[i+1] > pos do
+    i = i - 2
+  end
+  return blocks[i]*bgzf_voffset + pos - blocks[i+1]
+end
+
+--[[Move to a virtual offset in a BGZF file,
+    as returned by vtell.
+  ]]
+function gz_reader:vseek(voffset)
+  assert(self._handle, "attempt to read from a closed file")
+  assert(self._bgzf, "not a BGZF file")
+  local coffset = floor(voffset / bgzf_voffset)
+  local uoffset = voffset - coffset*bgzf_voffset
+  if not (self._handle.seek and self._handle:seek("set", coffset)) then
+    return nil, "file handle cannot seek"
+  end
+  -- The position is known if the block was read recently.
+  local blocks,ustart = self._blocks
+  for i=1,#blocks,2 do
+    if blocks[i] == coffset then
+      ustart = blocks[i+1]
+      break
+    end
+  end
+  if not ustart then
+    ustart = 0
+    self._vseeked = true
+  end
+  self._eof = false
+  self._pos = ustart
+  self._buffer = ""
+  self._offset = 0
+  self._bgzfpending = ""
+  self._blocks = { coffset, ustart }
+  read_skip(self, uoffset)
+  return self:vtell()
+end
+
 --[[Standard file handle close method
     for a gzfile in read mode.
   ]]
 function gz_reader:close()
+  if self._readahead then
+    self._readahead:close()
+    self._readahead = nil
+  end
+  if self._pool then
+    self._pool:close()
+    self._pool = nil
+  end
   if self._ownhandle then
     self._handle:close()
     self._ownhandle = nil
@@ -379,15 +611,53 @@ function gz_reader:close()
   return true
 end
 
---[[Convert values to strings and write to
-    a gzfile.
+--[[Compress the buffered values into BGZF blocks
+    and write them to the file. Unless ''final'' is set,
+    the last partial block is kept in the buffer.
   ]]
-local function write_values(gz, val, ...)
-  if not val then
+local function write_blocks(gz, final)
+  local str = concat(gz._pending)
+  local len = #str
+  if not final then
+    len = len - len % bgzf_blocksize
+    if len == 0 then
+      gz._pending = { str }
+      return gz
+    end
+    gz._pending = { sub(str, len+1) }
+    gz._pendinglen = #str - len
+    str = sub(str, 1, len)
+  else
+    gz._pending = {}
+    gz._pendinglen = 0
+  end
+  local outbuf,errmsg,errnum = zlib.bgzf_compress(str, {level=gz._level, pool=gz._pool})
+  if not outbuf then
+    return nil,errmsg,errnum
+  end
+  local res,message = gz._handle:write(outbuf)
+  if not res then
+    return nil,message
+  end
+  gz._bgzfoffset = gz._bgzfoffset + #outbuf
+  return gz
+end
+
+--[[Pass the buffered values through the compressor
+    and write the result to the file. With ''sync'', the
+    compressor is flushed so all of it can be read back.
+  ]]
+local function write_pending(gz, final, sync)
+  if gz._pendinglen == 0 and not (sync and not gz._bgzf) then
     return gz
   end
-  val = tostring(val)
-  local outbuf,errmsg,errnum = gz._process(val)
+  if gz._bgzf then
+    return write_blocks(gz, final)
+  end
+  local str = concat(gz._pending)
+  gz._pending = {}
+  gz._pendinglen = 0
+  local outbuf,errmsg,errnum = gz._process(str, sync)
   if errnum < 0 then
     return nil,errmsg,errnum
   end
@@ -395,8 +665,29 @@ local function write_values(gz, val, ...)
   if not res then
     return nil,message
   end
-  gz._crc32 = zlib.crc32(gz._crc32, val)
+  gz._crc32 = zlib.crc32(gz._crc32, str)
+  return gz
+end
+
+--[[Convert values to strings and add them to the
+    write buffer. The buffer is compressed when it
+    holds at least ''_bufsize'' bytes.
+  ]]
+local function write_values(gz, val, ...)
+  if not val then
+    return gz
+  end
+  val = tostring(val)
+  local pending = gz._pending
+  pending[#pending+1] = val
+  gz._pendinglen = gz._pendinglen + #val
   gz._size = gz._size + #val
+  if gz._pendinglen >= gz._bufsize then
+    local res,errmsg,errnum = write_pending(gz)
+    if not res then
+      return nil,errmsg,errnum
+    end
+  end
   return write_values(gz, ...)
 end
 
@@ -407,66 +698,111 @@ function gz_writer:write(...)
   return write_values(self, ...)
 end
 
+--[[Standard flush method.
+    Compresses the buffered data with a sync flush and
+    flushes the file handle, so everything written so
+    far can be read from the file.
+  ]]
+function gz_writer:flush()
+  assert(self._handle, "attempt to write to a closed file")
+  local res,errmsg,errnum = write_pending(self, true, true)
+  if not res then
+    return nil,errmsg,errnum
+  end
+  if self._handle.flush then
+    self._handle:flush()
+  end
+  return self
+end
+
 --[[Standard file handle seek.
     Can only seek forward while writing a gzfile.
+    The gap is filled with zeros by the compressor and
+    the CRC is extended without building the zeros.
   ]]
 function gz_writer:seek(whence, newpos)
   whence = whence or "cur"
-  newpos = newpos or 0
+  newpos = floor(newpos or 0)
+  local res,errmsg,errnum = write_pending(self)
+  if not res then
+    return nil,errmsg,errnum
+  end
   if whence == "set" then
     newpos = newpos - self._size
   end
   assert(newpos>=0, "attempt to seek backwards while writing a gzfile")
-  if newpos > 1024 then
-    local str = strrep('\0', 1024)
-    local crc = zlib.crc32(nil, str)
-    while newpos >= 1024 do
-      local outbuf,errmsg,errnum = self._process(str)
-      if errnum < 0 then
-        return nil,errmsg,errnum
+  if self._bgzf then
+    -- BGZF blocks are filled with the zeros like any other data.
+    local zeros = strrep('\0', newpos < self._bufsize and newpos or self._bufsize)
+    while newpos > 0 do
+      if newpos < #zeros then
+        zeros = sub(zeros, 1, newpos)
       end
-      local res,message = self._handle:write(outbuf)
+      res,errmsg,errnum = write_values(self, zeros)
       if not res then
-        return nil,message
+        return nil,errmsg,errnum
       end
-      -- what a convenient function
-      self._crc32 = zlib.crc32_combine(self._crc32, crc, 1024)
-      self._size = self._size + 1024
-      newpos = newpos - 1024
+      newpos = newpos - #zeros
     end
-  end
-  if newpos > 0 then
-    local str = strrep('\0', newpos)
-    local outbuf,errmsg,errnum = self._process(str)
+  elseif newpos > 0 then
+    local outbuf
+    outbuf,errmsg,errnum = self._process(newpos)
     if errnum < 0 then
       return nil,errmsg,errnum
     end
-    local res,message = self._handle:write(outbuf)
+    local message
+    res,message = self._handle:write(outbuf)
     if not res then
       return nil,message
     end
-    self._crc32 = zlib.crc32(self._crc32, str)
+    self._crc32 = zlib.crc32_zeros(self._crc32, newpos)
     self._size = self._size + newpos
   end
   return self._size
 end
 
+--[[Get the virtual offset of the write position
+    in a BGZF file. The full blocks in the buffer are
+    written first.
+  ]]
+function gz_writer:vtell()
+  assert(self._handle, "attempt to write to a closed file")
+  assert(self._bgzf, "not a BGZF file")
+  local res,errmsg,errnum = write_pending(self)
+  if not res then
+    return nil,errmsg,errnum
+  end
+  return self._bgzfoffset*bgzf_voffset + self._pendinglen
+end
+
 --[[Standard close method
     for a gzfile in write mode.
+    A BGZF file ends with an empty block.
   ]]
 function gz_writer:close()
   if self._handle then
-    local outbuf,errmsg,errnum = self._process(nil)
-    if outbuf then
-      self._handle:write(outbuf)
+    local res,errmsg,errnum = write_pending(self, true)
+    if not res then
+      return nil,errmsg,errnum
+    end
+    if self._bgzf then
+      self._handle:write(zlib.bgzf_compress(""))
+      self._pool:close()
+      self._pool = nil
+    else
+      local outbuf
+      outbuf,errmsg,errnum = self._process(nil)
+      if outbuf then
+        self._handle:write(outbuf)
+      end
+      self._handle:write(numbertobytes(self._crc32,4), numbertobytes(self._size,4))
     end
-    self._handle:write(numbertobytes(self._crc32,4), numbertobytes(self._size,4))
     if self._ownhandle then
       self._handle:close()
       self._ownhandle = nil
     end
     self._handle = nil
-    if errnum < 0 then
+    if errnum and errnum < 0 then
       return nil, errmsg, errnum
     end
   end
@@ -493,10 +829,17 @@ local gz_write_mt = { __index=gz_writer, __newindex=gz_mt_newindex }
       filename - Name of the original file (optional)
       comment - Description of the file (optional)
       extra - Table with subfield data (optional)
+    A BGZF file is read a block at a time, on ''threads''
+    threads.
   ]]
-local function gzfile_open(handle, ownhandle)
-  local gz = { _handle=handle, _ownhandle=ownhandle }
+local function gzfile_open(handle, ownhandle, bufsize, pipelined, threads)
+  local gz = { _handle=handle, _ownhandle=ownhandle,
+      _bufsize=bufsize or choose_bufsize(handle) }
   gz._process = zlib.decompressor{wbits=-15}
+  local start
+  if handle.seek then
+    start = handle:seek("cur",0)
+  end
   local header,message = handle:read(10)
   if not header then
     return nil,message
@@ -506,9 +849,11 @@ local function gzfile_open(handle, ownhandle)
   end
   local fl,xf,os = strbyte(header, 4, 4), strbyte(header, 9, 10)
   local fa,fc,fx,fn,ft = unpackflags(fl, 5)
+  local xlen,extra
   if fx then -- extra field
-    local len = bytestonumber(handle:read(2))
-    gz.extra = readextrafields(handle:read(len))
+    xlen = handle:read(2)
+    extra = handle:read(bytestonumber(xlen))
+    gz.extra = readextrafields(extra)
   end
   if fn then -- file name
     gz.filename = readzstring(handle)
@@ -523,10 +868,28 @@ local function gzfile_open(handle, ownhandle)
   gz.os = os_code[os] or ("unknown ("..os..")")
   gz._buffer = ""
   gz._pos = 0
+  gz._offset = 0
   gz._eof = false
+  gz._zout = 0
+  gz._checkpoints = {}
+  gz._nextcheckpoint = checkpoint_interval
+  gz._clock = 0
   if handle.seek then -- Disregard if seeking isn't possible.
     gz._zstreamstart = handle:seek("cur",0)
   end
+  if fl == 4 and gz.extra.BC then
+    -- BGZF blocks are decompressed whole, from the header.
+    gz._bgzf = true
+    gz._threads = threads or (pipelined and bgzf_threads) or 1
+    gz._bufsize = max(gz._bufsize, gz._threads*bgzf_voffset)
+    gz._pool = zlib.bgzf_pool(gz._threads)
+    gz._bgzfpending = header .. xlen .. extra
+    gz._zstreamstart = start
+    gz._blocks = { start or 0, 0 }
+    gz._vseeked = false
+  elseif pipelined then
+    gz._readahead = zlib.readahead(handle, {wbits=-15, bufsize=gz._bufsize})
+  end
   return setmetatable(gz, gz_read_mt)
 end
 
@@ -534,10 +897,13 @@ end
     If ''ownhandle'' is set, then the file
     handle will be closed with the gzfile.
   ]]
-local function gzfile_create(handle, ownhandle, level, filename, comment)
+local function gzfile_create(handle, ownhandle, level, filename, comment, bufsize)
   local gz = {
     _handle=handle,
     _ownhandle=ownhandle,
+    _bufsize=bufsize or 65536,
+    _pending={},
+    _pendinglen=0,
     _size=0,
     _crc32=zlib.crc32(),
     filename=filename,
@@ -561,14 +927,32 @@ local function gzfile_create(handle, ownhandle, level, filename, comment)
   return setmetatable(gz, gz_write_mt)
 end
 
---[[Standard open function for gzfiles.
-    The mode is either "r" or "w" and may also 
-    have "b". (A gzfile is always in binary mode.)
-    When writing a gzfile, the ''level'' option
-    is a number in the range [1,9].
+--[[Create a BGZF file in write mode.
+    Blocks are compressed on ''threads'' threads,
+    a few at a time for each thread.
   ]]
-function open(file, mode, level)
-  mode = mode or "r"
+local function bgzf_create(handle, ownhandle, level, threads)
+  local gz = {
+    _handle=handle,
+    _ownhandle=ownhandle,
+    _bufsize=bgzf_blocksize*threads*4,
+    _pending={},
+    _pendinglen=0,
+    _size=0,
+    _bgzf=true,
+    _level=level,
+    _threads=threads,
+    _pool=zlib.bgzf_pool(threads),
+    _bgzfoffset=handle:seek("cur",0) or 0
+  }
+  return setmetatable(gz, gz_write_mt)
+end
+
+--[[Check the arguments of the open functions.
+    Returns the mode for the file handle, the compression
+    level when writing, and whether a read mode has "p".
+  ]]
+local function check_open(file, mode, level)
   do
     local tn = type(file)
     assert(tn=='string' or ((
@@ -576,26 +960,56 @@ function open(file, mode, level)
     assert(type(mode)=='string')
   end
   if match(mode,'^b?rb?') then
-    mode = "rb"
+    return "rb", nil, find(mode,'p',1,true) ~= nil
   elseif match(mode,'b?wb?') then
-    mode = "wb"
     level = tonumber(level) or 6
     assert(level>0 and level<=9, "invalid compression level")
-  else
-    error("invalid mode")
+    return "wb", level
   end
-  local handle, message, ownhandle
+  error("invalid mode")
+end
+
+--[[Open the file handle for a file name.
+  ]]
+local function open_handle(file, mode)
   if type(file)=='string' then
-    handle, message = iopen(file, mode)
+    local handle, message = iopen(file, mode)
     if not handle then
       return nil, message
     end
-    ownhandle = true
-  else
-    handle = file
+    return handle, true
+  end
+  return file
+end
+
+--[[Standard open function for gzfiles.
+    The mode is either "r" or "w" and may also 
+    have "b". (A gzfile is always in binary mode.)
+    When writing a gzfile, the ''level'' option
+    is a number in the range [1,9].
+    ''bufsize'' is the size of the chunks read from
+    the file. By default it is chosen from the size
+    of the file. When writing, up to ''bufsize'' bytes
+    are collected before they are compressed, or until
+    the flush method is called.
+    With "p" in the read mode, the file is decompressed
+    ahead in a background thread while it is being read.
+    This needs an io library file on a regular file;
+    other handles are read normally. A BGZF file is read with several
+    threads instead.
+  ]]
+function open(file, mode, level, bufsize)
+  mode = mode or "r"
+  bufsize = tonumber(bufsize)
+  assert(not bufsize or bufsize > 0, "invalid buffer size")
+  local pipelined
+  mode, level, pipelined = check_open(file, mode, level)
+  local handle, ownhandle = open_handle(file, mode)
+  if not handle then
+    return nil, ownhandle
   end
   if mode == "rb" then
-    return gzfile_open(handle, ownhandle)
+    return gzfile_open(handle, ownhandle, bufsize, pipelined)
   else
     local name
     if type(file)=='string' then
@@ -604,6 +1018,38 @@ function open(file, mode, level)
         name = sub(name, 1, -4)
       end
     end
-    return gzfile_create(handle, ownhandle, level, name)
+    return gzfile_create(handle, ownhandle, level, name, nil, bufsize)
+  end
+end
+
+--[[Open a BGZF file.
+    A BGZF file is a series of gzip members that each hold
+    up to 64 KB, so it can be read by any gzip reader, but
+    its blocks can also be compressed and decompressed in
+    parallel on ''threads'' threads, 4 by default.
+    The vtell method returns a virtual offset, which is the
+    offset of a block in the file times 65536 plus an offset
+    in its data, and vseek returns to a virtual offset in a
+    file opened for reading. Where Lua numbers are doubles,
+    offsets are exact up to 2^53, or 128 GB of compressed data.
+    A gzip file that is not BGZF can not be opened.
+  ]]
+function open_bgzf(file, mode, level, threads)
+  mode = mode or "r"
+  threads = tonumber(threads) or bgzf_threads
+  assert(threads>=1 and threads<=64, "invalid number of threads")
+  mode, level = check_open(file, mode, level)
+  local handle, ownhandle = open_handle(file, mode)
+  if not handle then
+    return nil, ownhandle
+  end
+  if mode == "rb" then
+    local gz, message = gzfile_open(handle, ownhandle, nil, false, threads)
+    if gz and not gz._bgzf then
+      gz:close()
+      return nil, "Not a BGZF file"
+    end
+    return gz, message
   end
+  return bgzf_create(handle, ownhandle, level, threads)
 end
@@ -32,6 +32,10 @@
 
 #define BZ2COMPRESS_MT  	"larc.bzip2.deflate"
 #define BZ2DECOMPRESS_MT	"larc.bzip2.inflate"
+#define LARC_READAHEAD_MT	"larc.bzip2.readahead"
+
+#include "readahead.h"
+#include "lines.h"
 
 /* Living dangerously. */
 typedef struct
@@ -59,6 +63,7 @@ typedef struct bzip2_userdata
 	int status;
 	int result;
 	int flush;
+	int blocksize, workfactor;	/* to start a new stream after a flush */
 } bz_userdata;
 
 static int compress_userdata_gc(lua_State *L)
@@ -112,12 +117,12 @@ static int compress_call(lua_State *L)
 {
 	bz_userdata *ud = (bz_userdata*)lua_touserdata(L, lua_upvalueindex(1));
 	size_t len;
-	const char *str = luaL_optlstring(L, 1, NULL, &len);
+	const char *str = larc_optbytes(L, 1, NULL, &len);
 	if (str != NULL)
 	{
 		ud->z.next_in = (char*)str;
 		ud->z.avail_in = len;
-		ud->flush = BZ_RUN;
+		ud->flush = lua_toboolean(L, 2) ? BZ_FINISH : BZ_RUN;
 	}
 	else
 	{
@@ -126,6 +131,13 @@ static int compress_call(lua_State *L)
 		ud->flush = BZ_FINISH;
 	}
 	compress_to_buffer(L, ud);
+	if (str != NULL && ud->status == BZ_STREAM_END)
+	{
+		/* Only the end of a stream is written out to the last bit,
+		   so a flush finishes the stream and starts another one. */
+		BZ2_bzCompressEnd(&ud->z);
+		ud->status = BZ2_bzCompressInit(&ud->z, ud->blocksize, 0, ud->workfactor);
+	}
 	lua_pushinteger(L, len - ud->z.avail_in);
 	lua_pushinteger(L, ud->status);
 	return 3;
@@ -142,7 +154,7 @@ static int larc_bzip2_compress(lua_State *L)
 	int blocksize = 6,
 		workfactor = 0;
 	size_t len;
-	const char *str = luaL_checklstring(L, 1, &len);
+	const char *str = larc_checkbytes(L, 1, &len);
 	bz_userdata ud;
 
 	if (lua_gettop(L) > 1)
@@ -193,6 +205,9 @@ static int larc_bzip2_compress(lua_State *L)
 
 /**
  * Create a compress function.
+ * With true after the string, the stream is finished and a
+ * new one started, so the output so far can be decompressed.
+ * The streams are read back as one by the bz2file reader.
  * options:
  *   blocksize=[1,9]
  *   workfactor=[0,250]
@@ -217,6 +232,8 @@ static int larc_bzip2_compressor(lua_State *L)
 	ud->z.bzalloc = NULL;
 	ud->z.bzfree = NULL;
 	ud->z.opaque = NULL;
+	ud->blocksize = blocksize;
+	ud->workfactor = workfactor;
 	
 	ud->status = BZ2_bzCompressInit(&ud->z, blocksize, 0, workfactor);
 	if (ud->status != BZ_OK)
@@ -267,7 +284,7 @@ static int decompress_call(lua_State *L)
 {
 	bz_userdata *ud = (bz_userdata*)lua_touserdata(L, lua_upvalueindex(1));
 	size_t len;
-	const char *str = luaL_optlstring(L, 1, NULL, &len);
+	const char *str = larc_optbytes(L, 1, NULL, &len);
 	if (len > 0)
 	{
 		ud->z.next_in = (char*)str;
@@ -292,7 +309,7 @@ static int decompress_call(lua_State *L)
 static int larc_bzip2_decompress(lua_State *L)
 {
 	size_t len;
-	const char *str = luaL_checklstring(L, 1, &len);
+	const char *str = larc_checkbytes(L, 1, &len);
 	bz_userdata ud;
 
 	ud.z.bzalloc = NULL;
@@ -364,6 +381,97 @@ static int larc_bzip2_decompressor(lua_State *L)
 	return 1;
 }
 
+/* A flushed file is a series of streams, read as one. Anything
+   after a stream that does not start another one is ignored. */
+static int readahead_decompress(larc_Readahead *ra, const char **in, size_t *inlen,
+		char **out, size_t *outlen)
+{
+	bz_stream *z = (bz_stream*)ra->stream;
+	int status;
+	if (z->state == NULL)
+	{
+		/* the last stream ended; is there another? */
+		if (**in != 'B')
+			return LARC_RA_END;
+		status = BZ2_bzDecompressInit(z, 0, USE_SMALL_DECOMPRESS);
+		if (status != BZ_OK)
+		{
+			ra->errmsg = bz2_error(status);
+			return status;
+		}
+	}
+	z->next_in = (char*)*in;
+	z->avail_in = *inlen;
+	z->next_out = *out;
+	z->avail_out = *outlen;
+	status = BZ2_bzDecompress(z);
+	*in = z->next_in;
+	*inlen = z->avail_in;
+	*out = z->next_out;
+	*outlen = z->avail_out;
+	if (status == BZ_OK)
+		return LARC_RA_OK;
+	if (status == BZ_STREAM_END)
+	{
+		BZ2_bzDecompressEnd(z);
+		return *inlen > 0 && **in != 'B' ? LARC_RA_END : LARC_RA_OK;
+	}
+	ra->errmsg = bz2_error(status);
+	return status;
+}
+
+static void readahead_decompressend(larc_Readahead *ra)
+{
+	BZ2_bzDecompressEnd((bz_stream*)ra->stream);
+}
+
+/**
+ * Decompress an io file in a background thread.
+ * Returns nil if the handle is not an io file on a regular
+ * file or threads are not available.
+ * options:
+ *   bufsize=number
+ */
+static int larc_bzip2_readahead(lua_State *L)
+{
+	int bufsize = 65536,
+		status;
+	larc_Readahead *ra;
+	bz_stream *z;
+	if (lua_gettop(L) > 1)
+	{
+		luaL_checktype(L, 2, LUA_TTABLE);
+		GETINTOPTION(2,bufsize);
+	}
+	if (bufsize <= 0)
+		return luaL_argerror(L, 2, "invalid buffer size");
+
+	ra = larc_readahead_new(L, 1, bufsize, sizeof(bz_stream));
+	if (ra == NULL)
+	{
+		lua_pushnil(L);
+		return 1;
+	}
+	z = (bz_stream*)ra->stream;
+	z->bzalloc = NULL;
+	z->bzfree = NULL;
+	z->opaque = NULL;
+	z->next_in = NULL;
+	z->avail_in = 0;
+	status = BZ2_bzDecompressInit(z, 0, USE_SMALL_DECOMPRESS);
+	if (status != BZ_OK)
+	{
+		lua_pushnil(L);
+		lua_pushstring(L, bz2_error(status));
+		lua_pushinteger(L, status);
+		return 3;
+	}
+	ra->decode = readahead_decompress;
+	ra->finish = readahead_decompressend;
+	larc_readahead_start(L, ra);
+	return 1;
+}
+
 #ifdef _WIN32
 #undef LUAMOD_API
 #define LUAMOD_API      __declspec(dllexport)
@@ -375,6 +483,10 @@ static const luaL_Reg larc_bzip2_Reg[] =
 	{"decompress", larc_bzip2_decompress},
 	{"compressor", larc_bzip2_compressor},
 	{"decompressor", larc_bzip2_decompressor},
+	{"readahead", larc_bzip2_readahead},
+	{"readline", larc_readline},
+	{"lines", larc_lines},
+	{"bufsize", larc_bufsize},
 	{NULL, NULL}
 };
 
@@ -388,6 +500,7 @@ LUAMOD_API int luaopen_larc_bzip2(lua_State *L)
 	lua_pushcfunction(L, decompress_userdata_gc);
 	lua_setfield(L, -2, "__gc");
 	lua_pop(L, 1);
+	larc_readahead_register(L);
 	luaL_register(L, "larc.bzip2", larc_bzip2_Reg);
 	lua_pushstring(L, BZ2_bzlibVersion());
 	lua_setfield(L, -2, "BZLIB_VERSION");
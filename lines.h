@@ -0,0 +1,184 @@
+/*****************************************************************************
+ * LArc library
+ * Copyright (C) 2010 Tom N Harris. All rights reserved.
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty.  In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *  1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *  3. This notice may not be removed or altered from any source distribution.
+ *  4. Neither the names of the authors nor the names of any of the software
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ */
+
+/* Lines of the compressed file objects.
+
+   The gzfile, bz2file and lzmafile readers keep decoded data in a
+   Lua table, and each codec module registers readline, lines and
+   bufsize from this file to split it into lines and to size the
+   chunks read from the file. */
+
+#include <string.h>
+
+/* Add n to the integer in field k of the table at t. */
+static void lines_addfield(lua_State *L, int t, const char *k, size_t n)
+{
+	lua_pushstring(L, k);
+	lua_pushstring(L, k);
+	lua_rawget(L, t);
+	lua_pushinteger(L, lua_tointeger(L, -1) + (lua_Integer)n);
+	lua_remove(L, -2);
+	lua_rawset(L, t);
+}
+
+static void lines_storebuffer(lua_State *L, int t, int b, size_t off)
+{
+	lua_pushliteral(L, "_buffer");
+	lua_pushvalue(L, b);
+	lua_rawset(L, t);
+	lua_pushliteral(L, "_offset");
+	lua_pushinteger(L, off);
+	lua_rawset(L, t);
+}
+
+/* Read a line from the file object at t. The object keeps decoded
+   data in _buffer, of which the first _offset bytes were read, and
+   counts the bytes read in _pos. fill(t) returns more decoded data,
+   or nil at the end of the file. */
+static int lines_read(lua_State *L, int t, int fill)
+{
+	size_t len, off;
+	int b;
+	lua_pushliteral(L, "_offset");
+	lua_rawget(L, t);
+	off = (size_t)lua_tointeger(L, -1);
+	lua_pushliteral(L, "_buffer");
+	lua_rawget(L, t);
+	b = lua_gettop(L);
+	for (;;)
+	{
+		const char *buf = luaL_checklstring(L, b, &len);
+		const char *nl;
+		if (off > len)
+			off = len;
+		nl = (const char*)memchr(buf + off, '\n', len - off);
+		if (nl != NULL)
+		{
+			size_t n = nl - (buf + off);
+			lua_pushlstring(L, buf + off, n);
+			lua_pushliteral(L, "_offset");
+			lua_pushinteger(L, off + n + 1);
+			lua_rawset(L, t);
+			lines_addfield(L, t, "_pos", n + 1);
+			return 1;
+		}
+		lua_pushvalue(L, fill);
+		lua_pushvalue(L, t);
+		lua_call(L, 1, 1);
+		if (lua_isnil(L, -1))
+		{
+			/* the last line has no newline */
+			lua_pushliteral(L, "");
+			lua_replace(L, -2);
+			lines_storebuffer(L, t, lua_gettop(L), 0);
+			if (off == len)
+				return 0;
+			lua_pushlstring(L, buf + off, len - off);
+			lines_addfield(L, t, "_pos", len - off);
+			return 1;
+		}
+		lua_pushlstring(L, buf + off, len - off);
+		lua_insert(L, -2);
+		lua_concat(L, 2);
+		lua_replace(L, b);
+		off = 0;
+		lines_storebuffer(L, t, b, 0);
+	}
+}
+
+/**
+ * Read a line from a decoded file object.
+ * readline(t, fill)
+ */
+static int larc_readline(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	luaL_checkany(L, 2);
+	lua_settop(L, 2);
+	if (lines_read(L, 1, 2) == 0)
+		lua_pushnil(L);
+	return 1;
+}
+
+static int lines_iter(lua_State *L)
+{
+	return lines_read(L, lua_upvalueindex(1), lua_upvalueindex(2));
+}
+
+/**
+ * Iterate over the lines of a decoded file object.
+ * lines(t, fill)
+ */
+static int larc_lines(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	luaL_checkany(L, 2);
+	lua_settop(L, 2);
+	lua_pushcclosure(L, lines_iter, 2);
+	return 1;
+}
+
+/* Call handle:seek(whence, offset) for the handle at 1.
+   Returns 0 if it fails. */
+static int lines_seek(lua_State *L, const char *whence, lua_Number offset,
+		lua_Number *pos)
+{
+	int ok;
+	lua_getfield(L, 1, "seek");
+	lua_pushvalue(L, 1);
+	lua_pushstring(L, whence);
+	lua_pushnumber(L, offset);
+	ok = lua_pcall(L, 3, 1, 0) == 0 && lua_isnumber(L, -1);
+	if (ok)
+		*pos = lua_tonumber(L, -1);
+	lua_pop(L, 1);
+	return ok;
+}
+
+/**
+ * The size of the chunks to read from a compressed file.
+ * Reading about an eighth of the rest of the file at a time,
+ * within [16 KB, 1 MB], keeps the number of decoder calls low
+ * without holding a large file in memory. 64 KB if the handle
+ * cannot seek.
+ * bufsize(handle)
+ */
+static int larc_bufsize(lua_State *L)
+{
+	lua_Number cur, len, pos;
+	lua_Integer size = 16384;
+	luaL_checkany(L, 1);
+	lua_settop(L, 1);
+	if (!lines_seek(L, "cur", 0, &cur) || !lines_seek(L, "end", 0, &len))
+	{
+		lua_pushinteger(L, 65536);
+		return 1;
+	}
+	lines_seek(L, "set", cur, &pos);
+	len -= cur;
+	while (size < 1048576 && size * 8 < len)
+		size *= 2;
+	lua_pushinteger(L, size);
+	return 1;
+}
@@ -39,6 +39,7 @@ filter:del(0)
 */
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 #include "lua.h"
 #include "lauxlib.h"
@@ -46,12 +47,25 @@ filter:del(0)
 #include "lzma.h"
 #include "shared.h"
 
+/* #define NO_CLMUL */
+
+#if !defined(NO_CLMUL) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_CLMUL
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#endif
+
 #define UINT64TYPE	"large integer"
 
 #define LZMA_MT	"larc.lzma.stream"
 #define LZMAFILTER_LZMA_MT	"larc.lzma.lzmafilter"
 #define LZMAFILTER_DELTA_MT	"larc.lzma.deltafilter"
 #define LZMAFILTER_BCJ_MT	"larc.lzma.bcjfilter"
+#define LZMAINDEX_MT	"larc.lzma.index"
+#define LARC_READAHEAD_MT	"larc.lzma.readahead"
+
+#include "readahead.h"
+#include "lines.h"
 
 static void newuint64 (lua_State *L, uint64_t i) {
   uint64_t *li = (uint64_t*)lua_newuserdata(L, sizeof(uint64_t));
@@ -62,6 +76,19 @@ static void newuint64 (lua_State *L, uint64_t i) {
   lua_setmetatable(L, -2);
 }
 
+/* Push as a number if it fits the precision used by the struct module. */
+static void pushuint64 (lua_State *L, uint64_t i) {
+#ifdef LARC_NATIVE_INTEGER
+  if (i <= (uint64_t)LUA_MAXINTEGER)
+    lua_pushinteger(L, (lua_Integer)i);
+#else
+  if (i < (1ULL<<48))
+    lua_pushnumber(L, (lua_Number)i);
+#endif
+  else
+    newuint64(L, i);
+}
+
 static uint64_t getuint64 (lua_State *L, int i) {
   uint64_t li;
   if (lua_isnoneornil(L, i))
@@ -76,6 +103,10 @@ static uint64_t getuint64 (lua_State *L, int i) {
       return li;
     }
     case LUA_TNUMBER:
+#ifdef LARC_NATIVE_INTEGER
+      if (lua_isinteger(L, i))
+        return (uint64_t)lua_tointeger(L, i);
+#endif
       li = luaL_checknumber(L, i);
       return li;
     case LUA_TUSERDATA:
@@ -123,6 +154,7 @@ typedef struct lzma_userdata
 	int status;
 	int result;
 	lzma_action flush;
+	int syncflush;	/* the encoder supports LZMA_SYNC_FLUSH */
 } z_userdata;
 
 typedef struct lzmafilter_userdata
@@ -134,6 +166,7 @@ typedef struct lzmafilter_userdata
 		lzma_options_delta delta;
 		lzma_options_bcj bcj;
 	} options;
+	int dictref; /* keeps the preset dictionary string alive */
 } filter_userdata;
 
 static filter_userdata * new_lzmafilter(lua_State *L, lzma_vli id, const char * mt)
@@ -145,6 +178,7 @@ static filter_userdata * new_lzmafilter(lua_State *L, lzma_vli id, const char *
 	ud->head.id = id;
 	ud->head.options = &ud->options;
 	ud->end = LZMA_VLI_UNKNOWN;
+	ud->dictref = LUA_NOREF;
 	return ud;
 }
 
@@ -243,6 +277,37 @@ static int lzmafilter_option(lua_State *L, int argt, const char *opt, const char
 	return ret;
 }
 
+/**
+ * Set the preset dictionary of an lzma filter from the string at index n.
+ * A reference to the string is held until the dictionary is replaced
+ * or the filter is collected. nil or an empty string removes the dictionary.
+ */
+static void lzmafilter_setdict(lua_State *L, filter_userdata *filter, int n, int argt)
+{
+	size_t len = 0;
+	const char *str = NULL;
+	n = (n < 0) ? lua_gettop(L) + n + 1 : n;
+	if (!lua_isnil(L, n))
+	{
+		if (lua_type(L, n) != LUA_TSTRING)
+			luaL_argerror(L, argt, "invalid filter option");
+		str = lua_tolstring(L, n, &len);
+		if (len > UINT32_MAX)
+			luaL_argerror(L, argt, "dictionary is too large");
+	}
+	luaL_unref(L, LUA_REGISTRYINDEX, filter->dictref);
+	filter->dictref = LUA_NOREF;
+	filter->options.lzma.preset_dict = NULL;
+	filter->options.lzma.preset_dict_size = 0;
+	if (len > 0)
+	{
+		lua_pushvalue(L, n);
+		filter->dictref = luaL_ref(L, LUA_REGISTRYINDEX);
+		filter->options.lzma.preset_dict = (const uint8_t*)str;
+		filter->options.lzma.preset_dict_size = len;
+	}
+}
+
 static const char * const lzmamode_opts[] = { "normal","fast",NULL };
 static const lzma_mode lzmamode_ids[] = { LZMA_MODE_NORMAL,LZMA_MODE_FAST };
 static const char * const matchfinder_opts[] = { "bt4","bt3","bt2","hc4","hc3",NULL };
@@ -250,6 +315,12 @@ static const lzma_match_finder matchfinder_ids[] = { LZMA_MF_BT4,LZMA_MF_BT3,LZM
 
 /**
  * Create a filter.
+ * lzma1/lzma2 options:
+ *   preset=[0,9]
+ *   mode=normal|fast
+ *   mf=bt4|bt3|bt2|hc4|hc3
+ *   dict_size,lc,lp,pb,nice_len,depth
+ *   dictionary=string (preset dictionary, raw format only)
  */
 static int larc_lzmafilter_new(lua_State *L)
 {
@@ -304,6 +375,9 @@ static int larc_lzmafilter_new(lua_State *L)
 			filter->options.lzma.pb = lzmafilter_optint(L, 2, "pb", LZMA_PB_DEFAULT);
 			filter->options.lzma.nice_len = lzmafilter_optint(L, 2, "nice_len", 64);
 			filter->options.lzma.depth = lzmafilter_optint(L, 2, "depth", 0);
+			lua_getfield(L, 2, "dictionary");
+			lzmafilter_setdict(L, filter, -1, 2);
+			lua_pop(L, 1);
 		}
 		break;
 	case 3:
@@ -387,6 +461,8 @@ static int lzmafilter_lzma_newindex(lua_State *L)
 		filter->options.lzma.mode = lzmamode_ids[luaL_checkoption(L, 3, NULL, lzmamode_opts)];
 	else if (0 == strcmp(str, "mf"))
 		filter->options.lzma.mf = matchfinder_ids[luaL_checkoption(L, 3, NULL, matchfinder_opts)];
+	else if (0 == strcmp(str, "dictionary"))
+		lzmafilter_setdict(L, filter, 3, 3);
 	else
 		return luaL_error(L, "\"%s\" is not a valid option for this filter", str);
 	return 0;
@@ -430,11 +506,21 @@ static int lzmafilter_lzma_index(lua_State *L)
 		case LZMA_MF_HC4:
 			lua_pushliteral(L, "hc4"); break;
 		}
+	else if (0 == strcmp(str, "dictionary"))
+		lua_rawgeti(L, LUA_REGISTRYINDEX, filter->dictref);
 	else
 		lua_pushnil(L);
 	return 1;
 }
 
+static int lzmafilter_lzma_gc(lua_State *L)
+{
+	filter_userdata *filter = get_lzmafilter(L, 1);
+	luaL_unref(L, LUA_REGISTRYINDEX, filter->dictref);
+	filter->dictref = LUA_NOREF;
+	return 0;
+}
+
 static int lzmafilter_delta_newindex(lua_State *L)
 {
 	filter_userdata *filter = get_lzmafilter(L, 1);
@@ -487,7 +573,7 @@ static int check_has_filters(lua_State *L, int n)
 	lua_getfield(L, n, "filter");
 	if (!lua_isnil(L, -1))
 	{
-		if (lua_objlen(L, -1) > 4)
+		if (lua_istable(L, -1) && lua_objlen(L, -1) > LZMA_FILTERS_MAX)
 			luaL_error(L, "too many filters");
 		hasfilters = 1;
 	}
@@ -515,9 +601,11 @@ static int encode_to_buffer(lua_State *L, z_userdata *ud)
 			break;
 		luaL_addsize(&B, LUAL_BUFFERSIZE - ud->z.avail_out);
 	}
-	while (ud->z.avail_out == 0);
+	while (ud->z.avail_out == 0 || (ud->flush == LZMA_SYNC_FLUSH && ud->status == LZMA_OK));
 	if ((ud->status == LZMA_OK || ud->status == LZMA_STREAM_END) && ud->z.avail_in != 0)
 		return luaL_error(L, "unknown failure in encode");
+	if (ud->flush == LZMA_SYNC_FLUSH && ud->status == LZMA_STREAM_END)
+		ud->status = LZMA_OK;	/* the flush is done, not the stream */
 	luaL_pushresult(&B);
 	return 1;
 }
@@ -534,13 +622,13 @@ static int encode_call(lua_State *L)
 {
 	z_userdata *ud = (z_userdata*)lua_touserdata(L, lua_upvalueindex(1));
 	size_t len;
-	const char *str = luaL_optlstring(L, 1, NULL, &len);
+	const char *str = larc_optbytes(L, 1, NULL, &len);
 	
 	if (str != NULL)
 	{
 		ud->z.next_in = (uint8_t*)str;
 		ud->z.avail_in = len;
-		ud->flush = LZMA_RUN;
+		ud->flush = (lua_toboolean(L, 2) && ud->syncflush) ? LZMA_SYNC_FLUSH : LZMA_RUN;
 	}
 	else
 	{
@@ -555,12 +643,14 @@ static int encode_call(lua_State *L)
 	return 3;
 }
 
-static lzma_ret encoder_init_filters(lua_State *L, lzma_stream *stream,
-				int format, lzma_check check)
+/**
+ * Copy the filter or table of filters at the top of the stack
+ * into a filter chain. The chain is only valid while the
+ * filter objects are on the stack.
+ */
+static size_t get_filters(lua_State *L, lzma_filter *filter)
 {
-	lzma_filter filter[LZMA_FILTERS_MAX+1];
 	filter_userdata *fdata;
-	lzma_ret status;
 	size_t numfilters;
 	size_t i;
 	
@@ -583,6 +673,16 @@ static lzma_ret encoder_init_filters(lua_State *L, lzma_stream *stream,
 		filter[1].id = LZMA_VLI_UNKNOWN;
 		numfilters = 1;
 	}
+	return numfilters;
+}
+
+static lzma_ret encoder_init_filters(lua_State *L, lzma_stream *stream,
+				int format, lzma_check check)
+{
+	lzma_filter filter[LZMA_FILTERS_MAX+1];
+	lzma_ret status = LZMA_PROG_ERROR;
+	
+	get_filters(L, filter);
 	switch (format)
 	{
 	case 0: /* lzma */
@@ -599,19 +699,186 @@ static lzma_ret encoder_init_filters(lua_State *L, lzma_stream *stream,
 	return status;
 }
 
+#define SNIFF_SAMPLE	65536
+
+static unsigned int sniff_get16(const uint8_t *p, int big)
+{
+	return big ? (p[0]<<8)|p[1] : p[0]|(p[1]<<8);
+}
+
+static uint32_t sniff_get32(const uint8_t *p, int big)
+{
+	return big ? ((uint32_t)p[0]<<24)|((uint32_t)p[1]<<16)|(p[2]<<8)|p[3]
+	           : p[0]|(p[1]<<8)|((uint32_t)p[2]<<16)|((uint32_t)p[3]<<24);
+}
+
+/**
+ * Pick a BCJ filter from an ELF, PE, or Mach-O header.
+ */
+static lzma_vli sniff_executable(const uint8_t *buf, size_t len)
+{
+	if (len >= 20 && 0 == memcmp(buf, "\x7F" "ELF", 4))
+	{
+		int big = buf[5] == 2;
+		switch (sniff_get16(buf+18, big))
+		{
+		case 3: case 62: /* i386, x86-64 */
+			return LZMA_FILTER_X86;
+		case 40: /* arm */
+			return LZMA_FILTER_ARM;
+		case 50: /* ia64 */
+			return LZMA_FILTER_IA64;
+		case 20: case 21: /* ppc, ppc64 */
+			return big ? LZMA_FILTER_POWERPC : LZMA_VLI_UNKNOWN;
+		case 2: case 18: case 43: /* sparc, sparc32plus, sparcv9 */
+			return LZMA_FILTER_SPARC;
+#ifdef LZMA_FILTER_ARM64
+		case 183: /* aarch64 */
+			return LZMA_FILTER_ARM64;
+#endif
+		}
+		return LZMA_VLI_UNKNOWN;
+	}
+	if (len >= 64 && buf[0] == 'M' && buf[1] == 'Z')
+	{
+		uint32_t pe = sniff_get32(buf+0x3C, 0);
+		if (pe > len - 6 || 0 != memcmp(buf+pe, "PE\0\0", 4))
+			return LZMA_VLI_UNKNOWN;
+		switch (sniff_get16(buf+pe+4, 0))
+		{
+		case 0x014C: case 0x8664: /* i386, amd64 */
+			return LZMA_FILTER_X86;
+		case 0x01C0: /* arm */
+			return LZMA_FILTER_ARM;
+		case 0x01C2: case 0x01C4: /* thumb, armnt */
+			return LZMA_FILTER_ARMTHUMB;
+		case 0x0200: /* ia64 */
+			return LZMA_FILTER_IA64;
+#ifdef LZMA_FILTER_ARM64
+		case 0xAA64: /* arm64 */
+			return LZMA_FILTER_ARM64;
+#endif
+		}
+		return LZMA_VLI_UNKNOWN;
+	}
+	if (len >= 8)
+	{
+		uint32_t magic = sniff_get32(buf, 0);
+		int big;
+		if (magic == 0xFEEDFACEUL || magic == 0xFEEDFACFUL)
+			big = 0;
+		else if (magic == 0xCEFAEDFEUL || magic == 0xCFFAEDFEUL)
+			big = 1;
+		else
+			return LZMA_VLI_UNKNOWN;
+		switch (sniff_get32(buf+4, big))
+		{
+		case 7: case 0x01000007UL: /* i386, x86-64 */
+			return LZMA_FILTER_X86;
+		case 12: /* arm */
+			return LZMA_FILTER_ARM;
+		case 18: case 0x01000012UL: /* ppc, ppc64 */
+			return big ? LZMA_FILTER_POWERPC : LZMA_VLI_UNKNOWN;
+#ifdef LZMA_FILTER_ARM64
+		case 0x0100000CUL: /* arm64 */
+			return LZMA_FILTER_ARM64;
+#endif
+		}
+	}
+	return LZMA_VLI_UNKNOWN;
+}
+
+/**
+ * Order-0 entropy, in bits per byte, of a sample after
+ * subtracting the byte ''dist'' positions earlier.
+ */
+static double sniff_entropy(const uint8_t *buf, size_t len, size_t dist)
+{
+	size_t counts[256];
+	size_t i;
+	double e = 0;
+	memset(counts, 0, sizeof(counts));
+	for (i=dist; i<len; i++)
+		counts[(uint8_t)(buf[i] - (dist ? buf[i-dist] : 0))]++;
+	len -= dist;
+	for (i=0; i<256; i++)
+		if (counts[i])
+		{
+			double p = (double)counts[i] / len;
+			e -= p * log(p);
+		}
+	return e / log(2.0);
+}
+
+/**
+ * Look at a sample of the input and choose a filter to put
+ * in front of the compressor. Executables get the matching BCJ
+ * filter. Data with a regular stride, such as arrays of integers
+ * or samples, gets a delta filter if it makes the bytes noticeably
+ * more predictable. Returns LZMA_VLI_UNKNOWN if nothing fits.
+ */
+static lzma_vli sniff_filter(const uint8_t *buf, size_t len, lzma_options_delta *delta)
+{
+	static const size_t dists[] = { 1,2,3,4,6,8,12,16,0 };
+	lzma_vli id = sniff_executable(buf, len);
+	double raw, best;
+	size_t i, dist = 0;
+	if (id != LZMA_VLI_UNKNOWN || len < 1024)
+		return id;
+	if (len > SNIFF_SAMPLE)
+	{
+		buf += (len - SNIFF_SAMPLE) / 2;
+		len = SNIFF_SAMPLE;
+	}
+	raw = best = sniff_entropy(buf, len, 0);
+	for (i=0; dists[i]; i++)
+	{
+		double e = sniff_entropy(buf, len, dists[i]);
+		if (e < best)
+		{
+			best = e;
+			dist = dists[i];
+		}
+	}
+	if (dist == 0 || best > raw * 0.75)
+		return LZMA_VLI_UNKNOWN;
+	delta->type = LZMA_DELTA_TYPE_BYTE;
+	delta->dist = dist;
+	return LZMA_FILTER_DELTA;
+}
+
+/**
+ * Build a filter chain from a preset, optionally preceded by
+ * another filter.
+ */
+static lzma_ret preset_filters(lzma_filter *filter, lzma_options_lzma *options,
+				int preset, lzma_vli id, const lzma_filter *prefilter)
+{
+	size_t n = 0;
+	
+	if (lzma_lzma_preset(options, preset))
+		return LZMA_OPTIONS_ERROR;
+	
+	if (prefilter != NULL && prefilter->id != LZMA_VLI_UNKNOWN)
+		filter[n++] = *prefilter;
+	filter[n].id = id;
+	filter[n].options = options;
+	filter[n+1].id = LZMA_VLI_UNKNOWN;
+	return LZMA_OK;
+}
+
 static lzma_ret encoder_init(lua_State *L, lzma_stream *stream,
-				int format, int preset, lzma_vli id, lzma_check check)
+				int format, int preset, lzma_vli id, lzma_check check,
+				const lzma_filter *prefilter)
 {
 	lzma_filter filter[LZMA_FILTERS_MAX+1];
 	lzma_options_lzma options;
-	lzma_ret status = LZMA_PROG_ERROR;
-	
-	if (lzma_lzma_preset(&options, preset))
-		return LZMA_OPTIONS_ERROR;
+	lzma_ret status;
 	
-	filter[0].id = id;
-	filter[0].options = &options;
-	filter[1].id = LZMA_VLI_UNKNOWN;
+	status = preset_filters(filter, &options, preset, id, prefilter);
+	if (status != LZMA_OK)
+		return status;
+	status = LZMA_PROG_ERROR;
 	switch (format)
 	{
 	case 0: /* lzma */
@@ -627,6 +894,81 @@ static lzma_ret encoder_init(lua_State *L, lzma_stream *stream,
 	return status;
 }
 
+/* Output of the single-call coders. From 5.2 the coder writes into
+   the memory of a luaL_Buffer, which becomes the result string. 5.1
+   has no sized buffers, so the output is copied out of a userdata. */
+typedef struct out_buffer {
+#if LUA_VERSION_NUM > 501
+	luaL_Buffer b;
+#endif
+	uint8_t *data;
+} out_buffer;
+
+static void outbuffer_init(lua_State *L, out_buffer *out, size_t size)
+{
+#if LUA_VERSION_NUM > 501
+	out->data = (uint8_t*)luaL_buffinitsize(L, &out->b, size);
+#else
+	out->data = (uint8_t*)lua_newuserdata(L, size);
+#endif
+}
+
+/* Push the first len bytes of the output as a string. */
+static void outbuffer_push(lua_State *L, out_buffer *out, size_t len)
+{
+#if LUA_VERSION_NUM > 501
+	luaL_pushresultsize(&out->b, len);
+#else
+	lua_pushlstring(L, (const char*)out->data, len);
+	lua_replace(L, -2);
+#endif
+}
+
+/* Drop the output after a failed call. */
+static void outbuffer_discard(lua_State *L, out_buffer *out)
+{
+#if LUA_VERSION_NUM > 501
+	luaL_pushresultsize(&out->b, 0);
+#endif
+	lua_pop(L, 1);
+}
+
+/* Largest output buffer of the single-call coders. Bigger outputs,
+   and decoded sizes far above the input size, which can only be taken
+   from the stream index on trust, go through the streaming coders and
+   grow with the data instead. */
+#define BUFFER_CODE_MAX	(64*1024*1024)
+#define BUFFER_DECODE_RATIO	64
+
+/**
+ * Compress a whole string with one call into an output buffer
+ * sized from the worst case bound. Pushes the compressed string
+ * if successful. Returns LZMA_BUF_ERROR if the output did not fit,
+ * or the bound is too large to allocate up front, in which case
+ * the streaming encoder should be used instead.
+ */
+static lzma_ret buffer_encode(lua_State *L, lzma_filter *filter, int format,
+				lzma_check check, const uint8_t *in, size_t len)
+{
+	size_t bound = lzma_stream_buffer_bound(len);
+	size_t outpos = 0;
+	out_buffer out;
+	lzma_ret status;
+	
+	if (bound == 0 || bound > BUFFER_CODE_MAX)
+		return LZMA_BUF_ERROR;
+	outbuffer_init(L, &out, bound);
+	if (format == 1)
+		status = lzma_stream_buffer_encode(filter, check, NULL, in, len, out.data, &outpos, bound);
+	else
+		status = lzma_raw_buffer_encode(filter, NULL, in, len, out.data, &outpos, bound);
+	if (status == LZMA_OK)
+		outbuffer_push(L, &out, outpos);
+	else
+		outbuffer_discard(L, &out);
+	return status;
+}
+
 static const char * const format_opts[] = { "lzma","xz","raw",NULL };
 static const char * const method_opts[] = { "lzma1","lzma2",NULL };
 static const lzma_vli method_ids[] = { LZMA_FILTER_LZMA1,LZMA_FILTER_LZMA2 };
@@ -638,6 +980,7 @@ static const lzma_check check_ids[] = { LZMA_CHECK_NONE,LZMA_CHECK_CRC32,LZMA_CH
  * options:
  *   preset=[0,9]
  *   method=lzma1|lzma2
+ *   auto_filter=true (xz only, add a BCJ or delta filter based on the input)
  */
 static int larc_lzma_compress(lua_State *L)
 {
@@ -645,10 +988,13 @@ static int larc_lzma_compress(lua_State *L)
 		methid = 0,
 		format = 0,
 		crcid = 1,
-		hasfilters = 0;
+		hasfilters = 0,
+		autofilter = 0;
 	size_t len;
-	const char *str = luaL_checklstring(L, 1, &len);
+	const char *str = larc_checkbytes(L, 1, &len);
 	z_userdata ud = {LZMA_STREAM_INIT};
+	lzma_options_delta delta;
+	lzma_filter prefilter = { LZMA_VLI_UNKNOWN, NULL };
 
 	if (lua_gettop(L) > 1)
 	{
@@ -663,16 +1009,60 @@ static int larc_lzma_compress(lua_State *L)
 		lua_getfield(L, 2, "check");
 		crcid = luaL_checkoption(L, -1, "crc32", check_opts);
 		lua_pop(L, 1);
+		lua_getfield(L, 2, "auto_filter");
+		autofilter = lua_toboolean(L, -1);
+		lua_pop(L, 1);
 		hasfilters = check_has_filters(L, 2);
 	}
 	
+	if (autofilter && !hasfilters)
+	{
+		if (format != 1)
+			luaL_argerror(L, 2, "auto_filter requires the xz format");
+		prefilter.id = sniff_filter((const uint8_t*)str, len, &delta);
+		if (prefilter.id == LZMA_FILTER_DELTA)
+			prefilter.options = &delta;
+	}
+	
+	if (format != 0)
+	{
+		/* xz and raw can be done in one call */
+		lzma_filter filter[LZMA_FILTERS_MAX+1];
+		lzma_options_lzma options;
+		if (hasfilters)
+		{
+			lua_getfield(L, 2, "filter");
+			get_filters(L, filter);
+			ud.status = LZMA_OK;
+		}
+		else
+			ud.status = preset_filters(filter, &options, preset, method_ids[methid], &prefilter);
+		if (ud.status == LZMA_OK)
+			ud.status = buffer_encode(L, filter, format, check_ids[crcid], (const uint8_t*)str, len);
+		if (ud.status == LZMA_OK)
+		{
+			lua_pushinteger(L, len);
+			lua_pushinteger(L, status_to_errcode[LZMA_STREAM_END]);
+			return 3;
+		}
+		if (ud.status != LZMA_BUF_ERROR)
+		{
+			lua_pushnil(L);
+			lua_pushstring(L, status_to_string[ud.status]);
+			lua_pushinteger(L, status_to_errcode[ud.status]);
+			return 3;
+		}
+		if (hasfilters)
+			lua_pop(L, 1);
+	}
+	
 	if (hasfilters)
 	{
 		lua_getfield(L, 2, "filter");
 		ud.status = encoder_init_filters(L, &ud.z, format, check_ids[crcid]);
 	}
 	else
-		ud.status = encoder_init(L, &ud.z, format, preset, method_ids[methid], check_ids[crcid]);
+		ud.status = encoder_init(L, &ud.z, format, preset, method_ids[methid], check_ids[crcid], &prefilter);
 	if (ud.status != LZMA_OK)
 	{
 		lua_pushnil(L);
@@ -709,6 +1099,8 @@ static int larc_lzma_compress(lua_State *L)
 
 /**
  * Create a compress function.
+ * With true after the string, the output is flushed so it
+ * can all be decoded, except in the lzma format or with LZMA1.
  * options:
  *   preset=[0,9]
  */
@@ -741,8 +1133,16 @@ static int larc_lzma_compressor(lua_State *L)
 	luaL_getmetatable(L, LZMA_MT);
 	lua_setmetatable(L, -2);
 	memset(&ud->z, 0, sizeof(lzma_stream));
+	/* LZMA1 has no sync flush, so .lzma files can not be flushed */
+	ud->syncflush = format == 1 || (format == 2 && !hasfilters && methid == 1);
 	
-	ud->status = encoder_init(L, &ud->z, format, preset, method_ids[methid], check_ids[crcid]);
+	if (hasfilters)
+	{
+		lua_getfield(L, 1, "filter");
+		ud->status = encoder_init_filters(L, &ud->z, format, check_ids[crcid]);
+	}
+	else
+		ud->status = encoder_init(L, &ud->z, format, preset, method_ids[methid], check_ids[crcid], NULL);
 	if (ud->status != LZMA_OK)
 	{
 		lua_pushnil(L);
@@ -787,7 +1187,7 @@ static int decode_call(lua_State *L)
 {
 	z_userdata *ud = (z_userdata*)lua_touserdata(L, lua_upvalueindex(1));
 	size_t len;
-	const char *str = luaL_optlstring(L, 1, NULL, &len);
+	const char *str = larc_optbytes(L, 1, NULL, &len);
 	
 	if (len > 0)
 	{
@@ -810,58 +1210,109 @@ static int decode_call(lua_State *L)
 static lzma_ret decoder_init_filters(lua_State *L, lzma_stream *stream)
 {
 	lzma_filter filter[LZMA_FILTERS_MAX+1];
-	filter_userdata *fdata;
 	lzma_ret status;
-	size_t numfilters;
-	size_t i;
 	
-	if (lua_istable(L, -1))
-	{
-		numfilters = lua_objlen(L, -1);
-		for (i=0; i<numfilters; i++)
-		{
-			lua_rawgeti(L, -1, i+1);
-			fdata = get_lzmafilter(L, -1);
-			filter[i] = fdata->head;
-			lua_pop(L, 1);
-		}
-		filter[numfilters].id = LZMA_VLI_UNKNOWN;
-	}
-	else
-	{
-		fdata = get_lzmafilter(L, -1);
-		filter[0] = fdata->head;
-		filter[1].id = LZMA_VLI_UNKNOWN;
-		numfilters = 1;
-	}
+	get_filters(L, filter);
 	status = lzma_raw_decoder(stream, filter);
 	lua_pop(L, 1);
 	return status;
 }
 
+static uint64_t decoder_memlimit(void)
+{
+	uint64_t mem = lzma_physmem() / 2;
+	if (mem == 0) /* make a guess */
+		mem = 32ULL * 1024 * 1024;
+	return mem;
+}
+
 static lzma_ret decoder_init(lua_State *L, lzma_stream *stream, int format, lzma_vli id)
 {
-	uint64_t mem;
 	lzma_ret status = LZMA_PROG_ERROR;
 	
 	switch (format)
 	{
 	case 0: /* lzma */
-		mem = lzma_physmem() / 2;
-		if (mem == 0) /* make a guess */
-			mem = 32ULL * 1024 * 1024;
-		status = lzma_alone_decoder(stream, mem);
+		status = lzma_alone_decoder(stream, decoder_memlimit());
 		break;
 	case 1: /* xz */
-		mem = lzma_physmem() / 2;
-		if (mem == 0) /* make a guess */
-			mem = 32ULL * 1024 * 1024;
-		status = lzma_stream_decoder(stream, mem, 0);
+		status = lzma_stream_decoder(stream, decoder_memlimit(), 0);
 		break;
 	}
 	return status;
 }
 
+/**
+ * Decode the index of the last xz stream in a buffer.
+ * Trailing stream padding is skipped and ''end'' is set
+ * to the offset just past the stream footer.
+ */
+static lzma_ret xz_decode_index(const uint8_t *in, size_t len,
+				lzma_index **idx, size_t *end)
+{
+	lzma_stream_flags footer;
+	uint64_t mem = decoder_memlimit();
+	size_t pos;
+	lzma_ret status;
+	
+	while (len >= 4 && 0 == memcmp(in+len-4, "\0\0\0\0", 4))
+		len -= 4;
+	if (len < 2*LZMA_STREAM_HEADER_SIZE)
+		return LZMA_FORMAT_ERROR;
+	status = lzma_stream_footer_decode(&footer, in+len-LZMA_STREAM_HEADER_SIZE);
+	if (status != LZMA_OK)
+		return status;
+	if (footer.backward_size > len - 2*LZMA_STREAM_HEADER_SIZE)
+		return LZMA_DATA_ERROR;
+	pos = len - LZMA_STREAM_HEADER_SIZE - footer.backward_size;
+	status = lzma_index_buffer_decode(idx, &mem, NULL, in, &pos, len-LZMA_STREAM_HEADER_SIZE);
+	if (status != LZMA_OK)
+		return status;
+	status = lzma_index_stream_flags(*idx, &footer);
+	if (status != LZMA_OK)
+	{
+		lzma_index_end(*idx, NULL);
+		return status;
+	}
+	*end = len;
+	return LZMA_OK;
+}
+
+/**
+ * Decompress a single xz stream with one call. The output size is
+ * read from the stream index. Pushes the decompressed string if
+ * successful. Returns LZMA_BUF_ERROR if the size could not be
+ * determined or is too large to allocate up front, in which case
+ * the streaming decoder should be used.
+ */
+static lzma_ret buffer_decode(lua_State *L, const uint8_t *in, size_t len, size_t *inpos)
+{
+	lzma_index *idx;
+	lzma_vli outlen;
+	size_t end;
+	size_t outpos = 0;
+	uint64_t mem = decoder_memlimit();
+	out_buffer out;
+	lzma_ret status;
+	
+	if (LZMA_OK != xz_decode_index(in, len, &idx, &end))
+		return LZMA_BUF_ERROR;
+	outlen = lzma_index_uncompressed_size(idx);
+	status = (lzma_index_file_size(idx) == end && outlen <= BUFFER_CODE_MAX
+			&& outlen / BUFFER_DECODE_RATIO <= len) ? LZMA_OK : LZMA_BUF_ERROR;
+	lzma_index_end(idx, NULL);
+	if (status != LZMA_OK)
+		return status;
+	outbuffer_init(L, &out, outlen ? (size_t)outlen : 1);
+	*inpos = 0;
+	status = lzma_stream_buffer_decode(&mem, 0, NULL, in, inpos, len, out.data, &outpos, (size_t)outlen);
+	if (status == LZMA_OK)
+		outbuffer_push(L, &out, outpos);
+	else
+		outbuffer_discard(L, &out);
+	return status;
+}
+
 /**
  * Decompress a string.
  * Returns a string,number,number when successful.
@@ -875,7 +1326,7 @@ static int larc_lzma_decompress(lua_State *L)
 		format = 0,
 		hasfilters = 0;
 	size_t len;
-	const char *str = luaL_checklstring(L, 1, &len);
+	const char *str = larc_checkbytes(L, 1, &len);
 	z_userdata ud = {LZMA_STREAM_INIT};
 
 	if (lua_gettop(L) > 1)
@@ -890,6 +1341,26 @@ static int larc_lzma_decompress(lua_State *L)
 		hasfilters = check_has_filters(L, 2);
 	}
 	
+	if (format == 1)
+	{
+		/* a single xz stream can be done in one call */
+		size_t used;
+		ud.status = buffer_decode(L, (const uint8_t*)str, len, &used);
+		if (ud.status == LZMA_OK)
+		{
+			lua_pushinteger(L, used);
+			lua_pushinteger(L, status_to_errcode[LZMA_STREAM_END]);
+			return 3;
+		}
+		if (ud.status != LZMA_BUF_ERROR)
+		{
+			lua_pushnil(L);
+			lua_pushstring(L, status_to_string[ud.status]);
+			lua_pushinteger(L, status_to_errcode[ud.status]);
+			return 3;
+		}
+	}
+	
 	if (format == 2)
 	{
 		if (!hasfilters)
@@ -983,6 +1454,351 @@ static int larc_lzma_decompressor(lua_State *L)
 	return 1;
 }
 
+static int readahead_decode(larc_Readahead *ra, const char **in, size_t *inlen,
+		char **out, size_t *outlen)
+{
+	lzma_stream *z = (lzma_stream*)ra->stream;
+	lzma_ret status;
+	z->next_in = (const uint8_t*)*in;
+	z->avail_in = *inlen;
+	z->next_out = (uint8_t*)*out;
+	z->avail_out = *outlen;
+	status = lzma_code(z, LZMA_RUN);
+	*in = (const char*)z->next_in;
+	*inlen = z->avail_in;
+	*out = (char*)z->next_out;
+	*outlen = z->avail_out;
+	if (status == LZMA_STREAM_END)
+		return LARC_RA_END;
+	if (status_to_errcode[status] >= 0)
+		return LARC_RA_OK;
+	ra->errmsg = status_to_string[status];
+	return status_to_errcode[status];
+}
+
+static void readahead_decodeend(larc_Readahead *ra)
+{
+	lzma_end((lzma_stream*)ra->stream);
+}
+
+/**
+ * Decode an io file in a background thread.
+ * Returns nil if the handle is not an io file on a regular
+ * file or threads are not available.
+ * options:
+ *   format="lzma"|"xz"
+ *   bufsize=number
+ */
+static int larc_lzma_readahead(lua_State *L)
+{
+	int format = 0,
+		bufsize = 65536;
+	lzma_ret status;
+	larc_Readahead *ra;
+	if (lua_gettop(L) > 1)
+	{
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "format");
+		format = luaL_checkoption(L, -1, "lzma", format_opts);
+		lua_pop(L, 1);
+		GETINTOPTION(2,bufsize);
+	}
+	if (format == 2)
+		return luaL_argerror(L, 2, "raw format is not supported");
+	if (bufsize <= 0)
+		return luaL_argerror(L, 2, "invalid buffer size");
+
+	ra = larc_readahead_new(L, 1, bufsize, sizeof(lzma_stream));
+	if (ra == NULL)
+	{
+		lua_pushnil(L);
+		return 1;
+	}
+	status = decoder_init(L, (lzma_stream*)ra->stream, format, LZMA_FILTER_LZMA1);
+	if (status != LZMA_OK)
+	{
+		lua_pushnil(L);
+		lua_pushstring(L, status_to_string[status]);
+		lua_pushinteger(L, status_to_errcode[status]);
+		return 3;
+	}
+	ra->decode = readahead_decode;
+	ra->finish = readahead_decodeend;
+	larc_readahead_start(L, ra);
+	return 1;
+}
+
+typedef struct lzmaindex_userdata
+{
+	lzma_index *idx;
+	lzma_index *stream;	/* index of the stream being read, not yet joined */
+} index_userdata;
+
+static void lzmaindex_free(index_userdata *ud)
+{
+	if (ud->idx != NULL)
+		lzma_index_end(ud->idx, NULL);
+	if (ud->stream != NULL)
+		lzma_index_end(ud->stream, NULL);
+	ud->idx = NULL;
+	ud->stream = NULL;
+}
+
+static int lzmaindex_gc(lua_State *L)
+{
+	lzmaindex_free((index_userdata*)lua_touserdata(L, 1));
+	return 0;
+}
+
+static uint64_t list_seek(lua_State *L, int src, const char *whence, uint64_t offset)
+{
+	uint64_t pos;
+	lua_getfield(L, src, "seek");
+	lua_pushvalue(L, src);
+	lua_pushstring(L, whence);
+	lua_pushnumber(L, (lua_Number)offset);
+	lua_call(L, 3, 2);
+	if (lua_isnil(L, -2))
+		luaL_error(L, "%s", lua_isstring(L, -1) ? lua_tostring(L, -1) : "cannot seek in file");
+	pos = (uint64_t)lua_tonumber(L, -2);
+	lua_pop(L, 2);
+	return pos;
+}
+
+/**
+ * Push ''size'' bytes from ''offset'' of the string or file handle.
+ */
+static const uint8_t * list_read(lua_State *L, int src, const char *str, uint64_t len,
+				uint64_t offset, size_t size)
+{
+	const char *s;
+	size_t n;
+	if (offset > len || size > len - offset)
+		luaL_error(L, "unexpected end of file");
+	if (str != NULL)
+		lua_pushlstring(L, str+offset, size);
+	else
+	{
+		list_seek(L, src, "set", offset);
+		lua_getfield(L, src, "read");
+		lua_pushvalue(L, src);
+		lua_pushinteger(L, size);
+		lua_call(L, 2, 1);
+	}
+	s = lua_tolstring(L, -1, &n);
+	if (s == NULL || n != size)
+		luaL_error(L, "unexpected end of file");
+	return (const uint8_t*)s;
+}
+
+/**
+ * Read the indexes of every stream, from last to first,
+ * and join them into one index. The indexes are kept in
+ * the userdata, which frees them if a read raises an error.
+ */
+static lzma_ret list_streams(lua_State *L, int src, const char *str, uint64_t len,
+				index_userdata *ud)
+{
+	lzma_stream_flags header, footer;
+	const uint8_t *buf;
+	uint64_t pos = len, mem, padding, streamsize;
+	size_t inpos;
+	lzma_ret status;
+	
+	if (len == 0)
+		return LZMA_FORMAT_ERROR;
+	while (pos > 0)
+	{
+		padding = 0;
+		for (;;)
+		{
+			if (pos < 2*LZMA_STREAM_HEADER_SIZE)
+				return LZMA_DATA_ERROR;
+			buf = list_read(L, src, str, len, pos-LZMA_STREAM_HEADER_SIZE, LZMA_STREAM_HEADER_SIZE);
+			if (buf[8] != 0 || buf[9] != 0 || buf[10] != 0 || buf[11] != 0)
+				break;
+			/* stream padding */
+			lua_pop(L, 1);
+			pos -= 4;
+			padding += 4;
+		}
+		status = lzma_stream_footer_decode(&footer, buf);
+		lua_pop(L, 1);
+		if (status != LZMA_OK)
+			return status;
+		if (footer.backward_size > pos - 2*LZMA_STREAM_HEADER_SIZE)
+			return LZMA_DATA_ERROR;
+		pos -= LZMA_STREAM_HEADER_SIZE + footer.backward_size;
+		buf = list_read(L, src, str, len, pos, footer.backward_size);
+		mem = decoder_memlimit();
+		inpos = 0;
+		status = lzma_index_buffer_decode(&ud->stream, &mem, NULL, buf, &inpos, footer.backward_size);
+		lua_pop(L, 1);
+		if (status != LZMA_OK)
+			return status;
+		streamsize = lzma_index_total_size(ud->stream) + LZMA_STREAM_HEADER_SIZE;
+		if (streamsize > pos)
+			return LZMA_DATA_ERROR;
+		pos -= streamsize;
+		buf = list_read(L, src, str, len, pos, LZMA_STREAM_HEADER_SIZE);
+		status = lzma_stream_header_decode(&header, buf);
+		lua_pop(L, 1);
+		if (status == LZMA_OK)
+			status = lzma_stream_flags_compare(&header, &footer);
+		if (status == LZMA_OK)
+			status = lzma_index_stream_flags(ud->stream, &footer);
+		if (status == LZMA_OK)
+			status = lzma_index_stream_padding(ud->stream, padding);
+		if (status == LZMA_OK && ud->idx != NULL)
+		{
+			status = lzma_index_cat(ud->stream, ud->idx, NULL);
+			if (status == LZMA_OK)
+				ud->idx = NULL;
+		}
+		if (status != LZMA_OK)
+			return status;
+		ud->idx = ud->stream;
+		ud->stream = NULL;
+	}
+	return LZMA_OK;
+}
+
+typedef struct list_args
+{
+	const char *str;
+	uint64_t len;
+	index_userdata *ud;
+	lzma_ret status;
+} list_args;
+
+/* Called with the source and the arguments. */
+static int protected_list_streams(lua_State *L)
+{
+	list_args *args = (list_args*)lua_touserdata(L, 2);
+	args->status = list_streams(L, 1, args->str, args->len, args->ud);
+	return 0;
+}
+
+static void push_checkname(lua_State *L, lzma_check check)
+{
+	int i;
+	for (i=0; check_opts[i]; i++)
+		if (check_ids[i] == check)
+		{
+			lua_pushstring(L, check_opts[i]);
+			return;
+		}
+	lua_pushfstring(L, "unknown-%d", (int)check);
+}
+
+/**
+ * Describe the contents of an xz file, like "xz --list".
+ * The argument is either a string or a file handle. Only the
+ * stream headers, footers, and indexes are read.
+ * Returns a table when successful.
+ * Returns nil,string,number if there is an error.
+ */
+static int larc_lzma_list(lua_State *L)
+{
+	const char *str = NULL;
+	size_t len = 0;
+	uint64_t size, cur = 0;
+	index_userdata *ud;
+	list_args args;
+	lzma_index_iter iter;
+	lzma_ret status;
+	uint32_t checks;
+	int i, n, err;
+
+	lua_settop(L, 1);
+	if (lua_type(L, 1) == LUA_TSTRING)
+	{
+		str = lua_tolstring(L, 1, &len);
+		size = len;
+	}
+	else
+	{
+		if (lua_isnoneornil(L, 1))
+			luaL_argerror(L, 1, "string or file handle expected");
+		cur = list_seek(L, 1, "cur", 0);
+		size = list_seek(L, 1, "end", 0);
+	}
+	ud = (index_userdata*)lua_newuserdata(L, sizeof(index_userdata));
+	ud->idx = NULL;
+	ud->stream = NULL;
+	luaL_getmetatable(L, LZMAINDEX_MT);
+	lua_setmetatable(L, -2);
+	/* Restore the file position even if a read fails. */
+	args.str = str;
+	args.len = size;
+	args.ud = ud;
+	args.status = LZMA_PROG_ERROR;
+	lua_pushcfunction(L, protected_list_streams);
+	lua_pushvalue(L, 1);
+	lua_pushlightuserdata(L, &args);
+	err = lua_pcall(L, 2, 0, 0);
+	if (str == NULL)
+		list_seek(L, 1, "set", cur);
+	if (err != 0)
+	{
+		lzmaindex_free(ud);
+		return lua_error(L);
+	}
+	status = args.status;
+	if (status != LZMA_OK)
+	{
+		lzmaindex_free(ud);
+		lua_pushnil(L);
+		lua_pushstring(L, status_to_string[status]);
+		lua_pushinteger(L, status_to_errcode[status]);
+		return 3;
+	}
+	
+	lua_createtable(L, (int)lzma_index_block_count(ud->idx), 5);
+	pushuint64(L, lzma_index_stream_count(ud->idx));
+	lua_setfield(L, -2, "streams");
+	pushuint64(L, lzma_index_block_count(ud->idx));
+	lua_setfield(L, -2, "blocks");
+	pushuint64(L, lzma_index_file_size(ud->idx));
+	lua_setfield(L, -2, "compressed_size");
+	pushuint64(L, lzma_index_uncompressed_size(ud->idx));
+	lua_setfield(L, -2, "uncompressed_size");
+	checks = lzma_index_checks(ud->idx);
+	n = 0;
+	for (i=0; i<=LZMA_CHECK_ID_MAX; i++)
+		if (checks & (1U << i))
+		{
+			if (n++ > 0)
+				lua_pushliteral(L, ",");
+			push_checkname(L, (lzma_check)i);
+		}
+	lua_concat(L, n > 0 ? 2*n-1 : 0);
+	lua_setfield(L, -2, "check");
+	
+	lzma_index_iter_init(&iter, ud->idx);
+	i = 1;
+	while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK))
+	{
+		lua_createtable(L, 0, 6);
+		pushuint64(L, iter.stream.number);
+		lua_setfield(L, -2, "stream");
+		pushuint64(L, iter.block.compressed_file_offset);
+		lua_setfield(L, -2, "compressed_offset");
+		pushuint64(L, iter.block.uncompressed_file_offset);
+		lua_setfield(L, -2, "uncompressed_offset");
+		pushuint64(L, iter.block.total_size);
+		lua_setfield(L, -2, "compressed_size");
+		pushuint64(L, iter.block.uncompressed_size);
+		lua_setfield(L, -2, "uncompressed_size");
+		push_checkname(L, iter.stream.flags->check);
+		lua_setfield(L, -2, "check");
+		lua_rawseti(L, -2, i++);
+	}
+	lzma_index_end(ud->idx, NULL);
+	ud->idx = NULL;
+	return 1;
+}
+
 /**
  * Compute the CRC32 hash of a string.
  */
@@ -1013,6 +1829,133 @@ static int larc_lzma_crc32(lua_State *L)
 	return 1;
 }
 
+/* ECMA-182 polynomial, bit-reflected */
+#define CRC64_POLY	0xC96C5795D7870F42ULL
+
+/* x^(2^n) mod P */
+static uint64_t crc64_x2n_table[64];
+
+/**
+ * Multiply two reflected polynomials modulo P.
+ */
+static uint64_t crc64_multmodp(uint64_t a, uint64_t b)
+{
+	uint64_t m = 1ULL << 63, p = 0;
+	for (;;)
+	{
+		if (a & m)
+		{
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ CRC64_POLY : b >> 1;
+	}
+	return p;
+}
+
+/**
+ * x^(n*2^k) mod P
+ */
+static uint64_t crc64_x2nmodp(uint64_t n, unsigned k)
+{
+	uint64_t p = 1ULL << 63; /* x^0 */
+	while (n)
+	{
+		if (n & 1)
+			p = crc64_multmodp(crc64_x2n_table[k & 63], p);
+		n >>= 1;
+		k++;
+	}
+	return p;
+}
+
+#ifdef HAVE_CLMUL
+/*
+ * Folding constants, pairs of x^(d+63) and x^(d-1) mod P
+ * for distances d of 512, 384, 256, and 128 bits.
+ */
+static uint64_t crc64_fold[8];
+static int crc64_has_clmul;
+
+#define CRC64_FOLD(x,k)	_mm_xor_si128( \
+		_mm_clmulepi64_si128((x), (k), 0x00), \
+		_mm_clmulepi64_si128((x), (k), 0x11))
+#define CRC64_LOAD(p)	_mm_loadu_si128((const __m128i*)(p))
+
+/**
+ * CRC64 by carry-less multiplication. Four lanes of 16 bytes are
+ * folded in parallel, then merged. The final 128 bits are reduced
+ * with the table driven code, as is any tail shorter than 16 bytes.
+ */
+__attribute__((target("pclmul,sse2")))
+static uint64_t crc64_clmul(const uint8_t *buf, size_t size, uint64_t crc)
+{
+	__m128i x0, x1, x2, x3, k;
+	uint64_t tmp[2];
+	
+	if (size < 64)
+		return lzma_crc64(buf, size, crc);
+	x0 = _mm_xor_si128(CRC64_LOAD(buf), _mm_set_epi64x(0, (long long)~crc));
+	x1 = CRC64_LOAD(buf+16);
+	x2 = CRC64_LOAD(buf+32);
+	x3 = CRC64_LOAD(buf+48);
+	buf += 64;
+	size -= 64;
+	k = CRC64_LOAD(crc64_fold);
+	while (size >= 64)
+	{
+		x0 = _mm_xor_si128(CRC64_FOLD(x0, k), CRC64_LOAD(buf));
+		x1 = _mm_xor_si128(CRC64_FOLD(x1, k), CRC64_LOAD(buf+16));
+		x2 = _mm_xor_si128(CRC64_FOLD(x2, k), CRC64_LOAD(buf+32));
+		x3 = _mm_xor_si128(CRC64_FOLD(x3, k), CRC64_LOAD(buf+48));
+		buf += 64;
+		size -= 64;
+	}
+	x3 = _mm_xor_si128(x3, CRC64_FOLD(x0, CRC64_LOAD(crc64_fold+2)));
+	x3 = _mm_xor_si128(x3, CRC64_FOLD(x1, CRC64_LOAD(crc64_fold+4)));
+	k = CRC64_LOAD(crc64_fold+6);
+	x3 = _mm_xor_si128(x3, CRC64_FOLD(x2, k));
+	while (size >= 16)
+	{
+		x3 = _mm_xor_si128(CRC64_FOLD(x3, k), CRC64_LOAD(buf));
+		buf += 16;
+		size -= 16;
+	}
+	_mm_storeu_si128((__m128i*)tmp, x3);
+	crc = lzma_crc64((const uint8_t*)tmp, 16, ~0ULL);
+	return size ? lzma_crc64(buf, size, crc) : crc;
+}
+#endif
+
+static void crc64_init(void)
+{
+	int n;
+	crc64_x2n_table[0] = 1ULL << 62; /* x^1 */
+	for (n=1; n<64; n++)
+		crc64_x2n_table[n] = crc64_multmodp(crc64_x2n_table[n-1], crc64_x2n_table[n-1]);
+#ifdef HAVE_CLMUL
+	for (n=0; n<4; n++)
+	{
+		uint64_t d = 512 - 128*n;
+		crc64_fold[2*n] = crc64_x2nmodp(d+63, 0);
+		crc64_fold[2*n+1] = crc64_x2nmodp(d-1, 0);
+	}
+	__builtin_cpu_init();
+	crc64_has_clmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse2");
+#endif
+}
+
+static uint64_t crc64(const uint8_t *buf, size_t size, uint64_t crc)
+{
+#ifdef HAVE_CLMUL
+	if (crc64_has_clmul)
+		return crc64_clmul(buf, size, crc);
+#endif
+	return lzma_crc64(buf, size, crc);
+}
+
 /**
  * Compute the CRC64 hash of a string.
  */
@@ -1038,11 +1981,26 @@ static int larc_lzma_crc64(lua_State *L)
 		s = luaL_checklstring(L, 2, &n);
 	}
 	if (n > 0)
-		crc = lzma_crc64((const uint8_t*)s, n, crc);
+		crc = crc64((const uint8_t*)s, n, crc);
 	newuint64(L, crc);
 	return 1;
 }
 
+/**
+ * Compute the CRC64 of two strings joined together given
+ * the CRC64 of each and the length of the second string.
+ */
+static int larc_lzma_crc64combine(lua_State *L)
+{
+	uint64_t crc1, crc2, len;
+	
+	crc1 = getuint64(L, 1);
+	crc2 = getuint64(L, 2);
+	len = getuint64(L, 3);
+	newuint64(L, crc64_multmodp(crc64_x2nmodp(len, 3), crc1) ^ crc2);
+	return 1;
+}
+
 /**
  * Get what LZMA thinks is the maximum memory available.
  */
@@ -1066,6 +2024,7 @@ static const luaL_Reg lzmafilter_lzma_mt[] =
 	{"__index", lzmafilter_lzma_index},
 	{"__newindex", lzmafilter_lzma_newindex},
 	{"__tostring", lzmafilter_tostring},
+	{"__gc", lzmafilter_lzma_gc},
 	{NULL, NULL}
 };
 static const luaL_Reg lzmafilter_delta_mt[] = 
@@ -1089,10 +2048,16 @@ static const luaL_Reg larc_lzma_Reg[] =
 	{"decompress", larc_lzma_decompress},
 	{"compressor", larc_lzma_compressor},
 	{"decompressor", larc_lzma_decompressor},
+	{"readahead", larc_lzma_readahead},
+	{"readline", larc_readline},
+	{"lines", larc_lines},
+	{"bufsize", larc_bufsize},
 	{"filter", larc_lzmafilter_new},
 	{"crc32", larc_lzma_crc32},
 	{"crc64", larc_lzma_crc64},
+	{"crc64_combine", larc_lzma_crc64combine},
 	{"physmem", larc_lzma_physmem},
+	{"list", larc_lzma_list},
 	{NULL, NULL}
 };
 
@@ -1101,6 +2066,7 @@ LUAMOD_API int luaopen_larc_lzma(lua_State *L)
 	lua_getglobal(L, "require");
 	lua_pushliteral(L, "larc.struct");
 	lua_call(L, 1, 0);
+	crc64_init();
 	luaL_newmetatable(L, LZMAFILTER_LZMA_MT);
 	luaL_register(L, NULL, lzmafilter_lzma_mt);
 	lua_pop(L, 1);
@@ -1114,6 +2080,11 @@ LUAMOD_API int luaopen_larc_lzma(lua_State *L)
 	lua_pushcfunction(L, lzmauserdata_gc);
 	lua_setfield(L, -2, "__gc");
 	lua_pop(L, 1);
+	luaL_newmetatable(L, LZMAINDEX_MT);
+	lua_pushcfunction(L, lzmaindex_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+	larc_readahead_register(L);
 	luaL_register(L, "larc.lzma", larc_lzma_Reg);
 	lua_pushstring(L, lzma_version_string());
 	lua_setfield(L, -2, "LZMA_VERSION");
@@ -22,14 +22,25 @@
  *     this software without specific prior written permission.
  */
 
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
 #include "lua.h"
 #include "lauxlib.h"
+#include "lualib.h"
 
 #include "zlib.h"
 #include "shared.h"
 
 #define DEFLATE_MT	"larc.zlib.deflate"
 #define INFLATE_MT	"larc.zlib.inflate"
+#define GZFILE_MT	"larc.zlib.gzfile"
+#define BGZF_POOL_MT	"larc.zlib.bgzfpool"
+#define LARC_READAHEAD_MT	"larc.zlib.readahead"
+
+#include "readahead.h"
+#include "lines.h"
 
 typedef struct zlib_userdata
 {
@@ -37,8 +48,15 @@ typedef struct zlib_userdata
 	int status;
 	int result;
 	int flush;
+	int raw;	/* deflate without a zlib or gzip wrapper */
 } z_userdata;
 
+/* Source of zero bytes for seeking forward while compressing. */
+#define ZEROBLOCKSIZE	32768
+static const char zero_block[ZEROBLOCKSIZE];
+/* Shortest run written as a block of its own. */
+#define ZERORUNMIN	65536
+
 static int deflate_userdata_gc(lua_State *L)
 {
 	z_userdata *ud = (z_userdata*)lua_touserdata(L, 1);
@@ -53,19 +71,33 @@ static int inflate_userdata_gc(lua_State *L)
 	return 0;
 }
 
-static int deflate_to_buffer(lua_State *L, z_userdata *ud)
+/* Run deflate on the current input into the buffer. */
+static void deflate_into(luaL_Buffer *B, z_userdata *ud, int flush)
 {
-	luaL_Buffer B;
-	luaL_buffinit(L, &B);
 	do
 	{
-		ud->z.next_out = (unsigned char*)luaL_prepbuffer(&B);
+		ud->z.next_out = (unsigned char*)luaL_prepbuffer(B);
 		ud->z.avail_out = LUAL_BUFFERSIZE;
-		if ((ud->status = deflate(&ud->z, ud->flush)) == Z_STREAM_ERROR)
+		ud->status = deflate(&ud->z, flush);
+		if (ud->status == Z_BUF_ERROR && ud->z.avail_in == 0 && flush != Z_FINISH)
+		{
+			/* the input ran out just as the last buffer was filled,
+			   or there was nothing left to flush */
+			ud->status = Z_OK;
 			break;
-		luaL_addsize(&B, LUAL_BUFFERSIZE - ud->z.avail_out);
+		}
+		if (ud->status == Z_STREAM_ERROR)
+			break;
+		luaL_addsize(B, LUAL_BUFFERSIZE - ud->z.avail_out);
 	}
 	while (ud->z.avail_out == 0);
+}
+
+static int deflate_to_buffer(lua_State *L, z_userdata *ud)
+{
+	luaL_Buffer B;
+	luaL_buffinit(L, &B);
+	deflate_into(&B, ud, ud->flush);
 	if ((ud->status == Z_OK || ud->status == Z_STREAM_END) && ud->z.avail_in != 0)
 		return luaL_error(L, "unknown failure in deflate");
 	luaL_pushresult(&B);
@@ -80,16 +112,136 @@ static int protected_deflate_to_buffer(lua_State *L)
 	return 0;
 }
 
+/* Add bits to the output, least significant bit first. */
+static void zerorun_putbits(luaL_Buffer *B, unsigned long *bits, int *nbits,
+		unsigned long value, int n)
+{
+	*bits |= value << *nbits;
+	*nbits += n;
+	while (*nbits >= 8)
+	{
+		luaL_addchar(B, (char)(*bits & 0xFF));
+		*bits >>= 8;
+		*nbits -= 8;
+	}
+}
+
+/**
+ * Write a dynamic block of a zero byte followed by `count' matches of
+ * length 258 at distance 1, then an empty stored block to get back to
+ * a byte boundary. The block uses one-bit codes for both the length
+ * and the distance, so all the matches are zero bits.
+ */
+static void zerorun_block(luaL_Buffer *B, size_t count)
+{
+	/* code length code lengths, in the order 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1 */
+	static const unsigned char cllens[18] = {0,0,1,0,0,0,0,0,0,0,0,0,0,0,0,2,0,2};
+	unsigned long bits = 0;
+	int nbits = 0, i;
+	size_t zeros;
+	zerorun_putbits(B, &bits, &nbits, 0, 1);	/* not last */
+	zerorun_putbits(B, &bits, &nbits, 2, 2);	/* dynamic */
+	zerorun_putbits(B, &bits, &nbits, 286 - 257, 5);
+	zerorun_putbits(B, &bits, &nbits, 1 - 1, 5);
+	zerorun_putbits(B, &bits, &nbits, 18 - 4, 4);
+	for (i = 0; i < 18; i++)
+		zerorun_putbits(B, &bits, &nbits, cllens[i], 3);
+	/* Code lengths: 18 is 0, 1 is 10, 2 is 11, written reversed.
+	   Literal 0 and end of block get 2 bits, length 258 gets 1 bit,
+	   and distance 1 is the only distance. */
+	zerorun_putbits(B, &bits, &nbits, 3, 2);	/* 0: 2 */
+	zerorun_putbits(B, &bits, &nbits, 0, 1);	/* 1-138: 0 */
+	zerorun_putbits(B, &bits, &nbits, 138 - 11, 7);
+	zerorun_putbits(B, &bits, &nbits, 0, 1);	/* 139-255: 0 */
+	zerorun_putbits(B, &bits, &nbits, 117 - 11, 7);
+	zerorun_putbits(B, &bits, &nbits, 3, 2);	/* 256: 2 */
+	zerorun_putbits(B, &bits, &nbits, 0, 1);	/* 257-284: 0 */
+	zerorun_putbits(B, &bits, &nbits, 28 - 11, 7);
+	zerorun_putbits(B, &bits, &nbits, 1, 2);	/* 285: 1 */
+	zerorun_putbits(B, &bits, &nbits, 1, 2);	/* distance 0: 1 */
+	/* literal 0 is 10, length 258 is 0, distance 1 is 0 */
+	zerorun_putbits(B, &bits, &nbits, 1, 2);
+	zeros = (nbits + 2 * count) / 8;
+	nbits = (nbits + 2 * count) % 8;
+	if (zeros > 0)
+	{
+		luaL_addchar(B, (char)(bits & 0xFF));
+		bits = 0;
+		zeros--;
+	}
+	while (zeros > 0)
+	{
+		size_t n = zeros < LUAL_BUFFERSIZE ? zeros : LUAL_BUFFERSIZE;
+		memset(luaL_prepbuffer(B), 0, n);
+		luaL_addsize(B, n);
+		zeros -= n;
+	}
+	zerorun_putbits(B, &bits, &nbits, 3, 2);	/* end of block is 11 */
+	zerorun_putbits(B, &bits, &nbits, 0, 3);	/* not last, stored */
+	if (nbits > 0)
+		zerorun_putbits(B, &bits, &nbits, 0, 8 - nbits);
+	luaL_addlstring(B, "\0\0\377\377", 4);
+}
+
+/**
+ * Compress `count' zero bytes into one string.
+ * A long run in a raw stream is written as a block made here
+ * after a full flush, and the deflate window is then set to
+ * zeros, so the time depends on the size of the output only.
+ */
+static int deflate_zeros(lua_State *L, z_userdata *ud, lua_Number count)
+{
+	luaL_Buffer B;
+	lua_Number used = 0;
+	luaL_buffinit(L, &B);
+	ud->flush = Z_NO_FLUSH;
+	if (ud->raw && count >= ZERORUNMIN)
+	{
+		ud->z.next_in = (unsigned char*)zero_block;
+		ud->z.avail_in = 0;
+		deflate_into(&B, ud, Z_FULL_FLUSH);
+		if (ud->status == Z_BUF_ERROR)	/* already flushed */
+			ud->status = Z_OK;
+		if (ud->status == Z_OK)
+		{
+			size_t n = (size_t)((count - 1) / 258);
+			zerorun_block(&B, n);
+			used = 1 + 258 * (lua_Number)n;
+			deflateSetDictionary(&ud->z, (const Bytef*)zero_block, ZEROBLOCKSIZE);
+		}
+	}
+	while (used < count && ud->status == Z_OK)
+	{
+		size_t n = count - used < ZEROBLOCKSIZE ? (size_t)(count - used) : ZEROBLOCKSIZE;
+		ud->z.next_in = (unsigned char*)zero_block;
+		ud->z.avail_in = n;
+		deflate_into(&B, ud, Z_NO_FLUSH);
+		used += n - ud->z.avail_in;
+	}
+	luaL_pushresult(&B);
+	lua_pushnumber(L, used);
+	lua_pushinteger(L, ud->status);
+	return 3;
+}
+
 static int deflate_call(lua_State *L)
 {
 	z_userdata *ud = (z_userdata*)lua_touserdata(L, lua_upvalueindex(1));
 	size_t len;
-	const char *str = luaL_optlstring(L, 1, NULL, &len);
+	const char *str;
+	if (lua_type(L, 1) == LUA_TNUMBER)
+	{
+		lua_Number count = lua_tonumber(L, 1);
+		luaL_argcheck(L, count >= 0, 1, "invalid count");
+		/* a fraction of a byte would never be used */
+		return deflate_zeros(L, ud, floor(count));
+	}
+	str = larc_optbytes(L, 1, NULL, &len);
 	if (str != NULL)
 	{
 		ud->z.next_in = (unsigned char*)str;
 		ud->z.avail_in = len;
-		ud->flush = Z_NO_FLUSH;
+		ud->flush = lua_toboolean(L, 2) ? Z_SYNC_FLUSH : Z_NO_FLUSH;
 	}
 	else
 	{
@@ -121,7 +273,7 @@ static int larc_zlib_compress(lua_State *L)
 		mem = 8,
 		strategy = Z_DEFAULT_STRATEGY;
 	size_t len;
-	const char *str = luaL_checklstring(L, 1, &len);
+	const char *str = larc_checkbytes(L, 1, &len);
 	z_userdata ud;
 
 	if (lua_gettop(L) > 1)
@@ -177,6 +329,10 @@ static int larc_zlib_compress(lua_State *L)
 
 /**
  * Create a deflate function.
+ * The function compresses a string, or that many zero bytes
+ * when called with a number, and finishes the stream when
+ * called with nil. With true after the string, the output is
+ * flushed to a byte boundary so it can all be decompressed.
  * options:
  *   level=[0,9]
  *   wbits=[8,15]
@@ -210,6 +366,7 @@ static int larc_zlib_compressor(lua_State *L)
 	ud->z.zfree = Z_NULL;
 	ud->z.opaque = Z_NULL;
 	
+	ud->raw = wbits < 0;
 	ud->status = deflateInit2(&ud->z, level, Z_DEFLATED, wbits, mem, strategy);
 	if (ud->status != Z_OK)
 	{
@@ -232,6 +389,12 @@ static int inflate_to_buffer(lua_State *L, z_userdata *ud)
 		ud->z.next_out = (unsigned char*)luaL_prepbuffer(&B);
 		ud->z.avail_out = LUAL_BUFFERSIZE;
 		ud->status = inflate(&ud->z, Z_NO_FLUSH);
+		if (ud->status == Z_BUF_ERROR && ud->z.avail_in == 0)
+		{
+			/* the input ran out just as the last buffer was filled */
+			ud->status = Z_OK;
+			break;
+		}
 		if (ud->status != Z_OK && ud->status != Z_STREAM_END)
 			break;
 		luaL_addsize(&B, LUAL_BUFFERSIZE - ud->z.avail_out);
@@ -259,7 +422,7 @@ static int inflate_call(lua_State *L)
 {
 	z_userdata *ud = (z_userdata*)lua_touserdata(L, lua_upvalueindex(1));
 	size_t len;
-	const char *str = luaL_optlstring(L, 1, NULL, &len);
+	const char *str = larc_optbytes(L, 1, NULL, &len);
 	if (len > 0)
 	{
 		ud->z.next_in = (unsigned char*)str;
@@ -288,7 +451,7 @@ static int larc_zlib_decompress(lua_State *L)
 {
 	int wbits = 15;
 	size_t len;
-	const char *str = luaL_checklstring(L, 1, &len);
+	const char *str = larc_checkbytes(L, 1, &len);
 	z_userdata ud;
 
 	if (lua_gettop(L) > 1)
@@ -376,6 +539,696 @@ static int larc_zlib_decompressor(lua_State *L)
 	return 1;
 }
 
+static int readahead_inflate(larc_Readahead *ra, const char **in, size_t *inlen,
+		char **out, size_t *outlen)
+{
+	z_stream *z = (z_stream*)ra->stream;
+	int status;
+	z->next_in = (Bytef*)*in;
+	z->avail_in = *inlen;
+	z->next_out = (Bytef*)*out;
+	z->avail_out = *outlen;
+	status = inflate(z, Z_NO_FLUSH);
+	*in = (const char*)z->next_in;
+	*inlen = z->avail_in;
+	*out = (char*)z->next_out;
+	*outlen = z->avail_out;
+	if (status == Z_OK)
+		return LARC_RA_OK;
+	if (status == Z_STREAM_END)
+		return LARC_RA_END;
+	ra->errmsg = z->msg != NULL ? z->msg : zError(status);
+	return status < 0 ? status : Z_DATA_ERROR;
+}
+
+static void readahead_inflateend(larc_Readahead *ra)
+{
+	inflateEnd((z_stream*)ra->stream);
+}
+
+/**
+ * Inflate an io file in a background thread.
+ * Returns an object whose read method returns the next
+ * chunk of the stream, or nil at the end.
+ * Returns nil if the handle is not an io file on a regular
+ * file or threads are not available.
+ * options:
+ *   wbits=[8,15]
+ *   bufsize=number
+ */
+static int larc_zlib_readahead(lua_State *L)
+{
+	int wbits = 15,
+		bufsize = 65536,
+		status;
+	larc_Readahead *ra;
+	z_stream *z;
+	if (lua_gettop(L) > 1)
+	{
+		luaL_checktype(L, 2, LUA_TTABLE);
+		GETINTOPTION(2,wbits);
+		GETINTOPTION(2,bufsize);
+	}
+	if (bufsize <= 0)
+		return luaL_argerror(L, 2, "invalid buffer size");
+
+	ra = larc_readahead_new(L, 1, bufsize, sizeof(z_stream));
+	if (ra == NULL)
+	{
+		lua_pushnil(L);
+		return 1;
+	}
+	z = (z_stream*)ra->stream;
+	z->zalloc = Z_NULL;
+	z->zfree = Z_NULL;
+	z->opaque = Z_NULL;
+	z->next_in = Z_NULL;
+	z->avail_in = 0;
+	status = inflateInit2(z, wbits);
+	if (status != Z_OK)
+	{
+		lua_pushnil(L);
+		lua_pushstring(L, zError(status));
+		lua_pushinteger(L, status);
+		return 3;
+	}
+	ra->decode = readahead_inflate;
+	ra->finish = readahead_inflateend;
+	larc_readahead_start(L, ra);
+	return 1;
+}
+
+/**
+ * Copy a compressor or decompressor function with the state
+ * of its stream. The copy continues from the same point as
+ * the original, which is not changed.
+ * Returns nil,string,number if there is an error.
+ */
+static int larc_zlib_copy(lua_State *L)
+{
+	z_userdata *ud, *copy;
+	int isdeflate = 0, status;
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	ud = lua_getupvalue(L, 1, 1) != NULL ? (z_userdata*)lua_touserdata(L, -1) : NULL;
+	if (ud != NULL && lua_getmetatable(L, -1))
+	{
+		luaL_getmetatable(L, DEFLATE_MT);
+		isdeflate = lua_rawequal(L, -1, -2);
+		luaL_getmetatable(L, INFLATE_MT);
+		if (!isdeflate && !lua_rawequal(L, -1, -3))
+			ud = NULL;
+		lua_pop(L, 3);
+	}
+	else
+		ud = NULL;
+	if (ud == NULL)
+		return luaL_argerror(L, 1, "not a compressor or decompressor");
+
+	copy = (z_userdata*)lua_newuserdata(L, sizeof(z_userdata));
+	*copy = *ud;
+	if (isdeflate)
+		status = deflateCopy(&copy->z, &ud->z);
+	else
+		status = inflateCopy(&copy->z, &ud->z);
+	if (status != Z_OK)
+	{
+		lua_pushnil(L);
+		lua_pushstring(L, zError(status));
+		lua_pushinteger(L, status);
+		return 3;
+	}
+	luaL_getmetatable(L, isdeflate ? DEFLATE_MT : INFLATE_MT);
+	lua_setmetatable(L, -2);
+	lua_pushcclosure(L, isdeflate ? deflate_call : inflate_call, 1);
+	return 1;
+}
+
+/**
+ * BGZF blocked gzip.
+ * A BGZF file is a series of gzip members of at most 64 KB each,
+ * with the compressed size of the member in a "BC" extra field.
+ * The members are independent, so they are compressed and
+ * decompressed in parallel, and a position in the file is named
+ * by the offset of a member and an offset in its data.
+ */
+#define BGZF_BLOCKSIZE	65280	/* data in a full block */
+#define BGZF_MAXBLOCK	65536
+#define BGZF_HEADERSIZE	18
+#define BGZF_FOOTERSIZE	8
+#define BGZF_MAXTHREADS	64
+
+static const unsigned char bgzf_header[BGZF_HEADERSIZE] =
+	{31,139,8,4, 0,0,0,0, 0,255, 6,0, 'B','C', 2,0, 0,0};
+
+typedef struct bgzf_job
+{
+	const unsigned char *in;
+	size_t inlen;
+	unsigned char *out;
+	size_t outlen;
+	int status;
+	const char *errmsg;
+} bgzf_job;
+
+typedef struct bgzf_pool
+{
+	bgzf_job *jobs;
+	int njobs;
+	int next;	/* next job to take */
+	int level;	/* compression level, or -2 to decompress */
+#ifndef LARC_NO_THREADS
+	pthread_mutex_t lock;
+#endif
+} bgzf_pool;
+
+#define BGZF_INFLATE	-2
+#define BGZF_NOSTREAM	-3
+
+/* The stream of a thread, kept from one pool to the next. */
+typedef struct bgzf_stream
+{
+	z_stream z;
+	int level;	/* what the stream is set up for, or BGZF_NOSTREAM */
+	struct bgzf_threads *owner;
+} bgzf_stream;
+
+/* Threads that wait for the jobs of one pool after another.
+   The calling thread runs jobs with the first stream. */
+typedef struct bgzf_threads
+{
+	int nthreads;
+	bgzf_stream stream[BGZF_MAXTHREADS];
+#ifndef LARC_NO_THREADS
+	int started;
+	pthread_t thread[BGZF_MAXTHREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* there is a new pool, or stop is set */
+	pthread_cond_t done;	/* busy dropped to zero */
+	bgzf_pool *pool;
+	unsigned long batch;	/* counts the pools */
+	int busy;	/* threads still working on the pool */
+	int stop;
+#endif
+} bgzf_threads;
+
+static void bgzf_putlong(unsigned char *p, unsigned long n)
+{
+	p[0] = n & 0xFF;
+	p[1] = (n >> 8) & 0xFF;
+	p[2] = (n >> 16) & 0xFF;
+	p[3] = (n >> 24) & 0xFF;
+}
+
+static unsigned long bgzf_getlong(const unsigned char *p)
+{
+	return p[0] | ((unsigned long)p[1] << 8) |
+		((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+/* Compress the data of a job into a whole block. */
+static int bgzf_deflate_block(z_stream *z, bgzf_job *job)
+{
+	unsigned char *out = job->out;
+	size_t len;
+	deflateReset(z);
+	z->next_in = (Bytef*)job->in;
+	z->avail_in = job->inlen;
+	z->next_out = out + BGZF_HEADERSIZE;
+	z->avail_out = BGZF_MAXBLOCK - BGZF_HEADERSIZE - BGZF_FOOTERSIZE;
+	if (deflate(z, Z_FINISH) == Z_STREAM_END)
+		len = z->next_out - out - BGZF_HEADERSIZE;
+	else
+	{
+		/* Data that does not compress is kept in a stored block. */
+		unsigned char *p = out + BGZF_HEADERSIZE;
+		p[0] = 1;
+		p[1] = job->inlen & 0xFF;
+		p[2] = (job->inlen >> 8) & 0xFF;
+		p[3] = ~p[1];
+		p[4] = ~p[2];
+		memcpy(p + 5, job->in, job->inlen);
+		len = job->inlen + 5;
+	}
+	memcpy(out, bgzf_header, BGZF_HEADERSIZE);
+	len += BGZF_HEADERSIZE + BGZF_FOOTERSIZE;
+	out[16] = (len - 1) & 0xFF;
+	out[17] = ((len - 1) >> 8) & 0xFF;
+	bgzf_putlong(out + len - 8, crc32(crc32(0L, Z_NULL, 0), job->in, job->inlen));
+	bgzf_putlong(out + len - 4, job->inlen);
+	job->outlen = len;
+	return Z_OK;
+}
+
+/* Decompress a whole block into the output of a job,
+   which has the size written in the footer. */
+static int bgzf_inflate_block(z_stream *z, bgzf_job *job)
+{
+	const unsigned char *in = job->in;
+	size_t xlen = in[10] | (in[11] << 8);
+	unsigned char empty;
+	int status;
+	inflateReset(z);
+	z->next_in = (Bytef*)in + 12 + xlen;
+	z->avail_in = job->inlen - 12 - xlen - BGZF_FOOTERSIZE;
+	z->next_out = job->outlen > 0 ? job->out : &empty;
+	z->avail_out = job->outlen > 0 ? job->outlen : 1;
+	status = inflate(z, Z_FINISH);
+	if (status != Z_STREAM_END)
+	{
+		job->errmsg = z->msg != NULL ? z->msg : "truncated block";
+		return status == Z_OK || status == Z_BUF_ERROR ? Z_DATA_ERROR : status;
+	}
+	if (z->total_out != job->outlen || z->avail_in != 0)
+	{
+		job->errmsg = "incorrect block length";
+		return Z_DATA_ERROR;
+	}
+	if (crc32(crc32(0L, Z_NULL, 0), job->out, job->outlen)
+			!= bgzf_getlong(in + job->inlen - 8))
+	{
+		job->errmsg = "incorrect data check";
+		return Z_DATA_ERROR;
+	}
+	return Z_OK;
+}
+
+static void bgzf_endstream(bgzf_stream *s)
+{
+	if (s->level == BGZF_INFLATE)
+		inflateEnd(&s->z);
+	else if (s->level != BGZF_NOSTREAM)
+		deflateEnd(&s->z);
+	s->level = BGZF_NOSTREAM;
+}
+
+/* Set up a stream for a compression level or to decompress,
+   unless it already is. */
+static int bgzf_setstream(bgzf_stream *s, int level)
+{
+	int status;
+	if (s->level == level)
+		return Z_OK;
+	bgzf_endstream(s);
+	s->z.zalloc = Z_NULL;
+	s->z.zfree = Z_NULL;
+	s->z.opaque = Z_NULL;
+	s->z.next_in = Z_NULL;
+	s->z.avail_in = 0;
+	if (level == BGZF_INFLATE)
+		status = inflateInit2(&s->z, -15);
+	else
+		status = deflateInit2(&s->z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+	if (status == Z_OK)
+		s->level = level;
+	return status;
+}
+
+/* Take jobs from the pool until there are none left. */
+static void bgzf_work(bgzf_pool *pool, bgzf_stream *s)
+{
+	int status = bgzf_setstream(s, pool->level),
+		i;
+	for (;;)
+	{
+		bgzf_job *job;
+#ifndef LARC_NO_THREADS
+		pthread_mutex_lock(&pool->lock);
+#endif
+		i = pool->next++;
+#ifndef LARC_NO_THREADS
+		pthread_mutex_unlock(&pool->lock);
+#endif
+		if (i >= pool->njobs)
+			break;
+		job = &pool->jobs[i];
+		if (status != Z_OK)
+		{
+			job->status = status;
+			job->errmsg = zError(status);
+		}
+		else if (pool->level == BGZF_INFLATE)
+			job->status = bgzf_inflate_block(&s->z, job);
+		else
+			job->status = bgzf_deflate_block(&s->z, job);
+	}
+}
+
+static void *bgzf_worker(void *arg)
+{
+	bgzf_stream s;
+	s.level = BGZF_NOSTREAM;
+	bgzf_work((bgzf_pool*)arg, &s);
+	bgzf_endstream(&s);
+	return NULL;
+}
+
+/* Run the jobs of a pool on up to nthreads threads,
+   including the calling thread. */
+static void bgzf_run(bgzf_pool *pool, int nthreads)
+{
+#ifndef LARC_NO_THREADS
+	pthread_t thread[BGZF_MAXTHREADS];
+	int i, started = 0;
+	if (nthreads > pool->njobs)
+		nthreads = pool->njobs;
+	pthread_mutex_init(&pool->lock, NULL);
+	for (i = 1; i < nthreads; i++)
+		if (pthread_create(&thread[started], NULL, bgzf_worker, pool) == 0)
+			started++;
+	bgzf_worker(pool);
+	for (i = 0; i < started; i++)
+		pthread_join(thread[i], NULL);
+	pthread_mutex_destroy(&pool->lock);
+#else
+	(void)nthreads;
+	bgzf_worker(pool);
+#endif
+}
+
+#ifndef LARC_NO_THREADS
+/* Run the jobs of each new pool until told to stop. */
+static void *bgzf_thread(void *arg)
+{
+	bgzf_stream *s = (bgzf_stream*)arg;
+	bgzf_threads *t = s->owner;
+	unsigned long batch = 0;
+	pthread_mutex_lock(&t->lock);
+	for (;;)
+	{
+		while (t->batch == batch && !t->stop)
+			pthread_cond_wait(&t->work, &t->lock);
+		if (t->stop)
+			break;
+		batch = t->batch;
+		pthread_mutex_unlock(&t->lock);
+		bgzf_work(t->pool, s);
+		pthread_mutex_lock(&t->lock);
+		if (--t->busy == 0)
+			pthread_cond_signal(&t->done);
+	}
+	pthread_mutex_unlock(&t->lock);
+	return NULL;
+}
+#endif
+
+/* Run the jobs of a pool on the waiting threads
+   and the calling thread. */
+static void bgzf_threads_run(bgzf_threads *t, bgzf_pool *pool)
+{
+#ifndef LARC_NO_THREADS
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_mutex_lock(&t->lock);
+	t->pool = pool;
+	t->batch++;
+	t->busy = t->started;
+	pthread_cond_broadcast(&t->work);
+	pthread_mutex_unlock(&t->lock);
+	bgzf_work(pool, &t->stream[0]);
+	pthread_mutex_lock(&t->lock);
+	while (t->busy > 0)
+		pthread_cond_wait(&t->done, &t->lock);
+	t->pool = NULL;
+	pthread_mutex_unlock(&t->lock);
+	pthread_mutex_destroy(&pool->lock);
+#else
+	bgzf_work(pool, &t->stream[0]);
+#endif
+}
+
+/* Stop the threads and free the streams. */
+static void bgzf_threads_stop(bgzf_threads *t)
+{
+	int i;
+#ifndef LARC_NO_THREADS
+	if (t->started > 0)
+	{
+		pthread_mutex_lock(&t->lock);
+		t->stop = 1;
+		pthread_cond_broadcast(&t->work);
+		pthread_mutex_unlock(&t->lock);
+		for (i = 0; i < t->started; i++)
+			pthread_join(t->thread[i], NULL);
+		t->started = 0;
+	}
+	if (t->nthreads > 0)
+	{
+		pthread_cond_destroy(&t->done);
+		pthread_cond_destroy(&t->work);
+		pthread_mutex_destroy(&t->lock);
+	}
+#endif
+	for (i = 0; i < t->nthreads; i++)
+		bgzf_endstream(&t->stream[i]);
+	t->nthreads = 0;
+}
+
+/**
+ * Create a pool of threads for bgzf_compress and bgzf_decompress.
+ * The threads and their streams are kept from one call to the
+ * next until the pool is closed or collected.
+ */
+static int larc_zlib_bgzfpool(lua_State *L)
+{
+	int threads = luaL_optint(L, 1, 1),
+		i;
+	bgzf_threads *t;
+	luaL_argcheck(L, threads >= 1 && threads <= BGZF_MAXTHREADS, 1, "invalid number of threads");
+	t = (bgzf_threads*)lua_newuserdata(L, sizeof(bgzf_threads));
+	for (i = 0; i < threads; i++)
+	{
+		t->stream[i].level = BGZF_NOSTREAM;
+		t->stream[i].owner = t;
+	}
+#ifndef LARC_NO_THREADS
+	t->started = 0;
+	t->pool = NULL;
+	t->batch = 0;
+	t->busy = 0;
+	t->stop = 0;
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->work, NULL);
+	pthread_cond_init(&t->done, NULL);
+	for (i = 1; i < threads; i++)
+		if (pthread_create(&t->thread[t->started], NULL, bgzf_thread, &t->stream[t->started + 1]) == 0)
+			t->started++;
+#endif
+	t->nthreads = threads;
+	luaL_getmetatable(L, BGZF_POOL_MT);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static int bgzfpool_close(lua_State *L)
+{
+	bgzf_threads_stop((bgzf_threads*)luaL_checkudata(L, 1, BGZF_POOL_MT));
+	return 0;
+}
+
+static int bgzfpool_gc(lua_State *L)
+{
+	bgzf_threads_stop((bgzf_threads*)lua_touserdata(L, 1));
+	return 0;
+}
+
+/* Read the pool option. Returns NULL if there is none. */
+static bgzf_threads *bgzf_getpool(lua_State *L, int arg)
+{
+	bgzf_threads *t = NULL;
+	lua_getfield(L, arg, "pool");
+	if (!lua_isnil(L, -1))
+	{
+		t = (bgzf_threads*)luaL_checkudata(L, -1, BGZF_POOL_MT);
+		luaL_argcheck(L, t->nthreads > 0, arg, "pool is closed");
+	}
+	lua_pop(L, 1);
+	return t;
+}
+
+/**
+ * Compress a string into BGZF blocks.
+ * Each block holds up to 65280 bytes of the string. An empty
+ * string gives the empty block that ends a BGZF file.
+ * options:
+ *   level=[0,9]
+ *   threads=[1,64]
+ *   pool=a bgzf_pool, used instead of new threads
+ */
+static int larc_zlib_bgzfcompress(lua_State *L)
+{
+	int level = Z_DEFAULT_COMPRESSION,
+		threads = 1,
+		i;
+	size_t len;
+	const char *str = larc_checkbytes(L, 1, &len);
+	bgzf_pool pool;
+	bgzf_threads *t = NULL;
+	luaL_Buffer B;
+
+	if (lua_gettop(L) > 1)
+	{
+		luaL_checktype(L, 2, LUA_TTABLE);
+		GETINTOPTION(2,level);
+		GETINTOPTION(2,threads);
+		t = bgzf_getpool(L, 2);
+	}
+	luaL_argcheck(L, level >= -1 && level <= 9, 2, "invalid compression level");
+	luaL_argcheck(L, threads >= 1 && threads <= BGZF_MAXTHREADS, 2, "invalid number of threads");
+
+	pool.njobs = len > 0 ? (len + BGZF_BLOCKSIZE - 1) / BGZF_BLOCKSIZE : 1;
+	pool.next = 0;
+	pool.level = level;
+	pool.jobs = (bgzf_job*)lua_newuserdata(L, pool.njobs * (sizeof(bgzf_job) + BGZF_MAXBLOCK));
+	for (i = 0; i < pool.njobs; i++)
+	{
+		bgzf_job *job = &pool.jobs[i];
+		job->in = (const unsigned char*)str + (size_t)i * BGZF_BLOCKSIZE;
+		job->inlen = i < pool.njobs - 1 ? BGZF_BLOCKSIZE : len - (size_t)i * BGZF_BLOCKSIZE;
+		job->out = (unsigned char*)(pool.jobs + pool.njobs) + (size_t)i * BGZF_MAXBLOCK;
+		job->status = Z_OK;
+		job->errmsg = NULL;
+	}
+	if (t != NULL)
+		bgzf_threads_run(t, &pool);
+	else
+		bgzf_run(&pool, threads);
+
+	for (i = 0; i < pool.njobs; i++)
+		if (pool.jobs[i].status != Z_OK)
+		{
+			lua_pushnil(L);
+			lua_pushstring(L, pool.jobs[i].errmsg);
+			lua_pushinteger(L, pool.jobs[i].status);
+			return 3;
+		}
+	luaL_buffinit(L, &B);
+	for (i = 0; i < pool.njobs; i++)
+		luaL_addlstring(&B, (const char*)pool.jobs[i].out, pool.jobs[i].outlen);
+	luaL_pushresult(&B);
+	return 1;
+}
+
+/* Find the size of the BGZF block at the start of a string.
+   Returns 0 if the string does not hold the whole block,
+   or -1 if it is not a BGZF block. */
+static long bgzf_blocksize(const unsigned char *p, size_t len)
+{
+	size_t xlen, i;
+	if (len < 12)
+		return 0;
+	if (p[0] != 31 || p[1] != 139 || p[2] != 8 || p[3] != 4)
+		return -1;
+	xlen = p[10] | (p[11] << 8);
+	if (len < 12 + xlen)
+		return 0;
+	for (i = 12; i + 4 <= 12 + xlen; i += 4 + (p[i+2] | (p[i+3] << 8)))
+	{
+		if (p[i] == 'B' && p[i+1] == 'C' && p[i+2] == 2 && p[i+3] == 0 && i + 6 <= 12 + xlen)
+		{
+			long size = (p[i+4] | (p[i+5] << 8)) + 1;
+			if ((size_t)size <= 12 + xlen + BGZF_FOOTERSIZE)
+				return -1;
+			return (size_t)size <= len ? size : 0;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Decompress the whole BGZF blocks at the start of a string.
+ * Returns the data, the number of bytes used, and a table with
+ * the compressed and uncompressed size of each block in turn.
+ * Returns nil,string,number if there is an error.
+ * options:
+ *   threads=[1,64]
+ *   pool=a bgzf_pool, used instead of new threads
+ */
+static int larc_zlib_bgzfdecompress(lua_State *L)
+{
+	int threads = 1,
+		i;
+	size_t len, used = 0, total = 0;
+	const unsigned char *str = (const unsigned char*)larc_checkbytes(L, 1, &len);
+	unsigned char *out;
+	bgzf_pool pool;
+	bgzf_threads *t = NULL;
+
+	if (lua_gettop(L) > 1)
+	{
+		luaL_checktype(L, 2, LUA_TTABLE);
+		GETINTOPTION(2,threads);
+		t = bgzf_getpool(L, 2);
+	}
+	luaL_argcheck(L, threads >= 1 && threads <= BGZF_MAXTHREADS, 2, "invalid number of threads");
+
+	/* Find the blocks. There is at least one byte of deflate data
+	   in each, so the string holds fewer than len/27 + 1 blocks. */
+	pool.njobs = 0;
+	pool.next = 0;
+	pool.level = BGZF_INFLATE;
+	pool.jobs = (bgzf_job*)lua_newuserdata(L, (len / 27 + 1) * sizeof(bgzf_job));
+	for (;;)
+	{
+		bgzf_job *job;
+		long size = bgzf_blocksize(str + used, len - used);
+		if (size == 0)
+			break;
+		if (size < 0)
+		{
+			lua_pushnil(L);
+			lua_pushliteral(L, "not a BGZF block");
+			lua_pushinteger(L, Z_DATA_ERROR);
+			return 3;
+		}
+		job = &pool.jobs[pool.njobs++];
+		job->in = str + used;
+		job->inlen = size;
+		job->outlen = bgzf_getlong(str + used + size - 4);
+		job->status = Z_OK;
+		job->errmsg = NULL;
+		if (job->outlen > BGZF_MAXBLOCK)
+		{
+			lua_pushnil(L);
+			lua_pushliteral(L, "incorrect block length");
+			lua_pushinteger(L, Z_DATA_ERROR);
+			return 3;
+		}
+		used += size;
+		total += job->outlen;
+	}
+
+	out = (unsigned char*)lua_newuserdata(L, total);
+	total = 0;
+	for (i = 0; i < pool.njobs; i++)
+	{
+		pool.jobs[i].out = out + total;
+		total += pool.jobs[i].outlen;
+	}
+	if (pool.njobs > 0 && t != NULL)
+		bgzf_threads_run(t, &pool);
+	else if (pool.njobs > 0)
+		bgzf_run(&pool, threads);
+
+	for (i = 0; i < pool.njobs; i++)
+		if (pool.jobs[i].status != Z_OK)
+		{
+			lua_pushnil(L);
+			lua_pushstring(L, pool.jobs[i].errmsg);
+			lua_pushinteger(L, pool.jobs[i].status);
+			return 3;
+		}
+	lua_pushlstring(L, (const char*)out, total);
+	lua_pushinteger(L, used);
+	lua_createtable(L, pool.njobs * 2, 0);
+	for (i = 0; i < pool.njobs; i++)
+	{
+		lua_pushinteger(L, pool.jobs[i].inlen);
+		lua_rawseti(L, -2, i * 2 + 1);
+		lua_pushinteger(L, pool.jobs[i].outlen);
+		lua_rawseti(L, -2, i * 2 + 2);
+	}
+	return 3;
+}
+
 /**
  * Compute the CRC32 hash of a string.
  */
@@ -422,6 +1275,40 @@ static int larc_zlib_crc32combine(lua_State *L)
 	return 1;
 }
 
+/**
+ * Compute the CRC32 hash of a string of zero bytes,
+ * or extend a hash with zero bytes, without reading
+ * the bytes.
+ */
+static int larc_zlib_crc32zeros(lua_State *L)
+{
+	unsigned long crc;
+	lua_Number count;
+	
+	if (lua_gettop(L) < 2)
+	{
+		crc = crc32(0, NULL, 0);
+		count = luaL_checknumber(L, 1);
+	}
+	else
+	{
+		crc = lua_isnil(L, 1) ? crc32(0, NULL, 0) : (unsigned long)luaL_checknumber(L, 1);
+		count = luaL_checknumber(L, 2);
+	}
+	/* Appending zeros to the bare CRC register is multiplication by a
+	   power of x, which is what crc32_combine does with a zero CRC. */
+	crc ^= 0xFFFFFFFFUL;
+	while (count > 0)
+	{
+		long n = count < 0x40000000 ? (long)count : 0x40000000;
+		crc = crc32_combine(crc, 0, n);
+		count -= n;
+	}
+	crc ^= 0xFFFFFFFFUL;
+	lua_pushnumber(L, crc);
+	return 1;
+}
+
 /**
  * Compute the Adler32 hash of a string.
  */
@@ -469,6 +1356,626 @@ static int larc_zlib_adler32combine(lua_State *L)
 }
 
 
+/**
+ * Native gzip file objects.
+ * The object keeps its own input and output buffers over a C FILE,
+ * so reading lines or blocks does not go through Lua for each chunk.
+ */
+
+#define GZBUFSIZE	65536
+#define GZNAMEMAX	1024
+#define GZEXTRAMAX	4096
+
+typedef struct gzfile_userdata
+{
+	z_stream z;
+	gz_header head;
+	FILE *file;	/* owned file, or NULL to use the handle */
+	int handle;	/* reference to the io handle */
+	int fields;	/* reference to the table of header fields */
+	int writing;
+	int closed;
+	int status;
+	int eof;	/* no more compressed input */
+	long start;	/* file offset of the gzip stream */
+	double pos;	/* uncompressed position */
+	size_t bufsize;
+	unsigned char *in;
+	unsigned char *out;
+	size_t outpos, outend;	/* unread data when reading, pending data when writing */
+	Bytef name[GZNAMEMAX];
+	Bytef comment[GZNAMEMAX];
+	Bytef extra[GZEXTRAMAX];
+} gzfile_userdata;
+
+static const char *const gz_os_names[] = {
+	"msdos","amiga","vms","unix","vm/cms","atari","os/2","macos",
+	"z-system","cp/m","tops-20","windows","qdos","riscos",NULL,"prime"
+};
+
+static gzfile_userdata *gzfile_check(lua_State *L, int idx)
+{
+	gzfile_userdata *gz = (gzfile_userdata*)luaL_checkudata(L, idx, GZFILE_MT);
+	if (gz->closed)
+		luaL_error(L, "attempt to use a closed file");
+	return gz;
+}
+
+static FILE *gzfile_file(lua_State *L, gzfile_userdata *gz)
+{
+	FILE *f = gz->file;
+	if (f == NULL)
+	{
+		lua_rawgeti(L, LUA_REGISTRYINDEX, gz->handle);
+		f = larc_tofile(L, -1);
+		lua_pop(L, 1);
+		if (f == NULL)
+			luaL_error(L, "attempt to use a closed file");
+	}
+	return f;
+}
+
+/* Decompress more data into the output buffer.
+   Returns the number of bytes available, 0 at the end of the file. */
+static size_t gzfile_fill(lua_State *L, gzfile_userdata *gz)
+{
+	if (gz->outpos == gz->outend)
+		gz->outpos = gz->outend = 0;
+	while (gz->outpos == gz->outend)
+	{
+		if (gz->z.avail_in == 0 && !gz->eof)
+		{
+			FILE *f = gzfile_file(L, gz);
+			size_t n = fread(gz->in, 1, gz->bufsize, f);
+			if (n == 0)
+			{
+				if (ferror(f))
+					luaL_error(L, "error reading gzip file");
+				gz->eof = 1;
+			}
+			gz->z.next_in = gz->in;
+			gz->z.avail_in = n;
+		}
+		if (gz->status == Z_STREAM_END)
+		{
+			/* another gzip member may follow */
+			if (gz->z.avail_in == 0 || gz->z.next_in[0] != 31)
+				return 0;
+			inflateReset(&gz->z);
+			inflateGetHeader(&gz->z, &gz->head);
+		}
+		gz->z.next_out = gz->out + gz->outend;
+		gz->z.avail_out = gz->bufsize - gz->outend;
+		gz->status = inflate(&gz->z, Z_NO_FLUSH);
+		gz->outend = gz->bufsize - gz->z.avail_out;
+		if (gz->status == Z_BUF_ERROR && gz->eof)
+			luaL_error(L, "unexpected end of gzip file");
+		if (gz->status != Z_OK && gz->status != Z_STREAM_END && gz->status != Z_BUF_ERROR)
+			luaL_error(L, "%s", gz->z.msg ? gz->z.msg : zError(gz->status));
+	}
+	return gz->outend - gz->outpos;
+}
+
+static int gzfile_readline(lua_State *L, gzfile_userdata *gz, int keepnl)
+{
+	luaL_Buffer B;
+	size_t total = 0;
+	luaL_buffinit(L, &B);
+	for (;;)
+	{
+		size_t avail = gzfile_fill(L, gz);
+		const char *p = (const char*)gz->out + gz->outpos;
+		const char *nl;
+		if (avail == 0)
+			break;
+		nl = (const char*)memchr(p, '\n', avail);
+		if (nl != NULL)
+		{
+			size_t n = nl - p + 1;
+			luaL_addlstring(&B, p, keepnl ? n : n - 1);
+			gz->outpos += n;
+			gz->pos += n;
+			luaL_pushresult(&B);
+			return 1;
+		}
+		luaL_addlstring(&B, p, avail);
+		gz->outpos += avail;
+		gz->pos += avail;
+		total += avail;
+	}
+	luaL_pushresult(&B);
+	if (total == 0)
+	{
+		lua_pop(L, 1);
+		lua_pushnil(L);
+	}
+	return 1;
+}
+
+static int gzfile_readbytes(lua_State *L, gzfile_userdata *gz, size_t size)
+{
+	luaL_Buffer B;
+	size_t total = 0;
+	luaL_buffinit(L, &B);
+	while (total < size)
+	{
+		size_t avail = gzfile_fill(L, gz);
+		if (avail == 0)
+			break;
+		if (avail > size - total)
+			avail = size - total;
+		luaL_addlstring(&B, (const char*)gz->out + gz->outpos, avail);
+		gz->outpos += avail;
+		gz->pos += avail;
+		total += avail;
+	}
+	luaL_pushresult(&B);
+	if (total == 0 && (size > 0 || gzfile_fill(L, gz) == 0))
+	{
+		lua_pop(L, 1);
+		lua_pushnil(L);
+	}
+	return 1;
+}
+
+/**
+ * Read from a gzip file.
+ * The formats are those of file:read except "*n".
+ */
+static int gzfile_read(lua_State *L)
+{
+	gzfile_userdata *gz = gzfile_check(L, 1);
+	int n, nargs = lua_gettop(L) - 1;
+	if (gz->writing)
+		return luaL_error(L, "gzip file is not open for reading");
+	if (nargs == 0)
+		return gzfile_readline(L, gz, 0);
+	luaL_checkstack(L, nargs, "too many arguments");
+	for (n = 2; n <= nargs + 1; n++)
+	{
+		if (lua_type(L, n) == LUA_TNUMBER)
+			gzfile_readbytes(L, gz, (size_t)luaL_checknumber(L, n));
+		else
+		{
+			const char *p = luaL_checkstring(L, n);
+			if (*p == '*')
+				p++;
+			switch (*p)
+			{
+			case 'l':
+				gzfile_readline(L, gz, 0);
+				break;
+			case 'L':
+				gzfile_readline(L, gz, 1);
+				break;
+			case 'a':
+				gzfile_readbytes(L, gz, ~(size_t)0);
+				if (lua_isnil(L, -1))
+				{
+					lua_pop(L, 1);
+					lua_pushliteral(L, "");
+				}
+				break;
+			default:
+				return luaL_argerror(L, n, "invalid format");
+			}
+		}
+		if (lua_isnil(L, -1))
+			break;
+	}
+	return lua_gettop(L) - nargs - 1;
+}
+
+static int gzfile_lines_iter(lua_State *L)
+{
+	gzfile_userdata *gz = gzfile_check(L, lua_upvalueindex(1));
+	return gzfile_readline(L, gz, 0);
+}
+
+/**
+ * Iterate over the lines of a gzip file.
+ */
+static int gzfile_lines(lua_State *L)
+{
+	gzfile_userdata *gz = gzfile_check(L, 1);
+	if (gz->writing)
+		return luaL_error(L, "gzip file is not open for reading");
+	lua_settop(L, 1);
+	lua_pushcclosure(L, gzfile_lines_iter, 1);
+	return 1;
+}
+
+/* Write the pending compressed data. */
+static int gzfile_flushout(lua_State *L, gzfile_userdata *gz)
+{
+	if (gz->outend > 0)
+	{
+		FILE *f = gzfile_file(L, gz);
+		if (fwrite(gz->out, 1, gz->outend, f) != gz->outend)
+			return 0;
+		gz->outend = 0;
+	}
+	return 1;
+}
+
+/* Compress a block of data. Returns 0 if writing to the file failed. */
+static int gzfile_deflate(lua_State *L, gzfile_userdata *gz, const char *s, size_t len, int flush)
+{
+	gz->z.next_in = (Bytef*)s;
+	gz->z.avail_in = len;
+	for (;;)
+	{
+		gz->z.next_out = gz->out + gz->outend;
+		gz->z.avail_out = gz->bufsize - gz->outend;
+		gz->status = deflate(&gz->z, flush);
+		gz->outend = gz->bufsize - gz->z.avail_out;
+		if (gz->status == Z_STREAM_ERROR)
+			return luaL_error(L, "%s", zError(gz->status));
+		if (gz->outend == gz->bufsize)
+		{
+			if (!gzfile_flushout(L, gz))
+				return 0;
+			continue;
+		}
+		if (flush == Z_FINISH ? gz->status == Z_STREAM_END : gz->z.avail_in == 0)
+			break;
+	}
+	gz->pos += len;
+	return 1;
+}
+
+static int gzfile_ioerror(lua_State *L)
+{
+	lua_pushnil(L);
+	lua_pushliteral(L, "error writing gzip file");
+	return 2;
+}
+
+/**
+ * Write strings or numbers to a gzip file.
+ */
+static int gzfile_write(lua_State *L)
+{
+	gzfile_userdata *gz = gzfile_check(L, 1);
+	int n, nargs = lua_gettop(L);
+	if (!gz->writing)
+		return luaL_error(L, "gzip file is not open for writing");
+	for (n = 2; n <= nargs; n++)
+	{
+		size_t len;
+		const char *s = luaL_checklstring(L, n, &len);
+		if (!gzfile_deflate(L, gz, s, len, Z_NO_FLUSH))
+			return gzfile_ioerror(L);
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* Write `count' zero bytes. */
+static int gzfile_zeros(lua_State *L, gzfile_userdata *gz, double count)
+{
+	while (count > 0)
+	{
+		size_t n = count < ZEROBLOCKSIZE ? (size_t)count : ZEROBLOCKSIZE;
+		if (!gzfile_deflate(L, gz, zero_block, n, Z_NO_FLUSH))
+			return 0;
+		count -= n;
+	}
+	return 1;
+}
+
+/* Return to the start of the gzip stream. */
+static int gzfile_rewind(lua_State *L, gzfile_userdata *gz)
+{
+	if (gz->start < 0 || fseek(gzfile_file(L, gz), gz->start, SEEK_SET) != 0)
+		return 0;
+	inflateReset(&gz->z);
+	inflateGetHeader(&gz->z, &gz->head);
+	gz->z.avail_in = 0;
+	gz->status = Z_OK;
+	gz->eof = 0;
+	gz->outpos = gz->outend = 0;
+	gz->pos = 0;
+	return 1;
+}
+
+/**
+ * Seek in a gzip file.
+ * Reading seeks forward by decompressing and backward by starting over.
+ * Writing can only seek forward, which writes zeros.
+ */
+static int gzfile_seek(lua_State *L)
+{
+	static const char *const modes[] = {"set","cur","end",NULL};
+	gzfile_userdata *gz = gzfile_check(L, 1);
+	int op = luaL_checkoption(L, 2, "cur", modes);
+	double target = luaL_optnumber(L, 3, 0);
+	if (op == 2)
+		return luaL_argerror(L, 2, "cannot seek from end of a gzip file");
+	if (op == 1)
+		target += gz->pos;
+	if (target < 0)
+	{
+		lua_pushnil(L);
+		lua_pushliteral(L, "invalid position");
+		return 2;
+	}
+	if (gz->writing)
+	{
+		if (target < gz->pos)
+			return luaL_error(L, "attempt to seek backwards while writing a gzip file");
+		if (!gzfile_zeros(L, gz, target - gz->pos))
+			return gzfile_ioerror(L);
+	}
+	else
+	{
+		if (target < gz->pos && !gzfile_rewind(L, gz))
+		{
+			lua_pushnil(L);
+			lua_pushliteral(L, "file handle cannot seek backwards");
+			return 2;
+		}
+		while (gz->pos < target)
+		{
+			size_t avail = gzfile_fill(L, gz);
+			if (avail == 0)
+				break;
+			if (avail > target - gz->pos)
+				avail = (size_t)(target - gz->pos);
+			gz->outpos += avail;
+			gz->pos += avail;
+		}
+	}
+	lua_pushnumber(L, gz->pos);
+	return 1;
+}
+
+/* Finish the stream, unless `abandon' is set, and release the file. */
+static int gzfile_finish(lua_State *L, gzfile_userdata *gz, int abandon)
+{
+	int ok = 1;
+	if (gz->writing && abandon)
+		deflateEnd(&gz->z);
+	else if (gz->writing)
+	{
+		ok = gzfile_deflate(L, gz, "", 0, Z_FINISH) && gzfile_flushout(L, gz);
+		deflateEnd(&gz->z);
+	}
+	else
+		inflateEnd(&gz->z);
+	gz->closed = 1;
+	if (gz->file != NULL)
+	{
+		if (fclose(gz->file) != 0)
+			ok = 0;
+		gz->file = NULL;
+	}
+	else if (gz->writing)
+	{
+		lua_rawgeti(L, LUA_REGISTRYINDEX, gz->handle);
+		if (larc_tofile(L, -1) != NULL)
+			fflush(larc_tofile(L, -1));
+		lua_pop(L, 1);
+	}
+	luaL_unref(L, LUA_REGISTRYINDEX, gz->handle);
+	gz->handle = LUA_NOREF;
+	return ok;
+}
+
+/**
+ * Close a gzip file. A file being written is finished first.
+ * An io handle that was passed to gzopen is left open.
+ */
+static int gzfile_close(lua_State *L)
+{
+	gzfile_userdata *gz = gzfile_check(L, 1);
+	if (!gzfile_finish(L, gz, 0))
+		return gzfile_ioerror(L);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int gzfile_gc(lua_State *L)
+{
+	gzfile_userdata *gz = (gzfile_userdata*)lua_touserdata(L, 1);
+	if (!gz->closed)	/* the handle may already be closed */
+		gzfile_finish(L, gz, gz->file == NULL);
+	luaL_unref(L, LUA_REGISTRYINDEX, gz->handle);
+	gz->handle = LUA_NOREF;
+	luaL_unref(L, LUA_REGISTRYINDEX, gz->fields);
+	gz->fields = LUA_NOREF;
+	return 0;
+}
+
+static int gzfile_tostring(lua_State *L)
+{
+	gzfile_userdata *gz = (gzfile_userdata*)luaL_checkudata(L, 1, GZFILE_MT);
+	if (gz->closed)
+		lua_pushliteral(L, "gzip file (closed)");
+	else
+		lua_pushfstring(L, "gzip file (%p)", (void*)gz);
+	return 1;
+}
+
+/* Methods first, then the header fields. */
+static int gzfile_index(lua_State *L)
+{
+	gzfile_userdata *gz = (gzfile_userdata*)luaL_checkudata(L, 1, GZFILE_MT);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, lua_upvalueindex(1));
+	if (lua_isnil(L, -1) && gz->fields != LUA_NOREF)
+	{
+		lua_rawgeti(L, LUA_REGISTRYINDEX, gz->fields);
+		lua_pushvalue(L, 2);
+		lua_rawget(L, -2);
+	}
+	return 1;
+}
+
+/* Make the table of header fields like the ones of larc.gzfile. */
+static void gzfile_setfields(lua_State *L, gzfile_userdata *gz)
+{
+	lua_newtable(L);
+	if (gz->head.done == 1)
+	{
+		lua_pushnumber(L, gz->head.time);
+		lua_setfield(L, -2, "time");
+		if (gz->head.os < 16 && gz_os_names[gz->head.os] != NULL)
+			lua_pushstring(L, gz_os_names[gz->head.os]);
+		else
+			lua_pushfstring(L, "unknown (%d)", gz->head.os);
+		lua_setfield(L, -2, "os");
+		if (gz->head.name != Z_NULL)
+		{
+			lua_pushstring(L, (const char*)gz->head.name);
+			lua_setfield(L, -2, "filename");
+		}
+		if (gz->head.comment != Z_NULL)
+		{
+			lua_pushstring(L, (const char*)gz->head.comment);
+			lua_setfield(L, -2, "comment");
+		}
+		if (gz->head.extra != Z_NULL)
+		{
+			size_t i = 0, len = gz->head.extra_len < GZEXTRAMAX ? gz->head.extra_len : GZEXTRAMAX;
+			lua_newtable(L);
+			while (i + 4 <= len)
+			{
+				size_t sublen = gz->extra[i+2] | (gz->extra[i+3] << 8);
+				if (sublen > len - i - 4)
+					sublen = len - i - 4;
+				lua_pushlstring(L, (const char*)gz->extra + i, 2);
+				lua_pushlstring(L, (const char*)gz->extra + i + 4, sublen);
+				lua_rawset(L, -3);
+				i += 4 + sublen;
+			}
+			lua_setfield(L, -2, "extra");
+		}
+	}
+	gz->fields = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+/**
+ * Open a gzip file for reading or writing.
+ * The file is a file name or an io handle. The mode is "r" or "w",
+ * and the level is [1,9] when writing.
+ * Returns a file object with read, lines, write, seek and close methods
+ * and the header fields time, os, filename, comment and extra.
+ */
+static int larc_zlib_gzopen(lua_State *L)
+{
+	const char *mode = luaL_optstring(L, 2, "r");
+	int level = luaL_optint(L, 3, 6);
+	int writing = (strchr(mode, 'w') != NULL);
+	const char *filename = NULL;
+	gzfile_userdata *gz;
+	FILE *f;
+	if (!writing && strchr(mode, 'r') == NULL)
+		return luaL_argerror(L, 2, "invalid mode");
+	luaL_argcheck(L, level >= 1 && level <= 9, 3, "invalid compression level");
+	lua_settop(L, 1);
+	gz = (gzfile_userdata*)lua_newuserdata(L, sizeof(gzfile_userdata) + 2*GZBUFSIZE);
+	memset(gz, 0, sizeof(gzfile_userdata));
+	gz->handle = gz->fields = LUA_NOREF;
+	gz->closed = 1;
+	gz->writing = writing;
+	gz->bufsize = GZBUFSIZE;
+	gz->in = (unsigned char*)(gz + 1);
+	gz->out = gz->in + GZBUFSIZE;
+	luaL_getmetatable(L, GZFILE_MT);
+	lua_setmetatable(L, -2);
+	if (lua_type(L, 1) == LUA_TSTRING)
+	{
+		filename = lua_tostring(L, 1);
+		gz->file = fopen(filename, writing ? "wb" : "rb");
+		if (gz->file == NULL)
+		{
+			lua_pushnil(L);
+			lua_pushfstring(L, "%s: cannot open file", filename);
+			return 2;
+		}
+		f = gz->file;
+	}
+	else
+	{
+		f = larc_tofile(L, 1);
+		luaL_argcheck(L, f != NULL, 1, "file name or open file expected");
+		lua_pushvalue(L, 1);
+		gz->handle = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	gz->start = ftell(f);
+	if (writing)
+		gz->status = deflateInit2(&gz->z, level, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY);
+	else
+		gz->status = inflateInit2(&gz->z, 15+16);
+	if (gz->status != Z_OK)
+	{
+		if (gz->file != NULL)
+			fclose(gz->file);
+		gz->file = NULL;
+		luaL_unref(L, LUA_REGISTRYINDEX, gz->handle);
+		gz->handle = LUA_NOREF;
+		lua_pushnil(L);
+		lua_pushstring(L, zError(gz->status));
+		return 2;
+	}
+	gz->closed = 0;
+	if (writing)
+	{
+		gz->head.os = 255;
+		if (filename != NULL)
+		{
+			size_t len = strlen(filename);
+			if (len >= 3 && strcmp(filename + len - 3, ".gz") == 0)
+				len -= 3;
+			if (len >= GZNAMEMAX)
+				len = GZNAMEMAX - 1;
+			memcpy(gz->name, filename, len);
+			gz->head.name = gz->name;
+			lua_newtable(L);
+			lua_pushlstring(L, filename, len);
+			lua_setfield(L, -2, "filename");
+			gz->fields = luaL_ref(L, LUA_REGISTRYINDEX);
+		}
+		deflateSetHeader(&gz->z, &gz->head);
+	}
+	else
+	{
+		size_t n;
+		gz->head.name = gz->name;
+		gz->head.name_max = GZNAMEMAX;
+		gz->head.comment = gz->comment;
+		gz->head.comm_max = GZNAMEMAX;
+		gz->head.extra = gz->extra;
+		gz->head.extra_max = GZEXTRAMAX;
+		inflateGetHeader(&gz->z, &gz->head);
+		n = fread(gz->in, 1, gz->bufsize, f);
+		if (n < 10 || gz->in[0] != 31 || gz->in[1] != 139)
+		{
+			gzfile_finish(L, gz, 1);
+			lua_pushnil(L);
+			lua_pushliteral(L, "Not a valid gzip file");
+			return 2;
+		}
+		gz->z.next_in = gz->in;
+		gz->z.avail_in = n;
+		gzfile_fill(L, gz);
+		gzfile_setfields(L, gz);
+	}
+	return 1;
+}
+
+static const luaL_Reg larc_gzfile_Reg[] = 
+{
+	{"read", gzfile_read},
+	{"lines", gzfile_lines},
+	{"write", gzfile_write},
+	{"seek", gzfile_seek},
+	{"close", gzfile_close},
+	{NULL, NULL}
+};
+
+
 #ifdef _WIN32
 #undef LUAMOD_API
 #define LUAMOD_API      __declspec(dllexport)
@@ -480,10 +1987,20 @@ static const luaL_Reg larc_zlib_Reg[] =
 	{"decompress", larc_zlib_decompress},
 	{"compressor", larc_zlib_compressor},
 	{"decompressor", larc_zlib_decompressor},
+	{"copy", larc_zlib_copy},
+	{"readahead", larc_zlib_readahead},
+	{"readline", larc_readline},
+	{"lines", larc_lines},
+	{"bufsize", larc_bufsize},
+	{"bgzf_compress", larc_zlib_bgzfcompress},
+	{"bgzf_decompress", larc_zlib_bgzfdecompress},
+	{"bgzf_pool", larc_zlib_bgzfpool},
 	{"crc32", larc_zlib_crc32},
 	{"crc32_combine", larc_zlib_crc32combine},
+	{"crc32_zeros", larc_zlib_crc32zeros},
 	{"adler32", larc_zlib_adler32},
 	{"adler32_combine", larc_zlib_adler32combine},
+	{"gzopen", larc_zlib_gzopen},
 	{NULL, NULL}
 };
 
@@ -497,6 +2014,25 @@ LUAMOD_API int luaopen_larc_zlib(lua_State *L)
 	lua_pushcfunction(L, inflate_userdata_gc);
 	lua_setfield(L, -2, "__gc");
 	lua_pop(L, 1);
+	luaL_newmetatable(L, GZFILE_MT);
+	lua_pushcfunction(L, gzfile_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, gzfile_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_newtable(L);
+	luaL_register(L, NULL, larc_gzfile_Reg);
+	lua_pushcclosure(L, gzfile_index, 1);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+	luaL_newmetatable(L, BGZF_POOL_MT);
+	lua_pushcfunction(L, bgzfpool_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_newtable(L);
+	lua_pushcfunction(L, bgzfpool_close);
+	lua_setfield(L, -2, "close");
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+	larc_readahead_register(L);
 	luaL_register(L, "larc.zlib", larc_zlib_Reg);
 	lua_pushstring(L, zlibVersion());
 	lua_setfield(L, -2, "ZLIB_VERSION");
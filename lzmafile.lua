@@ -30,6 +30,8 @@ local find,match = string.find,string.match
 local iopen = io.open
 
 local lzma = require"larc.lzma"
+local readline,linesiter = lzma.readline,lzma.lines
+local choose_bufsize = lzma.bufsize
 
 module"larc.lzmafile"
 
@@ -38,108 +40,99 @@ module"larc.lzmafile"
 local lzma_reader = {}
 local lzma_writer = {}
 
---[[Support the "*line" read argument.
+--[[Decompress the next chunk of the file.
+    Returns nil at the end of the file.
   ]]
-local function read_line(lz)
-  if lz._eof and #lz._buffer == 0 then
+local function read_chunk(lz)
+  if lz._eof then
     return nil
   end
-  local handle, process = lz._handle, lz._process
-  local buffer = {}
-  local outbuf = lz._buffer
-  local buflen = #outbuf
-  local pos = find(outbuf, "\n", 1, true)
-  while not pos and not lz._eof do
-    buffer[#buffer+1] = outbuf
-    local inbuf = handle:read(1024)
-    if not inbuf then
+  local readahead = lz._readahead
+  if readahead then
+    local outbuf,errmsg,errnum = readahead:read()
+    if not outbuf then
+      assert(not errmsg, errmsg, errnum)
       lz._eof = true
-      break
     end
-    local errmsg,errnum
-    outbuf,errmsg,errnum = process(inbuf)
-    assert(errnum>=0, errmsg, errnum)
-    if errnum == lzma.LZMA_STREAM_END then
-      lz._eof = true
-    end
-    buflen = buflen + #outbuf
-    pos = find(outbuf, "\n", 1, true)
+    return outbuf
   end
-  if buflen == 0 then
+  local inbuf = lz._handle:read(lz._bufsize)
+  if not inbuf then
+    lz._eof = true
     return nil
   end
-  if pos then
-    lz._buffer = sub(outbuf, pos+1)
-    lz._pos = lz._pos + buflen + pos - #outbuf
-    buffer[#buffer+1] = sub(outbuf, 1, pos-1)
-  else
-    lz._buffer = ""
-    lz._pos = lz._pos + buflen
-    buffer[#buffer+1] = outbuf
+  local outbuf,errmsg,errnum = lz._process(inbuf)
+  assert(errnum>=0, errmsg, errnum)
+  if errnum == lzma.LZMA_STREAM_END then
+    lz._eof = true
   end
-  return concat(buffer)
+  return outbuf
+end
+
+--[[Drop the part of the buffer already returned
+    by read_line.
+  ]]
+local function trim_buffer(lz)
+  if lz._offset > 0 then
+    lz._buffer = sub(lz._buffer, lz._offset+1)
+    lz._offset = 0
+  end
+end
+
+--[[Support the "*line" read argument.
+    The line is found in the buffer by readline without
+    copying the rest of the buffer.
+  ]]
+local function read_line(lz)
+  return readline(lz, read_chunk)
 end
 
 --[[Support the "*all" read argument.
   ]]
 local function read_all(lz)
+  trim_buffer(lz)
   if lz._eof and #lz._buffer == 0 then
     return ""
   end
-  local handle, process = lz._handle, lz._process
   local buffer = { lz._buffer }
   local buflen = #buffer[1]
   lz._buffer = ""
-  while not lz._eof do
-    local inbuf = handle:read(1024)
-    if not inbuf then
-      lz._eof = true
-      break
-    end
-    local outbuf,errmsg,errnum = process(inbuf)
-    assert(errnum>=0, errmsg, errnum)
-    if errnum == lzma.LZMA_STREAM_END then
-      lz._eof = true
-    end
+  local outbuf = read_chunk(lz)
+  while outbuf do
     buflen = buflen + #outbuf
     buffer[#buffer+1] = outbuf
+    outbuf = read_chunk(lz)
   end
   lz._pos = lz._pos + buflen
-  buffer = concat(buffer)
-  return buffer
+  return concat(buffer)
 end
 
 --[[Read up to ''size'' bytes from a lzmafile.
   ]]
 local function read_bytes(lz, size)
+  trim_buffer(lz)
   if lz._eof and #lz._buffer == 0 then
     return nil
   end
   if size <= 0 then
     return ""
   end
-  local handle, process = lz._handle, lz._process
   local buffer = {}
   local outbuf = lz._buffer
   local buflen = #outbuf
-  while buflen < size and not lz._eof do
-    buffer[#buffer+1] = outbuf
-    local inbuf = handle:read(1024)
-    if not inbuf then
-      lz._eof = true
+  while buflen < size do
+    local chunk = read_chunk(lz)
+    if not chunk then
       break
     end
-    local errmsg,errnum
-    outbuf,errmsg,errnum = process(inbuf)
-    assert(errnum>=0, errmsg, errnum)
-    if errnum == lzma.LZMA_STREAM_END then
-      lz._eof = true
-    end
+    buffer[#buffer+1] = outbuf
+    outbuf = chunk
     buflen = buflen + #outbuf
   end
   if buflen == 0 then
     return nil
   end
+  -- pos is the offset from the end of the buffer
   local pos = size - buflen
   lz._buffer = sub(outbuf, #outbuf+pos+1)
   lz._pos = lz._pos + buflen + pos
@@ -170,29 +163,30 @@ function lzma_reader:read(size)
   return read_bytes(self, tonumber(size))
 end
 
+--[[Standard file handle lines method.
+  ]]
+function lzma_reader:lines()
+  assert(self._handle, "attempt to read from a closed file")
+  return linesiter(self, read_chunk)
+end
+
 --[[Skip ahead in the file.
     Basically the same as read_bytes but just 
     discards the bytes.
   ]]
 local function read_skip(lz, size)
+  trim_buffer(lz)
   if size <= 0 or (lz._eof and #lz._buffer == 0) then
     return lz._pos
   end
-  local handle, process = lz._handle, lz._process
   local outbuf = lz._buffer
   local bytesread = #outbuf
-  while bytesread < size and not lz._eof do
-    local inbuf = handle:read(1024)
-    if not inbuf then
-      lz._eof = true
+  while bytesread < size do
+    local chunk = read_chunk(lz)
+    if not chunk then
       break
     end
-    local errmsg,errnum
-    outbuf,errmsg,errnum = process(inbuf)
-    assert(errnum>=0, errmsg, errnum)
-    if errnum == lzma.LZMA_STREAM_END then
-      lz._eof = true
-    end
+    outbuf = chunk
     bytesread = bytesread + #outbuf
   end
   -- pos is the offset from the end of the buffer
@@ -207,13 +201,22 @@ end
     support seeking.
   ]]
 local function read_rewind(lz, newpos)
+  -- Stop the readahead before moving the file.
+  local readahead = lz._readahead
+  if readahead then
+    readahead:close()
+  end
   -- Return to the start of the compressed stream.
   assert(lz._lzstreamstart and
       lz._handle:seek("set",lz._lzstreamstart), "file handle cannot seek backwards")
   lz._eof = false
   lz._pos = 0
   lz._buffer = ""
+  lz._offset = 0
   lz._process = lzma.decompressor{format="lzma"}
+  if readahead then
+    lz._readahead = lzma.readahead(lz._handle, {format="lzma", bufsize=lz._bufsize})
+  end
   return read_skip(lz, newpos)
 end
 
@@ -246,6 +249,10 @@ end
     for a lzmafile in read mode.
   ]]
 function lzma_reader:close()
+  if self._readahead then
+    self._readahead:close()
+    self._readahead = nil
+  end
   if self._ownhandle then
     self._handle:close()
     self._ownhandle = nil
@@ -254,22 +261,47 @@ function lzma_reader:close()
   return true
 end
 
---[[Convert values to strings and write to
-    a lzmafile.
+--[[Pass the buffered values through the compressor
+    and write the result to the file. With ''sync'', the
+    compressor is flushed so all of it can be read back.
   ]]
-local function write_values(lz, val, ...)
-  if not val then
+local function write_pending(lz, sync)
+  if lz._pendinglen == 0 and not sync then
     return lz
   end
-  local outbuf,errnum = lz._process(tostring(val))
+  local str = concat(lz._pending)
+  lz._pending = {}
+  lz._pendinglen = 0
+  local outbuf,errmsg,errnum = lz._process(str, sync)
   if errnum < 0 then
-    return nil,errnum
+    return nil,errmsg,errnum
   end
   local res,message = lz._handle:write(outbuf)
   if not res then
-    return res,message
+    return nil,message
   end
+  return lz
+end
+
+--[[Convert values to strings and add them to the
+    write buffer. The buffer is compressed when it
+    holds at least ''_bufsize'' bytes.
+  ]]
+local function write_values(lz, val, ...)
+  if not val then
+    return lz
+  end
+  val = tostring(val)
+  local pending = lz._pending
+  pending[#pending+1] = val
+  lz._pendinglen = lz._pendinglen + #val
   lz._size = lz._size + #val
+  if lz._pendinglen >= lz._bufsize then
+    local res,errmsg,errnum = write_pending(lz)
+    if not res then
+      return nil,errmsg,errnum
+    end
+  end
   return write_values(lz, ...)
 end
 
@@ -280,19 +312,42 @@ function lzma_writer:write(...)
   return write_values(self, ...)
 end
 
+--[[Standard flush method.
+    Compresses the buffered data and flushes the file
+    handle. The lzma format has no sync flush, so the
+    compressor may keep back some of the data until the
+    file is closed.
+  ]]
+function lzma_writer:flush()
+  assert(self._handle, "attempt to write to a closed file")
+  local res,errmsg,errnum = write_pending(self, true)
+  if not res then
+    return nil,errmsg,errnum
+  end
+  if self._handle.flush then
+    self._handle:flush()
+  end
+  return self
+end
+
 --[[Standard file handle seek.
     Can only seek forward while writing a gzfile.
   ]]
 function lzma_writer:seek(whence, newpos)
   whence = whence or "cur"
   newpos = newpos or 0
+  local res,errmsg,errnum = write_pending(self)
+  if not res then
+    return nil,errmsg,errnum
+  end
+  local bufsize = self._bufsize
   if whence == "set" then
     newpos = newpos - self._size
   end
   assert(newpos>=0, "attempt to seek backwards while writing a lzmafile")
-  if newpos > 1024 then
-    local str = strrep('\0', 1024)
-    while newpos >= 1024 do
+  if newpos > bufsize then
+    local str = strrep('\0', bufsize)
+    while newpos >= bufsize do
       local outbuf,errmsg,errnum = self._process(str)
       if errnum < 0 then
         return nil,errmsg,errnum
@@ -301,8 +356,8 @@ function lzma_writer:seek(whence, newpos)
       if not res then
         return nil,message
       end
-      self._size = self._size + 1024
-      newpos = newpos - 1024
+      self._size = self._size + bufsize
+      newpos = newpos - bufsize
     end
   end
   if newpos > 0 then
@@ -325,7 +380,12 @@ end
   ]]
 function lzma_writer:close()
   if self._handle then
-    local outbuf,errmsg,errnum = self._process(nil)
+    local res,errmsg,errnum = write_pending(self)
+    if not res then
+      return nil,errmsg,errnum
+    end
+    local outbuf
+    outbuf,errmsg,errnum = self._process(nil)
     if outbuf then
       self._handle:write(outbuf)
     end
@@ -356,23 +416,38 @@ local lzma_write_mt = { __index=lzma_writer, __newindex=lzma_mt_newindex }
     If ''ownhandle'' is set, then the file
     handle will be closed with the lzmafile.
   ]]
-local function lzmafile_open(handle, ownhandle)
-  local lz = { _handle=handle, _ownhandle=ownhandle }
+local function lzmafile_open(handle, ownhandle, bufsize, pipelined)
+  local lz = { _handle=handle, _ownhandle=ownhandle,
+      _bufsize=bufsize or choose_bufsize(handle) }
   lz._process = lzma.decompressor{format="lzma"}
   if handle.seek then -- Disregard if seeking isn't possible.
     lz._lzstreamstart = handle:seek("cur",0)
   end
-  local data,message,errnum = handle:read(13) -- the smallest lz stream
-  if not data then
-    return nil,message
+  local data,message,errnum
+  if pipelined then
+    lz._readahead = lzma.readahead(handle, {format="lzma", bufsize=lz._bufsize})
   end
-  data,message,errnum = lz._process(data)
-  if errnum < 0 then
-    return nil,message
+  if lz._readahead then
+    data,message,errnum = lz._readahead:read()
+    if message then
+      return nil,message
+    end
+    lz._eof = not data
+    data = data or ""
+  else
+    data,message,errnum = handle:read(13) -- the smallest lz stream
+    if not data then
+      return nil,message
+    end
+    data,message,errnum = lz._process(data)
+    if errnum < 0 then
+      return nil,message
+    end
+    lz._eof = errnum == lzma.LZMA_STREAM_END
   end
-  lz._eof = errnum == lzma.LZMA_STREAM_END
   lz._buffer = data
   lz._pos = 0
+  lz._offset = 0
   return setmetatable(lz, lzma_read_mt)
 end
 
@@ -380,10 +455,13 @@ end
     If ''ownhandle'' is set, then the file
     handle will be closed with the lzmafile.
   ]]
-local function lzmafile_create(handle, ownhandle, level)
+local function lzmafile_create(handle, ownhandle, level, bufsize)
   local lz = {
     _handle=handle,
     _ownhandle=ownhandle,
+    _bufsize=bufsize or 65536,
+    _pending={},
+    _pendinglen=0,
     _size=0
   }
   lz._process = lzma.compressor{format="lzma",preset=level}
@@ -395,16 +473,29 @@ end
     have "b". (A lzmafile is always in binary mode.)
     When writing a lzmafile, the ''level'' option
     is a number in the range [1,9].
+    ''bufsize'' is the size of the chunks read from
+    the file. By default it is chosen from the size
+    of the file. When writing, up to ''bufsize'' bytes
+    are collected before they are compressed, or until
+    the flush method is called.
+    With "p" in the read mode, the file is decompressed
+    ahead in a background thread while it is being read.
+    This needs an io library file on a regular file;
+    other handles are read normally.
   ]]
-function open(file, mode, level)
+function open(file, mode, level, bufsize)
   mode = mode or "r"
+  bufsize = tonumber(bufsize)
+  assert(not bufsize or bufsize > 0, "invalid buffer size")
   do
     local tn = type(file)
     assert(tn=='string' or ((
         tn=='table' or tn=='userdata') and type(file.seek)=='function'))
     assert(type(mode)=='string')
   end
+  local pipelined
   if match(mode,'^b?rb?') then
+    pipelined = find(mode,'p',1,true) ~= nil
     mode = "rb"
   elseif match(mode,'b?wb?') then
     mode = "wb"
@@ -424,8 +515,8 @@ function open(file, mode, level)
     handle = file
   end
   if mode == "rb" then
-    return lzmafile_open(handle, ownhandle)
+    return lzmafile_open(handle, ownhandle, bufsize, pipelined)
   else
-    return lzmafile_create(handle, ownhandle, level)
+    return lzmafile_create(handle, ownhandle, level, bufsize)
   end
 end
@@ -0,0 +1,386 @@
+/*****************************************************************************
+ * LArc library
+ * Copyright (C) 2010 Tom N Harris. All rights reserved.
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty.  In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *  1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *  3. This notice may not be removed or altered from any source distribution.
+ *  4. Neither the names of the authors nor the names of any of the software
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ */
+
+/* Background decompression for the compressed file readers.
+
+   A readahead object reads an io library file in a worker thread and
+   decodes it into a ring of chunks while Lua consumes the ones before.
+   The codec module supplies the decoder through the decode and finish
+   callbacks, and defines LARC_READAHEAD_MT before including this file.
+
+   The worker reads a duplicate of the file descriptor with pread, so
+   closing the io handle does not free a FILE in use by the thread, and
+   the position of the handle does not move under the caller. The
+   handle is moved to where the worker stopped reading when the
+   readahead object is closed. Only regular files are
+   read ahead: a read from a pipe or terminal can block forever, and
+   the worker has to be joined.
+
+   When built with LARC_NO_THREADS, larc_readahead_new always declines
+   and the readers decode on the calling thread. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef LARC_NO_THREADS
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+#include "lualib.h"
+
+#define LARC_READAHEAD_SLOTS	4
+
+/* Status of a chunk. Decoder errors are negative. */
+#define LARC_RA_OK	0
+#define LARC_RA_END	1
+
+typedef struct larc_Readahead larc_Readahead;
+
+/* Decode from *in to *out, advancing both pointers and lengths.
+   Returns LARC_RA_OK, LARC_RA_END at the end of the stream, or a
+   negative error number after setting errmsg. */
+typedef int (*larc_Decode)(larc_Readahead *ra, const char **in, size_t *inlen,
+		char **out, size_t *outlen);
+
+typedef struct larc_Chunk
+{
+	char *data;
+	size_t len;
+	int status;
+} larc_Chunk;
+
+struct larc_Readahead
+{
+	void *stream;	/* decoder state, after this structure */
+	larc_Decode decode;
+	void (*finish)(larc_Readahead *ra);	/* free the decoder state */
+	int handle;	/* reference to the io handle */
+	size_t bufsize;
+	char *in;
+	larc_Chunk chunk[LARC_READAHEAD_SLOTS];
+	int head, count;	/* next chunk to read, chunks decoded */
+	int stop;
+	int running;	/* worker has not been joined */
+	int status;	/* last status seen by the reader */
+	const char *errmsg;
+#ifndef LARC_NO_THREADS
+	int fd;	/* duplicate descriptor read by the worker, or -1 */
+	off_t offset;	/* file position of the next read */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;	/* a chunk was decoded */
+	pthread_cond_t space;	/* a chunk was read */
+#endif
+};
+
+#ifndef LARC_NO_THREADS
+static void *readahead_worker(void *arg)
+{
+	larc_Readahead *ra = (larc_Readahead*)arg;
+	const char *in = ra->in;
+	size_t inlen = 0;
+	int status = LARC_RA_OK;
+	while (status == LARC_RA_OK)
+	{
+		larc_Chunk *c;
+		char *out;
+		size_t outlen;
+		pthread_mutex_lock(&ra->lock);
+		while (ra->count == LARC_READAHEAD_SLOTS && !ra->stop)
+			pthread_cond_wait(&ra->space, &ra->lock);
+		if (ra->stop)
+		{
+			pthread_mutex_unlock(&ra->lock);
+			break;
+		}
+		c = &ra->chunk[(ra->head + ra->count) % LARC_READAHEAD_SLOTS];
+		pthread_mutex_unlock(&ra->lock);
+		/* The reader does not touch this chunk until it is counted. */
+		out = c->data;
+		outlen = ra->bufsize;
+		while (outlen > 0 && status == LARC_RA_OK)
+		{
+			if (inlen == 0)
+			{
+				ssize_t n;
+				in = ra->in;
+				do
+					n = pread(ra->fd, ra->in, ra->bufsize, ra->offset);
+				while (n < 0 && errno == EINTR);
+				if (n <= 0)
+				{
+					/* a truncated stream ends quietly, like the Lua readers */
+					if (n < 0)
+					{
+						ra->errmsg = "error reading file";
+						status = -1;
+					}
+					else
+						status = LARC_RA_END;
+					break;
+				}
+				inlen = (size_t)n;
+				ra->offset += n;
+			}
+			status = ra->decode(ra, &in, &inlen, &out, &outlen);
+		}
+		c->len = ra->bufsize - outlen;
+		c->status = status;
+		pthread_mutex_lock(&ra->lock);
+		ra->count++;
+		pthread_cond_signal(&ra->ready);
+		pthread_mutex_unlock(&ra->lock);
+	}
+	return NULL;
+}
+#endif
+
+/* Stop and join the worker. */
+static void readahead_stop(larc_Readahead *ra)
+{
+#ifndef LARC_NO_THREADS
+	if (ra->running)
+	{
+		pthread_mutex_lock(&ra->lock);
+		ra->stop = 1;
+		pthread_cond_signal(&ra->space);
+		pthread_mutex_unlock(&ra->lock);
+		pthread_join(ra->thread, NULL);
+		pthread_cond_destroy(&ra->space);
+		pthread_cond_destroy(&ra->ready);
+		pthread_mutex_destroy(&ra->lock);
+		ra->running = 0;
+	}
+#endif
+}
+
+static void readahead_release(lua_State *L, larc_Readahead *ra)
+{
+	int i;
+	readahead_stop(ra);
+	if (ra->finish != NULL)
+	{
+		ra->finish(ra);
+		ra->finish = NULL;
+	}
+	free(ra->in);
+	ra->in = NULL;
+	for (i = 0; i < LARC_READAHEAD_SLOTS; i++)
+	{
+		free(ra->chunk[i].data);
+		ra->chunk[i].data = NULL;
+	}
+#ifndef LARC_NO_THREADS
+	if (ra->fd >= 0)
+	{
+		close(ra->fd);
+		ra->fd = -1;
+	}
+#endif
+	luaL_unref(L, LUA_REGISTRYINDEX, ra->handle);
+	ra->handle = LUA_NOREF;
+	if (ra->status == LARC_RA_OK)
+		ra->status = LARC_RA_END;
+}
+
+#ifndef LARC_NO_THREADS
+/* Duplicate the descriptor of f for the worker and get the position
+   of f. Returns -1 if f is not a regular file. */
+static int readahead_open(FILE *f, off_t *pos)
+{
+	struct stat st;
+	if (fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode))
+		return -1;
+	*pos = ftello(f);
+	if (*pos < 0)
+		return -1;
+	return dup(fileno(f));
+}
+#endif
+
+/* Create a readahead object for the io handle at idx, with room for a
+   decoder state of streamsize bytes. Returns NULL, with nothing pushed,
+   if the handle is not an open regular file or threads are not
+   available. */
+static larc_Readahead *larc_readahead_new(lua_State *L, int idx, size_t bufsize,
+		size_t streamsize)
+{
+	larc_Readahead *ra;
+	int i;
+	FILE *f = larc_tofile(L, idx);
+	if (bufsize == 0)
+		luaL_argerror(L, idx, "invalid buffer size");
+#ifdef LARC_NO_THREADS
+	f = NULL;
+#endif
+	if (f == NULL)
+		return NULL;
+	ra = (larc_Readahead*)lua_newuserdata(L, sizeof(larc_Readahead) + streamsize);
+	memset(ra, 0, sizeof(larc_Readahead) + streamsize);
+	ra->handle = LUA_NOREF;
+#ifndef LARC_NO_THREADS
+	ra->fd = readahead_open(f, &ra->offset);
+#endif
+	luaL_getmetatable(L, LARC_READAHEAD_MT);
+	lua_setmetatable(L, -2);
+#ifndef LARC_NO_THREADS
+	if (ra->fd < 0)
+	{
+		lua_pop(L, 1);
+		return NULL;
+	}
+#endif
+	ra->stream = ra + 1;
+	ra->bufsize = bufsize;
+	ra->in = (char*)malloc(bufsize);
+	for (i = 0; i < LARC_READAHEAD_SLOTS; i++)
+		ra->chunk[i].data = (char*)malloc(bufsize);
+	for (i = 0; i < LARC_READAHEAD_SLOTS; i++)
+		if (ra->in == NULL || ra->chunk[i].data == NULL)
+			luaL_error(L, "not enough memory");
+	lua_pushvalue(L, idx);
+	ra->handle = luaL_ref(L, LUA_REGISTRYINDEX);
+	return ra;
+}
+
+/* Start the worker of the readahead object at the top of the stack,
+   after the codec has set up the decoder. Replaces the object with nil
+   if the thread cannot be created. */
+static void larc_readahead_start(lua_State *L, larc_Readahead *ra)
+{
+#ifndef LARC_NO_THREADS
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->ready, NULL);
+	pthread_cond_init(&ra->space, NULL);
+	if (pthread_create(&ra->thread, NULL, readahead_worker, ra) != 0)
+	{
+		pthread_cond_destroy(&ra->space);
+		pthread_cond_destroy(&ra->ready);
+		pthread_mutex_destroy(&ra->lock);
+		readahead_release(L, ra);
+		lua_pop(L, 1);
+		lua_pushnil(L);
+		return;
+	}
+	ra->running = 1;
+#endif
+}
+
+static int readahead_result(lua_State *L, larc_Readahead *ra)
+{
+	lua_pushnil(L);
+	if (ra->status == LARC_RA_END)
+		return 1;
+	lua_pushstring(L, ra->errmsg);
+	lua_pushinteger(L, ra->status);
+	return 3;
+}
+
+/**
+ * Get the next decoded chunk, waiting for the worker if needed.
+ * Returns nil at the end of the stream.
+ * Returns nil,string,number if there is an error.
+ */
+static int readahead_read(lua_State *L)
+{
+	larc_Readahead *ra = (larc_Readahead*)luaL_checkudata(L, 1, LARC_READAHEAD_MT);
+#ifndef LARC_NO_THREADS
+	larc_Chunk *c;
+	if (ra->status != LARC_RA_OK)
+		return readahead_result(L, ra);
+	pthread_mutex_lock(&ra->lock);
+	while (ra->count == 0)
+		pthread_cond_wait(&ra->ready, &ra->lock);
+	c = &ra->chunk[ra->head];
+	pthread_mutex_unlock(&ra->lock);
+	lua_pushlstring(L, c->data, c->len);
+	ra->status = c->status;
+	pthread_mutex_lock(&ra->lock);
+	ra->head = (ra->head + 1) % LARC_READAHEAD_SLOTS;
+	ra->count--;
+	pthread_cond_signal(&ra->space);
+	pthread_mutex_unlock(&ra->lock);
+	if (ra->status != LARC_RA_OK)
+	{
+		/* the worker has finished */
+		readahead_stop(ra);
+		if (lua_objlen(L, -1) == 0)
+			return readahead_result(L, ra);
+	}
+	return 1;
+#else
+	return readahead_result(L, ra);
+#endif
+}
+
+/**
+ * Stop the worker and free the decoder.
+ * The io handle is left open, at the end of the input read
+ * by the worker.
+ */
+static int readahead_close(lua_State *L)
+{
+	larc_Readahead *ra = (larc_Readahead*)luaL_checkudata(L, 1, LARC_READAHEAD_MT);
+	readahead_stop(ra);
+#ifndef LARC_NO_THREADS
+	if (ra->fd >= 0)
+	{
+		FILE *f;
+		lua_rawgeti(L, LUA_REGISTRYINDEX, ra->handle);
+		f = larc_tofile(L, -1);
+		if (f != NULL)
+			fseeko(f, ra->offset, SEEK_SET);
+		lua_pop(L, 1);
+	}
+#endif
+	readahead_release(L, ra);
+	return 0;
+}
+
+static int readahead_gc(lua_State *L)
+{
+	readahead_release(L, (larc_Readahead*)lua_touserdata(L, 1));
+	return 0;
+}
+
+static const luaL_Reg larc_readahead_Reg[] =
+{
+	{"read", readahead_read},
+	{"close", readahead_close},
+	{NULL, NULL}
+};
+
+/* Create the metatable of the readahead objects. */
+static void larc_readahead_register(lua_State *L)
+{
+	luaL_newmetatable(L, LARC_READAHEAD_MT);
+	lua_pushcfunction(L, readahead_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_newtable(L);
+	luaL_register(L, NULL, larc_readahead_Reg);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+}
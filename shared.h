@@ -45,14 +45,108 @@
 		lua_pushinteger(L, -c); \
 		lua_setfield(L, -2, #c); }
 
-/* Helper for 5.2 compatibility. Will need to be rewritten many times. */
-#if LUA_VERSION_NUM > 501
-static int lua_cpcall(lua_State *L, lua_CFunction func, void *ud)
+/* Helpers for 5.2 and later compatibility. */
+#if LUA_VERSION_NUM > 501 && !defined(lua_cpcall)
+#define lua_cpcall(L,f,u)	(lua_pushcfunction(L, (f)), \
+		lua_pushlightuserdata(L, (u)), lua_pcall(L, 1, 0, 0))
+#endif
+#if LUA_VERSION_NUM > 501 && !defined(lua_objlen)
+#define lua_objlen(L,i)	lua_rawlen(L, (i))
+#endif
+#if LUA_VERSION_NUM > 502 && !defined(luaL_optint)
+#define luaL_optint(L,n,d)	((int)luaL_optinteger(L, (n), (d)))
+#endif
+#if LUA_VERSION_NUM > 501 && !defined(luaL_register)
+#include <string.h>
+/* Register functions in a module table, creating the global tables for
+   a dotted name as luaL_register does in 5.1. */
+static void larc_register(lua_State *L, const char *libname, const luaL_Reg *l)
+{
+	if (libname != NULL)
+	{
+		lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+		lua_getfield(L, -1, libname);
+		if (!lua_istable(L, -1))
+		{
+			const char *name = libname, *e;
+			lua_pop(L, 1);
+			lua_pushglobaltable(L);
+			do {
+				e = strchr(name, '.');
+				if (e == NULL)
+					e = name + strlen(name);
+				lua_pushlstring(L, name, e - name);
+				lua_rawget(L, -2);
+				if (lua_isnil(L, -1))
+				{
+					lua_pop(L, 1);
+					lua_newtable(L);
+					lua_pushlstring(L, name, e - name);
+					lua_pushvalue(L, -2);
+					lua_settable(L, -4);
+				}
+				lua_remove(L, -2);
+				name = e + 1;
+			} while (*e == '.');
+			lua_pushvalue(L, -1);
+			lua_setfield(L, -3, libname);
+		}
+		lua_remove(L, -2);
+	}
+	luaL_setfuncs(L, l, 0);
+}
+#define luaL_register	larc_register
+#endif
+
+/* Lua 5.3 and later have 64-bit integers. Use them for 64-bit values and
+   box only what does not fit in a large integer userdata. */
+#if LUA_VERSION_NUM >= 503 && LUA_MAXINTEGER >= 0x7FFFFFFFFFFFFFFFLL \
+		&& !defined(LARC_NO_NATIVE_INTEGER)
+#define LARC_NATIVE_INTEGER
+#endif
+
+/* Mutable byte buffer created by larc.struct.buffer */
+#define LARC_BUFFER_MT	"larc.struct.buffer"
+typedef struct larc_Buffer {
+	char *data;
+	size_t size;
+	int ref;	/* buffer that owns the data, for slices */
+} larc_Buffer;
+
+/* Get the bytes of a string or buffer argument. */
+static const char *larc_optbytes(lua_State *L, int arg, const char *def, size_t *len)
 {
-	lua_CFunction pfunc = func;
-	lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_CPCALL);
-	lua_pushlightuserdata(L, &pfunc);
-	lua_pushlightuserdata(L, ud);
-	return lua_pcall(L, 2, 0, 0);
+	if (lua_type(L, arg) == LUA_TUSERDATA)
+	{
+		larc_Buffer *b = (larc_Buffer*)luaL_checkudata(L, arg, LARC_BUFFER_MT);
+		*len = b->size;
+		return b->data;
+	}
+	return luaL_optlstring(L, arg, def, len);
 }
+#define larc_checkbytes(L,arg,len)	(lua_type(L, arg) == LUA_TUSERDATA ? \
+		larc_optbytes(L, arg, NULL, len) : luaL_checklstring(L, arg, len))
+
+#include <stdio.h>
+#include "lualib.h"
+
+/* Get the FILE of an open io library handle, or NULL. */
+static FILE *larc_tofile(lua_State *L, int idx)
+{
+#if LUA_VERSION_NUM > 501
+	luaL_Stream *p = (luaL_Stream*)luaL_testudata(L, idx, LUA_FILEHANDLE);
+	return (p != NULL && p->closef != NULL) ? p->f : NULL;
+#else
+	FILE **p = (FILE**)lua_touserdata(L, idx);
+	if (p != NULL && lua_getmetatable(L, idx))
+	{
+		luaL_getmetatable(L, LUA_FILEHANDLE);
+		if (!lua_rawequal(L, -1, -2))
+			p = NULL;
+		lua_pop(L, 2);
+	}
+	else
+		p = NULL;
+	return p != NULL ? *p : NULL;
 #endif
+}
@@ -9,8 +9,22 @@
 
 #include "lua.h"
 #include "lauxlib.h"
+#include "lualib.h"
+
+#include "shared.h"
 
 /* #define NO_LONG_DOUBLE */
+/* #define NO_SIMD */
+
+#if !defined(NO_SIMD) && defined(__GNUC__) && defined(__SSE2__)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_SSSE3
+#define HAVE_AVX2
+#include <immintrin.h>
+#endif
+#endif
 
 /*
 ** {======================================================
@@ -38,6 +52,40 @@
 ** f - float
 ** d - double
 ** ' ' - ignored
+**
+** struct.compile(fmt) parses a format once; the result has pack,
+** unpack and size methods and may be used wherever a format string is
+** expected. struct.size(fmt) is the packed size of a fixed format.
+**
+** struct.buffer(n) creates a mutable buffer of `n' bytes. Values are
+** written in place with struct.pack_into(fmt, buf, pos, ...) and read
+** back with struct.unpack_from(fmt, buf, pos); buf:slice(i, j) is a view
+** of part of the buffer and buf:tostring(i, j) copies it to a string.
+** Buffers may be passed wherever data to unpack is expected.
+**
+** struct.reader(handle, bufsize) reads binary data from a file, or any
+** object with a read method, through its own buffer: reader:unpack(fmt)
+** returns the next values, reader:skip(n) moves ahead and reader:tell()
+** gives the position. The handle is read ahead of the reader.
+**
+** struct.base64encode(s), base32encode and base85encode encode whole
+** strings; the matching decode functions skip white space and return
+** nil and a message for invalid data.
+**
+** struct.packvli_array(t) packs an array of integers as consecutive
+** vlis and struct.unpackvli_array(data, pos, count) decodes them.
+**
+** struct.unpack_array(fmt, data, pos, count) and struct.pack_array(fmt, t)
+** convert between arrays and runs of a single number item, such as '>d'.
+**
+** Integers that do not fit in 48 bits are returned as large integer
+** userdata. On Lua 5.3 and later they are native integers unless
+** LARC_NO_NATIVE_INTEGER is defined.
+** Arithmetic on large integers always returns a large integer, since
+** __eq is not called between a number and a userdata. To avoid a new
+** userdata for each result, li:add_inplace(x) and li:sub_inplace(x)
+** update a large integer created with struct.largeinteger, for use as
+** an accumulator.
 */
 
 /* is 'x' a power of 2? */
@@ -77,7 +125,7 @@ typedef longestint largeinteger_t;
 #define LARGETYPE	"large integer"
 
 #define PADDING        (sizeof(struct cD) - sizeof(double))
-#define MAXALIGN      (PADDING > (sizeof(largeinteger_t) ? PADDING : sizeof(largeinteger_t)))
+#define MAXALIGN      (PADDING > sizeof(largeinteger_t) ? PADDING : sizeof(largeinteger_t))
 
 
 static void newlargeint (lua_State *L, largeinteger_t i) {
@@ -87,6 +135,29 @@ static void newlargeint (lua_State *L, largeinteger_t i) {
   lua_setmetatable(L, -2);
 }
 
+/* push a signed integer, boxing it if it does not fit a plain number */
+static void pushsigned (lua_State *L, longestint i) {
+#ifdef LARC_NATIVE_INTEGER
+  lua_pushinteger(L, (lua_Integer)i);
+#else
+  if (i > LONGESTMAX || i < LONGESTMIN)
+    newlargeint(L, i);
+  else
+    lua_pushnumber(L, (lua_Number)i);
+#endif
+}
+
+static void pushunsigned (lua_State *L, ulongestint i) {
+#ifdef LARC_NATIVE_INTEGER
+  lua_pushinteger(L, (lua_Integer)i);
+#else
+  if (i > LONGESTMAX)
+    newlargeint(L, (largeinteger_t)i);
+  else
+    lua_pushnumber(L, (lua_Number)i);
+#endif
+}
+
 static largeinteger_t getlargeint (lua_State *L, int i) {
   largeinteger_t li;
   if (lua_isnoneornil(L, i))
@@ -101,6 +172,10 @@ static largeinteger_t getlargeint (lua_State *L, int i) {
       return li;
     }
     case LUA_TNUMBER:
+#ifdef LARC_NATIVE_INTEGER
+      if (lua_isinteger(L, i))
+        return lua_tointeger(L, i);
+#endif
       li = luaL_checknumber(L, i);
       return li;
     case LUA_TUSERDATA:
@@ -125,40 +200,266 @@ static size_t getnum (const char **fmt, size_t df) {
   }
 }
 
-static void * memchr2 (const void * ptr, int c, size_t nb) {
-  unsigned short * p = (unsigned short *)ptr;
-  unsigned short * q = p + (nb / 2);
-  while (p < q) {
-    if (*p++ == c)
-      return p-1;
+/*
+** Space for a result of at most `size' bytes. The result is pushed with
+** pushresult when it is complete.
+*/
+static char *prepresult (lua_State *L, luaL_Buffer *b, size_t size) {
+#if LUA_VERSION_NUM > 501
+  return luaL_buffinitsize(L, b, size);
+#else
+  if (size <= LUAL_BUFFERSIZE) {
+    luaL_buffinit(L, b);
+    return luaL_prepbuffer(b);
+  }
+  return (char *)lua_newuserdata(L, size);
+#endif
+}
+
+static void pushresult (lua_State *L, luaL_Buffer *b, const char *p,
+                        size_t size, size_t n) {
+#if LUA_VERSION_NUM > 501
+  (void)p; (void)size;
+  luaL_pushresultsize(b, n);
+#else
+  if (size <= LUAL_BUFFERSIZE) {
+    luaL_addsize(b, n);
+    luaL_pushresult(b);
+  }
+  else {
+    lua_pushlstring(L, p, n);
+    lua_remove(L, -2);
+  }
+#endif
+}
+
+
+/* find the first zero unit of `w' bytes in the first `nb' bytes of `p' */
+static const char *findterm_scalar (const char *p, size_t nb, int w) {
+  const char *q = p + (nb / w) * w;
+  for (; p < q; p += w) {
+    if (p[0] == 0 && (w < 2 || p[1] == 0) &&
+        (w < 4 || (p[2] == 0 && p[3] == 0)))
+      return p;
+  }
+  return NULL;
+}
+
+#ifdef HAVE_SSE2
+static const char *findterm_sse2 (const char *p, size_t nb, int w) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t i;
+  for (i = 0; i + 16 <= nb; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    int m = _mm_movemask_epi8(w == 2 ? _mm_cmpeq_epi16(v, zero)
+                                     : _mm_cmpeq_epi32(v, zero));
+    if (m != 0)
+      return p + i + __builtin_ctz(m);
+  }
+  return findterm_scalar(p + i, nb - i, w);
+}
+#endif
+
+#ifdef HAVE_AVX2
+__attribute__((target("avx2")))
+static const char *findterm_avx2 (const char *p, size_t nb, int w) {
+  const __m256i zero = _mm256_setzero_si256();
+  size_t i;
+  for (i = 0; i + 32 <= nb; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    unsigned m = (unsigned)_mm256_movemask_epi8(w == 2 ?
+                   _mm256_cmpeq_epi16(v, zero) : _mm256_cmpeq_epi32(v, zero));
+    if (m != 0)
+      return p + i + __builtin_ctz(m);
+  }
+  return findterm_sse2(p + i, nb - i, w);
+}
+#endif
+
+static const char *(*findterm_wide) (const char *p, size_t nb, int w) =
+#ifdef HAVE_SSE2
+  findterm_sse2;
+#else
+  findterm_scalar;
+#endif
+
+static void simd_init (void) {
+#ifdef HAVE_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    findterm_wide = findterm_avx2;
+#endif
+}
+
+/* find the terminator of a string of `w'-byte units */
+static const char *findterm (const char *p, size_t nb, int w) {
+  if (w == 1)
+    return (const char *)memchr(p, 0, nb);
+  return findterm_wide(p, nb, w);
+}
+
+
+#ifdef HAVE_SSE2
+/* swap the bytes of each 16-bit lane */
+#define swap16(v)	_mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8))
+
+/* store eight 16-bit code units as UTF-16 or UTF-32 */
+static unsigned char *putunits (__m128i u, unsigned char *o, int width,
+                                int endian) {
+  const __m128i zero = _mm_setzero_si128();
+  if (width == 2) {
+    _mm_storeu_si128((__m128i *)o, endian == BIG ? swap16(u) : u);
+    return o + 16;
+  }
+  if (endian == BIG) {
+    u = swap16(u);
+    _mm_storeu_si128((__m128i *)o, _mm_unpacklo_epi16(zero, u));
+    _mm_storeu_si128((__m128i *)(o + 16), _mm_unpackhi_epi16(zero, u));
+  }
+  else {
+    _mm_storeu_si128((__m128i *)o, _mm_unpacklo_epi16(u, zero));
+    _mm_storeu_si128((__m128i *)(o + 16), _mm_unpackhi_epi16(u, zero));
+  }
+  return o + 32;
+}
+
+/*
+** Transcode 16 bytes of UTF-8 that are all ASCII or all 2-byte
+** sequences. Returns the new output position, or NULL if the block has
+** other characters.
+*/
+static unsigned char *utf8block (const unsigned char *s, unsigned char *o,
+                                 int width, int endian) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i v = _mm_loadu_si128((const __m128i *)s);
+  if (_mm_movemask_epi8(v) == 0) {
+    o = putunits(_mm_unpacklo_epi8(v, zero), o, width, endian);
+    return putunits(_mm_unpackhi_epi8(v, zero), o, width, endian);
+  }
+  /* lead byte 0xC2-0xDF followed by a continuation byte in every lane */
+  if (_mm_movemask_epi8(_mm_cmpeq_epi16(
+        _mm_and_si128(v, _mm_set1_epi16((short)0xC0E0)),
+        _mm_set1_epi16((short)0x80C0))) == 0xFFFF &&
+      _mm_movemask_epi8(_mm_cmpeq_epi16(
+        _mm_and_si128(v, _mm_set1_epi16(0x001E)), zero)) == 0) {
+    __m128i u = _mm_or_si128(
+      _mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0x1F)), 6),
+      _mm_and_si128(_mm_srli_epi16(v, 8), _mm_set1_epi16(0x3F)));
+    return putunits(u, o, width, endian);
   }
   return NULL;
 }
 
-static void * memchr4 (const void * ptr, int c, size_t nb) {
-  unsigned long * p = (unsigned long *)ptr;
-  unsigned long * q = p + (nb / 4);
-  while (p < q) {
-    if (*p++ == c)
-      return p-1;
+/*
+** Transcode eight UTF-16 or UTF-32 code units that are all below 0x80 or
+** all in 0x80-0x7FF. Returns the new output position, or NULL.
+*/
+static unsigned char *unicodeblock (const unsigned char *s, unsigned char *o,
+                                    int width, int endian) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i u;
+  if (width == 2) {
+    u = _mm_loadu_si128((const __m128i *)s);
+    if (endian == BIG) u = swap16(u);
+  }
+  else {
+    __m128i a = _mm_loadu_si128((const __m128i *)s);
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+    if (endian == BIG) {
+      a = swap16(a);
+      a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(a, 0xB1), 0xB1);
+      b = swap16(b);
+      b = _mm_shufflehi_epi16(_mm_shufflelo_epi16(b, 0xB1), 0xB1);
+    }
+    u = _mm_packs_epi32(a, b);  /* large values saturate and fail below */
+  }
+  if (_mm_movemask_epi8(_mm_cmpeq_epi16(
+        _mm_and_si128(u, _mm_set1_epi16((short)0xFF80)), zero)) == 0xFFFF) {
+    _mm_storel_epi64((__m128i *)o, _mm_packus_epi16(u, u));
+    return o + 8;
+  }
+  if (_mm_movemask_epi8(_mm_cmpeq_epi16(
+        _mm_and_si128(u, _mm_set1_epi16((short)0xF800)), zero)) == 0xFFFF &&
+      _mm_movemask_epi8(_mm_cmpeq_epi16(
+        _mm_and_si128(u, _mm_set1_epi16((short)0xFF80)), zero)) == 0) {
+    __m128i lead = _mm_or_si128(_mm_srli_epi16(u, 6), _mm_set1_epi16(0xC0));
+    __m128i cont = _mm_or_si128(_mm_and_si128(u, _mm_set1_epi16(0x3F)),
+                                _mm_set1_epi16(0x80));
+    _mm_storeu_si128((__m128i *)o, _mm_or_si128(lead, _mm_slli_epi16(cont, 8)));
+    return o + 16;
   }
   return NULL;
 }
+#endif
+
+
+static unsigned char *putunit (unsigned char *o, unsigned long w, int width,
+                               int endian) {
+  if (width == 2) {
+    if (endian == BIG) {
+      o[0] = (unsigned char)(w>>8);
+      o[1] = (unsigned char)w;
+    }
+    else {
+      o[0] = (unsigned char)w;
+      o[1] = (unsigned char)(w>>8);
+    }
+    return o + 2;
+  }
+  if (endian == BIG) {
+    o[0] = (unsigned char)(w>>24);
+    o[1] = (unsigned char)(w>>16);
+    o[2] = (unsigned char)(w>>8);
+    o[3] = (unsigned char)w;
+  }
+  else {
+    o[0] = (unsigned char)w;
+    o[1] = (unsigned char)(w>>8);
+    o[2] = (unsigned char)(w>>16);
+    o[3] = (unsigned char)(w>>24);
+  }
+  return o + 4;
+}
 
 
 static void strtounicode (lua_State *L, int arg, int width, int endian) {
   luaL_Buffer b;
-  unsigned long uni;
-  size_t l;
+  unsigned long uni = 0;
+  size_t l, size;
   const unsigned char *s = (const unsigned char *)luaL_checklstring(L, arg, &l);
   const unsigned char *t = s + l;
-  luaL_buffinit(L, &b);
+  unsigned char *o, *start;
+  if (l > ~(size_t)0 / width)
+    luaL_argerror(L, arg, "string too long");
+  size = l * width;  /* one unit at most for each byte */
+  o = start = (unsigned char *)prepresult(L, &b, size);
   while (s < t) {
-    if (*s < 0x80)
+    if (*s < 0x80) {
+#ifdef HAVE_SSE2
+      if (t - s >= 16) {
+        unsigned char *e = utf8block(s, o, width, endian);
+        if (e != NULL) {
+          o = e;
+          s += 16;
+          continue;
+        }
+      }
+#endif
       uni = *s++;
+    }
     else if (*s < 0xC0)
       luaL_argerror(L, arg, "invalid utf-8");
     else if (*s < 0xE0) {
+#ifdef HAVE_SSE2
+      if (t - s >= 16) {
+        unsigned char *e = utf8block(s, o, width, endian);
+        if (e != NULL) {
+          o = e;
+          s += 16;
+          continue;
+        }
+      }
+#endif
       if (t-s < 2) luaL_argerror(L, arg, "invalid utf-8");
       if ((s[1]&0xC0) != 0x80) luaL_argerror(L, arg, "invalid utf-8");
       uni = ((unsigned long)(s[0]&0x1F) << 6) | (s[1]&0x3F);
@@ -214,51 +515,18 @@ static void strtounicode (lua_State *L, int arg, int width, int endian) {
     if (width == 2) {
       if (uni >= 0x110000)
         luaL_argerror(L, arg, "unicode character out of range");
-      if (uni < 0x10000) {
-        if (endian == BIG) {
-          luaL_addchar(&b, uni>>8);
-          luaL_addchar(&b, uni);
-        }
-        else {
-          luaL_addchar(&b, uni);
-          luaL_addchar(&b, uni>>8);
-        }
-      }
+      if (uni < 0x10000)
+        o = putunit(o, uni, 2, endian);
       else {
-        unsigned long w1,w2;
         uni -= 0x10000;
-        w1 = (uni>>10) | 0xD800;
-        w2 = (uni&0x3FF) | 0xDC00;
-        if (endian == BIG) {
-          luaL_addchar(&b, w1>>8);
-          luaL_addchar(&b, w1);
-          luaL_addchar(&b, w2>>8);
-          luaL_addchar(&b, w2);
-        }
-        else {
-          luaL_addchar(&b, w1);
-          luaL_addchar(&b, w1>>8);
-          luaL_addchar(&b, w2);
-          luaL_addchar(&b, w2>>8);
-        }
-      }
-    }
-    else {
-      if (endian == BIG) {
-        luaL_addchar(&b, uni>>24);
-        luaL_addchar(&b, uni>>16);
-        luaL_addchar(&b, uni>>8);
-        luaL_addchar(&b, uni);
-      }
-      else {
-        luaL_addchar(&b, uni);
-        luaL_addchar(&b, uni>>8);
-        luaL_addchar(&b, uni>>16);
-        luaL_addchar(&b, uni>>24);
+        o = putunit(o, (uni>>10) | 0xD800, 2, endian);
+        o = putunit(o, (uni&0x3FF) | 0xDC00, 2, endian);
       }
     }
+    else
+      o = putunit(o, uni, 4, endian);
   }
-  luaL_pushresult(&b);
+  pushresult(L, &b, (char *)start, size, o - start);
   lua_replace(L, arg);
 }
 
@@ -267,13 +535,26 @@ static void unicodetostr (lua_State *L, const char *str, size_t len, int width,
   unsigned long uni;
   const unsigned char *s = (const unsigned char *)str;
   const unsigned char *t = s + (len / width) * width;
-  luaL_buffinit(L, &b);
+  /* at most 3 bytes for a UTF-16 unit, 6 for a 32-bit character */
+  size_t size = (len / width) * (width == 2 ? 3 : 6);
+  unsigned char *o, *start;
+  o = start = (unsigned char *)prepresult(L, &b, size);
   while (s < t) {
+#ifdef HAVE_SSE2
+    if ((size_t)(t - s) >= (size_t)8 * width) {
+      unsigned char *e = unicodeblock(s, o, width, endian);
+      if (e != NULL) {
+        o = e;
+        s += 8 * width;
+        continue;
+      }
+    }
+#endif
     if (width == 4) {
       if (endian == BIG)
-        uni = (s[0]<<24) | (s[1]<<16) | (s[2]<<8) | (s[3]);
+        uni = ((unsigned long)s[0]<<24) | (s[1]<<16) | (s[2]<<8) | (s[3]);
       else
-        uni = (s[0]) | (s[1]<<8) | (s[2]<<16) | (s[3]<<24);
+        uni = (s[0]) | (s[1]<<8) | (s[2]<<16) | ((unsigned long)s[3]<<24);
       if ((uni&0xFFFFF800UL) == 0xD800) luaL_error(L, "invalid unicode character");
       s += 4;
     }
@@ -298,41 +579,41 @@ static void unicodetostr (lua_State *L, const char *str, size_t len, int width,
       }
     }
     if (uni < 0x80)
-      luaL_addchar(&b, uni);
+      *o++ = uni;
     else if (uni < 0x800) {
-      luaL_addchar(&b, (uni>>6)|0xC0);
-      luaL_addchar(&b, (uni&0x3F)|0x80);
+      *o++ = (uni>>6)|0xC0;
+      *o++ = (uni&0x3F)|0x80;
     }
     else if (uni < 0x10000) {
-      luaL_addchar(&b, (uni>>12)|0xE0);
-      luaL_addchar(&b, ((uni>>6)&0x3F)|0x80);
-      luaL_addchar(&b, (uni&0x3F)|0x80);
+      *o++ = (uni>>12)|0xE0;
+      *o++ = ((uni>>6)&0x3F)|0x80;
+      *o++ = (uni&0x3F)|0x80;
     }
     else if (uni < 0x200000) {
-      luaL_addchar(&b, (uni>>18)|0xF0);
-      luaL_addchar(&b, ((uni>>12)&0x3F)|0x80);
-      luaL_addchar(&b, ((uni>>6)&0x3F)|0x80);
-      luaL_addchar(&b, (uni&0x3F)|0x80);
+      *o++ = (uni>>18)|0xF0;
+      *o++ = ((uni>>12)&0x3F)|0x80;
+      *o++ = ((uni>>6)&0x3F)|0x80;
+      *o++ = (uni&0x3F)|0x80;
     }
     else if (uni < 0x4000000) {
-      luaL_addchar(&b, (uni>>24)|0xF8);
-      luaL_addchar(&b, ((uni>>18)&0x3F)|0x80);
-      luaL_addchar(&b, ((uni>>12)&0x3F)|0x80);
-      luaL_addchar(&b, ((uni>>6)&0x3F)|0x80);
-      luaL_addchar(&b, (uni&0x3F)|0x80);
+      *o++ = (uni>>24)|0xF8;
+      *o++ = ((uni>>18)&0x3F)|0x80;
+      *o++ = ((uni>>12)&0x3F)|0x80;
+      *o++ = ((uni>>6)&0x3F)|0x80;
+      *o++ = (uni&0x3F)|0x80;
     }
     else if (uni < 0x80000000UL) {
-      luaL_addchar(&b, (uni>>30)|0xFC);
-      luaL_addchar(&b, ((uni>>24)&0x3F)|0x80);
-      luaL_addchar(&b, ((uni>>18)&0x3F)|0x80);
-      luaL_addchar(&b, ((uni>>12)&0x3F)|0x80);
-      luaL_addchar(&b, ((uni>>6)&0x3F)|0x80);
-      luaL_addchar(&b, (uni&0x3F)|0x80);
+      *o++ = (uni>>30)|0xFC;
+      *o++ = ((uni>>24)&0x3F)|0x80;
+      *o++ = ((uni>>18)&0x3F)|0x80;
+      *o++ = ((uni>>12)&0x3F)|0x80;
+      *o++ = ((uni>>6)&0x3F)|0x80;
+      *o++ = (uni&0x3F)|0x80;
     }
     else
       luaL_error(L, "unicode character out of range");
   }
-  luaL_pushresult(&b);
+  pushresult(L, &b, (char *)start, size, o - start);
 }
 
 
@@ -372,15 +653,18 @@ static size_t optsize (lua_State *L, char opt, const char **fmt, size_t *rep) {
 }
 
 
-static int gettoalign (size_t len, Header *h, int opt, size_t size) {
+/* alignment of an item, 0 if it is not aligned */
+static size_t itemalign (Header *h, int opt, size_t size) {
   if (opt == 'x' && size == 0) size = h->align;
   else if (size == 0 || opt == 'c' || opt == 's' || opt == 'x') return 0;
   else if (opt == 'u') size = 2;
   else if (opt == 'U') size = 4;
   if (size > (size_t)h->align) size = h->align;  /* respect max. alignment */
-  return  (size - (len & (size - 1))) & (size - 1);
+  return size;
 }
 
+#define padding(len,a)	((a) ? ((a) - ((len) & ((a) - 1))) & ((a) - 1) : 0)
+
 
 static void commoncases (lua_State *L, int opt, const char **fmt, Header *h) {
   switch (opt) {
@@ -401,19 +685,116 @@ static void commoncases (lua_State *L, int opt, const char **fmt, Header *h) {
 }
 
 
-static void putinteger (lua_State *L, luaL_Buffer *b, int arg, int endian,
-                        int size) {
-  ulongestint value = getlargeint(L, arg);
-  if (endian == LITTLE) {
-    int i;
-    for (i = 0; i < size; i++)
-      luaL_addchar(b, (value >> 8*i) & 0xff);
+/*
+** A compiled format: the format string parsed once into one operation
+** per item, with endianness and alignment resolved. When no item has a
+** variable size the offsets of all items are known in advance.
+*/
+typedef struct FormatOp {
+  char opt;
+  char endian;
+  size_t size;  /* 0 for variable-size items */
+  size_t align;
+  size_t offset;  /* from the start of the format, if fixed */
+} FormatOp;
+
+typedef struct Format {
+  size_t nops;
+  size_t nvalues;  /* values produced by unpack */
+  size_t size;  /* total size, if fixed */
+  size_t maxalign;
+  int fixed;
+  FormatOp ops[1];
+} Format;
+
+#define FORMATTYPE	"larc.struct.format"
+#define FORMATCACHE	"larc.struct.formatcache"
+
+#define MAXOPS	((~(size_t)0 - sizeof(Format)) / sizeof(FormatOp))
+
+
+static Format *newformat (lua_State *L, const char *fmt) {
+  Header h;
+  const char *p = fmt;
+  size_t nops = 0;
+  size_t pos = 0;
+  size_t i = 0;
+  Format *f;
+  defaultoptions(&h);
+  while (*p) {  /* count the items */
+    int opt = *p++;
+    size_t rep = 1;
+    optsize(L, opt, &p, &rep);
+    switch (opt) {
+      case ' ': case '<': case '>': case '!':
+        commoncases(L, opt, &p, &h);
+        break;
+      default:
+        if (rep > MAXOPS - nops)
+          luaL_error(L, "format too long");
+        nops += rep;
+    }
   }
-  else {
-    int i;
-    for (i = size - 1; i >= 0; i--)
-      luaL_addchar(b, (value >> 8*i) & 0xff);
+  f = (Format *)lua_newuserdata(L, sizeof(Format) +
+                                   (nops ? nops - 1 : 0) * sizeof(FormatOp));
+  luaL_getmetatable(L, FORMATTYPE);
+  lua_setmetatable(L, -2);
+  f->nops = nops;
+  f->nvalues = 0;
+  f->maxalign = 1;
+  f->fixed = 1;
+  defaultoptions(&h);
+  p = fmt;
+  while (*p) {
+    int opt = *p++;
+    size_t rep = 1;
+    size_t size = optsize(L, opt, &p, &rep);
+    switch (opt) {
+      case ' ': case '<': case '>': case '!':
+        commoncases(L, opt, &p, &h);
+        continue;
+    }
+    while (rep--) {
+      FormatOp *op = &f->ops[i++];
+      op->opt = opt;
+      op->endian = h.endian;
+      op->size = size;
+      op->align = itemalign(&h, opt, size);
+      if (op->align > f->maxalign) f->maxalign = op->align;
+      op->offset = pos + padding(pos, op->align);
+      pos = op->offset + size;
+      if (size == 0 && opt != 'x') f->fixed = 0;
+      if (opt != 'x') f->nvalues++;
+    }
   }
+  f->size = pos;
+  return f;
+}
+
+
+/*
+** Get the compiled format at `arg', compiling format strings on first
+** use. The compiled format replaces the string on the stack.
+*/
+static Format *getformat (lua_State *L, int arg) {
+  Format *f;
+  if (lua_type(L, arg) == LUA_TUSERDATA)
+    return (Format *)luaL_checkudata(L, arg, FORMATTYPE);
+  luaL_checkstring(L, arg);
+  lua_getfield(L, LUA_REGISTRYINDEX, FORMATCACHE);
+  lua_pushvalue(L, arg);
+  lua_rawget(L, -2);
+  f = (Format *)lua_touserdata(L, -1);
+  if (f == NULL) {
+    lua_pop(L, 1);
+    f = newformat(L, lua_tostring(L, arg));
+    lua_pushvalue(L, arg);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+  }
+  lua_replace(L, arg);
+  lua_pop(L, 1);
+  return f;
 }
 
 
@@ -429,87 +810,131 @@ static void correctbytes (char *b, int size, int endian) {
 }
 
 
-static int b_pack (lua_State *L) {
-  luaL_Buffer b;
-  const char *fmt = luaL_checkstring(L, 1);
-  Header h;
-  int arg = 2;
-  size_t totalsize = 0;
-  defaultoptions(&h);
-  lua_pushnil(L);  /* mark to separate arguments from string buffer */
-  luaL_buffinit(L, &b);
-  while (*fmt != '\0') {
-    int opt = *fmt++;
-    size_t rep = 1;
-    size_t size = optsize(L, opt, &fmt, &rep);
-    while (rep--) {
-      int toalign = gettoalign(totalsize, &h, opt, size);
-      totalsize += toalign;
-      while (toalign-- > 0) luaL_addchar(&b, '\0');
-      switch (opt) {
-        case 'b': case 'B': case 'h': case 'H':
-        case 'l': case 'L': case 'i': case 'I':
-        case 'q': case 'Q': {  /* integer types */
-          putinteger(L, &b, arg++, h.endian, size);
-          break;
-        }
-        case 'x': {
-          size_t l;
-          for (l=0; l<size; l++)
-            luaL_addchar(&b, '\0');
-          break;
-        }
-        case 'f': {
-          float f = (float)luaL_checknumber(L, arg++);
-          correctbytes((char *)&f, size, h.endian);
-          luaL_addlstring(&b, (char *)&f, size);
-          break;
-        }
-        case 'd': {
-          double d = luaL_checknumber(L, arg++);
-          correctbytes((char *)&d, size, h.endian);
-          luaL_addlstring(&b, (char *)&d, size);
-          break;
-        }
-        case 'u': case 'U':
-          strtounicode(L, arg, opt=='U'?4:2, h.endian);
-          /* continue as string */
-        case 'c': case 's': {
-          size_t l;
-          size_t sz = size;
-          const char *s = luaL_checklstring(L, arg++, &l);
-          if (size == 0) size = l;
-          if (l < size) {
-            luaL_addlstring(&b, s, l);
-            while (l++ < size)
-              luaL_addchar(&b, '\0');
-          }
-          else
-            luaL_addlstring(&b, s, size);
-          if (opt == 's' && sz == 0) {
-            luaL_addchar(&b, '\0');  /* add zero at the end */
-            size++;
-          }
-          else if (opt == 'u' && sz == 0) {
-            luaL_addchar(&b, '\0');
-            luaL_addchar(&b, '\0');
-            size+=2;
-          }
-          else if (opt == 'U' && sz == 0) {
-            luaL_addchar(&b, '\0');
-            luaL_addchar(&b, '\0');
-            luaL_addchar(&b, '\0');
-            luaL_addchar(&b, '\0');
-            size+=4;
+static void storeinteger (lua_State *L, char *p, int arg, int endian,
+                          int size) {
+  ulongestint value = getlargeint(L, arg);
+  int i;
+  if (endian == LITTLE) {
+    for (i = 0; i < size; i++)
+      p[i] = (char)(value >> 8*i);
+  }
+  else {
+    for (i = size - 1; i >= 0; i--)
+      p[size - 1 - i] = (char)(value >> 8*i);
+  }
+}
+
+
+/*
+** Compute the position after packing the arguments from `arg' starting
+** at `pos'. Arguments of variable-size unicode items are converted in
+** place on the stack.
+*/
+static size_t packsize (lua_State *L, const Format *f, int arg, size_t pos) {
+  size_t i;
+  if (f->fixed && (pos & (f->maxalign - 1)) == 0)
+    return pos + f->size;
+  for (i = 0; i < f->nops; i++) {
+    const FormatOp *op = &f->ops[i];
+    size_t size = op->size;
+    pos += padding(pos, op->align);
+    if (size == 0 && op->opt != 'x') {
+      size_t l;
+      switch (op->opt) {
+        case 'u': strtounicode(L, arg, 2, op->endian); l = 2; break;
+        case 'U': strtounicode(L, arg, 4, op->endian); l = 4; break;
+        case 's': l = 1; break;
+        default: l = 0; break;
+      }
+      luaL_checklstring(L, arg, &size);
+      size += l;
+    }
+    if (op->opt != 'x') arg++;
+    if (size > ~(size_t)0 - pos)
+      luaL_error(L, "format result too large");
+    pos += size;
+  }
+  return pos;
+}
+
+
+/*
+** Pack the arguments from `arg' into memory at `base+pos'. The space was
+** computed with packsize. Returns the position after the last item.
+*/
+static size_t packinto (lua_State *L, const Format *f, int arg, char *base,
+                        size_t pos) {
+  size_t i;
+  for (i = 0; i < f->nops; i++) {
+    const FormatOp *op = &f->ops[i];
+    size_t size = op->size;
+    size_t toalign = padding(pos, op->align);
+    char *p;
+    memset(base + pos, 0, toalign);
+    pos += toalign;
+    p = base + pos;
+    switch (op->opt) {
+      case 'b': case 'B': case 'h': case 'H':
+      case 'l': case 'L': case 'i': case 'I':
+      case 'q': case 'Q': {  /* integer types */
+        storeinteger(L, p, arg++, op->endian, size);
+        break;
+      }
+      case 'x': {
+        memset(p, 0, size);
+        break;
+      }
+      case 'f': {
+        float f = (float)luaL_checknumber(L, arg++);
+        correctbytes((char *)&f, size, op->endian);
+        memcpy(p, &f, size);
+        break;
+      }
+      case 'd': {
+        double d = luaL_checknumber(L, arg++);
+        correctbytes((char *)&d, size, op->endian);
+        memcpy(p, &d, size);
+        break;
+      }
+      case 'u': case 'U':
+        if (size != 0)  /* variable-size items were converted by packsize */
+          strtounicode(L, arg, op->opt=='U'?4:2, op->endian);
+        /* continue as string */
+      case 'c': case 's': {
+        size_t l;
+        const char *s = luaL_checklstring(L, arg++, &l);
+        if (size == 0) {
+          memcpy(p, s, l);
+          size = l;
+          if (op->opt != 'c') {  /* add zero at the end */
+            size_t z = op->opt=='U' ? 4 : op->opt=='u' ? 2 : 1;
+            memset(p + l, 0, z);
+            size += z;
           }
-          break;
         }
-        default: commoncases(L, opt, &fmt, &h);
+        else if (l < size) {
+          memcpy(p, s, l);
+          memset(p + l, 0, size - l);
+        }
+        else
+          memcpy(p, s, size);
+        break;
       }
-      totalsize += size;
     }
+    pos += size;
   }
-  luaL_pushresult(&b);
+  return pos;
+}
+
+
+/* the size is computed first so the result is written in one piece */
+static int b_pack (lua_State *L) {
+  luaL_Buffer b;
+  Format *f = getformat(L, 1);
+  size_t size = packsize(L, f, 2, 0);
+  char *p = prepresult(L, &b, size);
+  packinto(L, f, 2, p, 0);
+  pushresult(L, &b, p, size, size);
   return 1;
 }
 
@@ -531,131 +956,748 @@ static void getinteger (lua_State *L, const char *buff, int endian,
     ulongestint mask = ~(0ULL) << (size*8 - 1);
     if (li & mask)  /* negative value? */
       li |= mask;  /* signal extension */
-    if ((longestint)li > LONGESTMAX || (longestint)li < LONGESTMIN)
-      newlargeint(L, li);
-    else
-      lua_pushnumber(L, (lua_Number)(longestint)li);
+    pushsigned(L, (longestint)li);
     return;
   }
   /* unsigned format */
-  if (li > LONGESTMAX)
-    newlargeint(L, li);
-  else
-    lua_pushnumber(L, (lua_Number)li);
+  pushunsigned(L, li);
   return;
 }
 
 
+/* push a string field of `len' bytes, converting unicode to utf-8 */
+static void pushfield (lua_State *L, int opt, const char *p, size_t len,
+                       int endian) {
+  if (opt == 's' || opt == 'c')
+    lua_pushlstring(L, p, len);
+  else
+    unicodetostr(L, p, len, opt=='U'?4:2, endian);
+}
+
+
+/* unpack an item of known size; the caller checked the data length */
+static void unpackitem (lua_State *L, const FormatOp *op, const char *p) {
+  switch (op->opt) {
+    case 'b': case 'B': case 'h': case 'H':
+    case 'l': case 'L': case 'i':  case 'I':
+    case 'q': case 'Q': {  /* integer types */
+      getinteger(L, p, op->endian, islower(op->opt), op->size);
+      break;
+    }
+    case 'x': {
+      break;
+    }
+    case 'f': {
+      float f;
+      memcpy(&f, p, sizeof(f));
+      correctbytes((char *)&f, sizeof(f), op->endian);
+      lua_pushnumber(L, f);
+      break;
+    }
+    case 'd': {
+      double d;
+      memcpy(&d, p, sizeof(d));
+      correctbytes((char *)&d, sizeof(d), op->endian);
+      lua_pushnumber(L, d);
+      break;
+    }
+    case 'c': {
+      lua_pushlstring(L, p, op->size);
+      break;
+    }
+    case 's': case 'u': case 'U': {  /* fixed-size string field */
+      size_t sz = op->size;
+      const char *e = findterm(p, sz, op->opt=='U' ? 4 : op->opt=='u' ? 2 : 1);
+      if (e != NULL)
+        sz = e - p;
+      pushfield(L, op->opt, p, sz, op->endian);
+      break;
+    }
+  }
+}
+
+
+/*
+** Unpack all items of a format starting at `*ppos', leaving the values
+** on the stack. Returns an error message, or NULL on success with
+** `*ppos' updated to the position after the last item.
+*/
+static const char *unpackformat (lua_State *L, const Format *f,
+                                 const char *data, size_t ld, size_t *ppos) {
+  size_t pos = *ppos;
+  size_t i;
+  if (f->fixed && (pos & (f->maxalign - 1)) == 0) {
+    /* all offsets are known: check the length once */
+    if (pos > ld || f->size > ld - pos)
+      return "data string too short";
+    for (i = 0; i < f->nops; i++)
+      unpackitem(L, &f->ops[i], data + pos + f->ops[i].offset);
+    *ppos = pos + f->size;
+    return NULL;
+  }
+  for (i = 0; i < f->nops; i++) {
+    const FormatOp *op = &f->ops[i];
+    size_t size = op->size;
+    pos += padding(pos, op->align);
+    if (pos > ld || size > ld - pos)
+      return "data string too short";
+    if (size == 0 && op->opt == 'c') {
+      if (!lua_isnumber(L, -1))
+        luaL_error(L, "format `c0' needs a previous size");
+      size = lua_tonumber(L, -1);
+      lua_pop(L, 1);
+      if (size > ld - pos)
+        return "data string too short";
+      lua_pushlstring(L, data+pos, size);
+    }
+    else if (size == 0 && op->opt != 'x') {  /* zero-terminated string */
+      int w = op->opt=='U' ? 4 : op->opt=='u' ? 2 : 1;
+      const char *e = findterm(data+pos, ld-pos, w);
+      if (e == NULL)
+        return "unfinished string in data";
+      size = e - (data+pos);
+      pushfield(L, op->opt, data+pos, size, op->endian);
+      size += w;
+    }
+    else
+      unpackitem(L, op, data+pos);
+    pos += size;
+  }
+  *ppos = pos;
+  return NULL;
+}
+
+
 static int b_unpack (lua_State *L) {
-  Header h;
-  const char *fmt = luaL_checkstring(L, 1);
-  size_t ld, ls;
-  const char *data = luaL_checklstring(L, 2, &ld);
+  Format *f = getformat(L, 1);
+  size_t ld;
+  const char *data = larc_checkbytes(L, 2, &ld);
   size_t pos = luaL_optinteger(L, 3, 1) - 1;
-  defaultoptions(&h);
+  const char *msg;
   lua_settop(L, 2);
   if (pos >= ld) {
     lua_pushnil(L);
     lua_pushliteral(L, "data string too short");
     return 2;
   }
-  ls = 1;
-  while (*fmt) {
-    int opt = *fmt++;
-    size_t rep = 1;
-    size_t size = optsize(L, opt, &fmt, &rep);
-    if (size != 0 && opt != 'x')
-      ls += rep;
-  }
-  luaL_checkstack(L, ls, "too many values to unpack");
-  fmt = lua_tostring(L, 1);
-  while (*fmt) {
-    int opt = *fmt++;
-    size_t rep = 1;
-    size_t size = optsize(L, opt, &fmt, &rep);
-    while (rep--) {
-      pos += gettoalign(pos, &h, opt, size);
-      if (pos+size > ld) {
-        lua_pushnil(L);
-        lua_pushliteral(L, "data string too short");
-        return 2;
+  luaL_checkstack(L, f->nvalues + 1, "too many values to unpack");
+  msg = unpackformat(L, f, data, ld, &pos);
+  if (msg != NULL) {
+    lua_pushnil(L);
+    lua_pushstring(L, msg);
+    return 2;
+  }
+  lua_pushinteger(L, pos + 1);
+  return lua_gettop(L) - 2;
+}
+
+
+/*
+** unpack_many(fmt, data [, pos [, count]]): unpack `count' consecutive
+** records into an array of tables. Without a count, unpack records up to
+** the end of the data, stopping before an incomplete record. Returns the
+** array and the position after the last record.
+*/
+static int b_unpackmany (lua_State *L) {
+  Format *f = getformat(L, 1);
+  size_t ld;
+  const char *data = larc_checkbytes(L, 2, &ld);
+  size_t pos = luaL_optinteger(L, 3, 1) - 1;
+  int all = lua_isnoneornil(L, 4);
+  size_t count = all ? 0 : (size_t)luaL_checkinteger(L, 4);
+  size_t n, prealloc = count;
+  lua_settop(L, 2);
+  if (f->fixed && f->size > 0) {
+    size_t fit = pos < ld ? (ld - pos) / f->size : 0;
+    if (all || prealloc > fit) prealloc = fit;
+  }
+  lua_createtable(L, prealloc > INT_MAX ? 0 : (int)prealloc, 0);
+  luaL_checkstack(L, f->nvalues + 2, "too many values to unpack");
+  for (n = 0; all || n < count; n++) {
+    size_t next = pos;
+    const char *msg;
+    int top, i;
+    if (all && pos >= ld)
+      break;
+    lua_createtable(L, f->nvalues > INT_MAX ? 0 : (int)f->nvalues, 0);
+    top = lua_gettop(L);
+    msg = unpackformat(L, f, data, ld, &next);
+    if (msg != NULL) {
+      if (all) {
+        lua_settop(L, 3);
+        break;
       }
-      switch (opt) {
-        case 'b': case 'B': case 'h': case 'H':
-        case 'l': case 'L': case 'i':  case 'I':
-        case 'q': case 'Q': {  /* integer types */
-          int issigned = islower(opt);
-          getinteger(L, data+pos, h.endian, issigned, size);
-          break;
-        }
-        case 'x': {
-          break;
-        }
-        case 'f': {
-          float f;
-          memcpy(&f, data+pos, size);
-          correctbytes((char *)&f, sizeof(f), h.endian);
-          lua_pushnumber(L, f);
-          break;
-        }
-        case 'd': {
-          double d;
-          memcpy(&d, data+pos, size);
-          correctbytes((char *)&d, sizeof(d), h.endian);
-          lua_pushnumber(L, d);
-          break;
-        }
-        case 'c': {
-          if (size == 0) {
-            if (!lua_isnumber(L, -1))
-              luaL_error(L, "format `c0' needs a previous size");
-            size = lua_tonumber(L, -1);
-            lua_pop(L, 1);
-            if (pos+size > ld) {
-              lua_pushnil(L);
-              lua_pushliteral(L, "data string too short");
-              return 2;
-            }
-          }
-          lua_pushlstring(L, data+pos, size);
-          break;
-        }
-        case 's': case 'u': case 'U': {
-          size_t sz = size==0 ? (ld-pos) : size;
-          const char *e;
-          if (opt == 'U')
-            e = (const char *)memchr4(data+pos, 0, sz);
-          else if (opt == 'u')
-            e = (const char *)memchr2(data+pos, 0, sz);
-          else
-            e = (const char *)memchr(data+pos, 0, sz);
-          if (e == NULL) {
-            if (size == 0) {
-              lua_pushnil(L);
-              lua_pushliteral(L, "unfinished string in data");
-              return 2;
-            }
-          }
-          else {
-            sz = e - (data+pos);
-            if (size == 0)
-              size = sz + (opt=='U'?4:opt=='u'?2:1);
-          }
-          if (opt != 's')
-            unicodetostr(L, data+pos, sz, opt=='U'?4:2, h.endian);
+      lua_pushnil(L);
+      lua_pushstring(L, msg);
+      return 2;
+    }
+    for (i = lua_gettop(L) - top; i > 0; i--)
+      lua_rawseti(L, top, i);
+    lua_rawseti(L, 3, n + 1);
+    if (next == pos && all)  /* format consumes no data */
+      break;
+    pos = next;
+  }
+  lua_pushinteger(L, pos + 1);
+  return 2;
+}
+
+
+static int records_iter (lua_State *L) {
+  Format *f = (Format *)lua_touserdata(L, lua_upvalueindex(1));
+  size_t ld;
+  const char *data = larc_optbytes(L, lua_upvalueindex(2), NULL, &ld);
+  size_t pos = luaL_checkinteger(L, 2) - 1;
+  const char *msg;
+  if (pos >= ld)
+    return 0;
+  lua_settop(L, 1);  /* slot for the next position */
+  luaL_checkstack(L, f->nvalues + 1, "too many values to unpack");
+  msg = unpackformat(L, f, data, ld, &pos);
+  if (msg != NULL)
+    luaL_error(L, "%s", msg);
+  lua_pushinteger(L, pos + 1);
+  lua_replace(L, 1);
+  return lua_gettop(L);
+}
+
+
+/*
+** records(fmt, data [, pos]): iterate over the records in data. Each
+** step returns the position after the record followed by its values.
+*/
+static int b_records (lua_State *L) {
+  lua_Integer pos = luaL_optinteger(L, 3, 1);
+  size_t ld;
+  getformat(L, 1);
+  larc_checkbytes(L, 2, &ld);
+  lua_pushvalue(L, 1);
+  lua_pushvalue(L, 2);
+  lua_pushcclosure(L, records_iter, 2);
+  lua_pushnil(L);
+  lua_pushinteger(L, pos);
+  return 3;
+}
+
+
+#define COLCHUNK	256
+
+#define get16(p,big)	((big) ? \
+  (uint16_t)((p)[0] << 8 | (p)[1]) : (uint16_t)((p)[1] << 8 | (p)[0]))
+#define get32(p,big)	((big) ? \
+  ((uint32_t)(p)[0] << 24 | (uint32_t)(p)[1] << 16 | \
+   (uint32_t)(p)[2] << 8 | (uint32_t)(p)[3]) : \
+  ((uint32_t)(p)[3] << 24 | (uint32_t)(p)[2] << 16 | \
+   (uint32_t)(p)[1] << 8 | (uint32_t)(p)[0]))
+
+/* can a column be decoded straight into lua_Numbers? */
+static int columnfast (const FormatOp *op) {
+  switch (op->opt) {
+    case 'f': case 'd':
+      return 1;
+    case 'b': case 'B': case 'h': case 'H':
+    case 'l': case 'L': case 'i': case 'I':
+      return op->size == 1 || op->size == 2 || op->size == 4;
+    default:
+      return 0;
+  }
+}
+
+/* decode `n' values of a column spaced `stride' bytes apart */
+static void decodecolumn (const FormatOp *op, const unsigned char *p,
+                          size_t stride, size_t n, lua_Number *out) {
+  int big = (op->endian == BIG);
+  int issigned = islower(op->opt);
+  size_t i;
+  if (op->opt == 'f') {
+    for (i = 0; i < n; i++, p += stride) {
+      uint32_t u = get32(p, big);
+      float v;
+      memcpy(&v, &u, sizeof(v));
+      out[i] = v;
+    }
+  }
+  else if (op->opt == 'd') {
+    for (i = 0; i < n; i++, p += stride) {
+      uint64_t u = big ? (uint64_t)get32(p, 1) << 32 | get32(p + 4, 1)
+                       : (uint64_t)get32(p + 4, 0) << 32 | get32(p, 0);
+      double v;
+      memcpy(&v, &u, sizeof(v));
+      out[i] = v;
+    }
+  }
+  else switch (op->size) {
+    case 1:
+      if (issigned)
+        for (i = 0; i < n; i++, p += stride) out[i] = (signed char)*p;
+      else
+        for (i = 0; i < n; i++, p += stride) out[i] = *p;
+      break;
+    case 2:
+      if (issigned)
+        for (i = 0; i < n; i++, p += stride) out[i] = (int16_t)get16(p, big);
+      else
+        for (i = 0; i < n; i++, p += stride) out[i] = get16(p, big);
+      break;
+    case 4:
+      if (issigned)
+        for (i = 0; i < n; i++, p += stride) out[i] = (int32_t)get32(p, big);
+      else
+        for (i = 0; i < n; i++, p += stride) out[i] = get32(p, big);
+      break;
+  }
+}
+
+
+/*
+** unpack_columns(fmt, data [, pos [, count]]): unpack an array of
+** fixed-size records into one array per field. Returns the arrays
+** followed by the position after the last record.
+*/
+static int b_unpackcolumns (lua_State *L) {
+  Format *f = getformat(L, 1);
+  size_t ld;
+  const char *data = larc_checkbytes(L, 2, &ld);
+  size_t pos = luaL_optinteger(L, 3, 1) - 1;
+  int all = lua_isnoneornil(L, 4);
+  size_t count = all ? 0 : (size_t)luaL_checkinteger(L, 4);
+  size_t fit, i, j;
+  if (!f->fixed || f->size == 0)
+    luaL_argerror(L, 1, "format has a variable size");
+  if (f->size % f->maxalign != 0 || pos % f->maxalign != 0)
+    luaL_argerror(L, 3, "records are not aligned");
+  lua_settop(L, 2);
+  fit = pos < ld ? (ld - pos) / f->size : 0;
+  if (all)
+    count = fit;
+  else if (count > fit) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "data string too short");
+    return 2;
+  }
+  luaL_checkstack(L, f->nvalues + 1, "too many values to unpack");
+  for (j = 0; j < f->nops; j++) {
+    const FormatOp *op = &f->ops[j];
+    const char *p = data + pos + op->offset;
+    if (op->opt == 'x')
+      continue;
+    lua_createtable(L, count > INT_MAX ? 0 : (int)count, 0);
+    if (columnfast(op)) {
+      int isint = (op->opt != 'f' && op->opt != 'd');
+      lua_Number buf[COLCHUNK];
+      for (i = 0; i < count; i += COLCHUNK) {
+        size_t k, m = count - i < COLCHUNK ? count - i : COLCHUNK;
+        decodecolumn(op, (const unsigned char *)p + i * f->size, f->size,
+                     m, buf);
+        for (k = 0; k < m; k++) {
+          if (isint)
+            lua_pushinteger(L, (lua_Integer)buf[k]);
           else
-            lua_pushlstring(L, data+pos, sz);
-          break;
+            lua_pushnumber(L, buf[k]);
+          lua_rawseti(L, -2, i + k + 1);
         }
-        default: commoncases(L, opt, &fmt, &h);
       }
-      pos += size;
+    }
+    else {
+      for (i = 0; i < count; i++) {
+        unpackitem(L, op, p + i * f->size);
+        lua_rawseti(L, -2, i + 1);
+      }
     }
   }
-  lua_pushinteger(L, pos + 1);
+  lua_pushinteger(L, pos + count * f->size + 1);
   return lua_gettop(L) - 2;
 }
 
+
+/*
+** {======================================================
+** Mutable byte buffers
+** =======================================================
+*/
+
+#define BUFFERTYPE	LARC_BUFFER_MT
+
+typedef larc_Buffer Buffer;
+
+
+static Buffer *checkbuffer (lua_State *L, int arg) {
+  return (Buffer *)luaL_checkudata(L, arg, BUFFERTYPE);
+}
+
+
+/* buffer(n) or buffer(s): a buffer of `n' zero bytes or a copy of `s' */
+static int b_buffer (lua_State *L) {
+  size_t l;
+  const char *s = NULL;
+  Buffer *b;
+  if (lua_type(L, 1) == LUA_TNUMBER) {
+    lua_Integer n = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, n >= 0, 1, "invalid size");
+    l = (size_t)n;
+  }
+  else
+    s = larc_checkbytes(L, 1, &l);
+  b = (Buffer *)lua_newuserdata(L, sizeof(Buffer) + l);
+  b->data = (char *)(b + 1);
+  b->size = l;
+  b->ref = LUA_NOREF;
+  if (s != NULL)
+    memcpy(b->data, s, l);
+  else
+    memset(b->data, 0, l);
+  luaL_getmetatable(L, BUFFERTYPE);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+
+/* translate the range arguments i and j like string.sub */
+static char *bufferrange (lua_State *L, Buffer *b, int arg, size_t *len) {
+  lua_Integer n = (lua_Integer)b->size;
+  lua_Integer i = luaL_optinteger(L, arg, 1);
+  lua_Integer j = luaL_optinteger(L, arg + 1, -1);
+  if (i < 0) i += n + 1;
+  if (j < 0) j += n + 1;
+  if (i < 1) i = 1;
+  if (j > n) j = n;
+  if (i > j) {
+    *len = 0;
+    return b->data;
+  }
+  *len = (size_t)(j - i + 1);
+  return b->data + i - 1;
+}
+
+
+static int buffer_tostring (lua_State *L) {
+  Buffer *b = checkbuffer(L, 1);
+  size_t l;
+  const char *s = bufferrange(L, b, 2, &l);
+  lua_pushlstring(L, s, l);
+  return 1;
+}
+
+
+/* a view of part of the buffer sharing the same memory */
+static int buffer_slice (lua_State *L) {
+  Buffer *b = checkbuffer(L, 1);
+  size_t l;
+  char *s = bufferrange(L, b, 2, &l);
+  Buffer *v = (Buffer *)lua_newuserdata(L, sizeof(Buffer));
+  v->data = s;
+  v->size = l;
+  v->ref = LUA_NOREF;
+  luaL_getmetatable(L, BUFFERTYPE);
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, 1);
+  v->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+
+static int buffer_len (lua_State *L) {
+  lua_pushinteger(L, checkbuffer(L, 1)->size);
+  return 1;
+}
+
+
+static int buffer_gc (lua_State *L) {
+  Buffer *b = checkbuffer(L, 1);
+  luaL_unref(L, LUA_REGISTRYINDEX, b->ref);
+  b->ref = LUA_NOREF;
+  return 0;
+}
+
+
+/* pack_into(fmt, buf, pos, ...): pack values into a buffer in place */
+static int b_packinto (lua_State *L) {
+  Format *f = getformat(L, 1);
+  Buffer *b = checkbuffer(L, 2);
+  lua_Integer pos = luaL_checkinteger(L, 3) - 1;
+  size_t end;
+  luaL_argcheck(L, pos >= 0 && (size_t)pos <= b->size, 3, "out of range");
+  end = packsize(L, f, 4, (size_t)pos);
+  luaL_argcheck(L, end <= b->size, 3, "buffer too small");
+  packinto(L, f, 4, b->data, (size_t)pos);
+  lua_pushinteger(L, end + 1);
+  return 1;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Buffered readers
+** =======================================================
+*/
+
+#define READERTYPE	"larc.struct.reader"
+
+#define READERBUFSIZE	65536
+
+/* buffered data starts at a stream position that is a multiple of this,
+   so alignment in formats follows positions in the stream */
+#define READERALIGN	64
+
+typedef struct Reader {
+  char *buf;
+  size_t cap;  /* size of the buffer */
+  size_t start, end;  /* unread data in the buffer */
+  longestint base;  /* stream position of buf[0] */
+  int handle;  /* reference to the handle */
+  int bufref;  /* reference to the buffer memory */
+  int eof;
+} Reader;
+
+
+static Reader *checkreader (lua_State *L, int arg) {
+  return (Reader *)luaL_checkudata(L, arg, READERTYPE);
+}
+
+
+/* replace the buffer with one of at least `size' bytes */
+static void reader_grow (lua_State *L, Reader *r, size_t size) {
+  size_t cap = r->cap;
+  char *buf;
+  while (cap < size)
+    cap *= 2;
+  buf = (char *)lua_newuserdata(L, cap);
+  memcpy(buf, r->buf, r->end);
+  luaL_unref(L, LUA_REGISTRYINDEX, r->bufref);
+  r->bufref = luaL_ref(L, LUA_REGISTRYINDEX);
+  r->buf = buf;
+  r->cap = cap;
+}
+
+
+/* discard the buffered data, keeping the position */
+static void reader_drop (Reader *r, longestint skip) {
+  longestint pos = r->base + r->end + skip;
+  r->start = r->end = (size_t)(pos % READERALIGN);
+  r->base = pos - r->start;
+}
+
+
+/* read until at least `need' bytes are buffered or the stream ends */
+static void reader_fill (lua_State *L, Reader *r, size_t need) {
+  while (r->end - r->start < need && !r->eof) {
+    size_t want;
+    FILE *fp;
+    if (r->start >= READERALIGN) {  /* move the unread data to the front */
+      size_t shift = r->start - r->start % READERALIGN;
+      memmove(r->buf, r->buf + shift, r->end - shift);
+      r->base += shift;
+      r->start -= shift;
+      r->end -= shift;
+    }
+    if (r->end >= r->cap || r->start + need > r->cap)
+      reader_grow(L, r, r->start + need > r->cap ? r->start + need
+                                                 : r->cap + 1);
+    want = r->cap - r->end;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, r->handle);
+    fp = larc_tofile(L, -1);
+    if (fp != NULL) {
+      size_t n = fread(r->buf + r->end, 1, want, fp);
+      if (n == 0) {
+        if (ferror(fp))
+          luaL_error(L, "read error");
+        r->eof = 1;
+      }
+      r->end += n;
+      lua_pop(L, 1);
+    }
+    else {  /* call handle:read(want) */
+      size_t l = 0;
+      const char *s;
+      lua_getfield(L, -1, "read");
+      lua_insert(L, -2);
+      lua_pushinteger(L, want);
+      lua_call(L, 2, 2);
+      s = lua_tolstring(L, -2, &l);
+      if (s == NULL && !lua_isnil(L, -1))
+        luaL_error(L, "%s", lua_tostring(L, -1));
+      if (l > want)
+        luaL_error(L, "handle returned too much data");
+      if (s == NULL || l == 0)
+        r->eof = 1;
+      else {
+        memcpy(r->buf + r->end, s, l);
+        r->end += l;
+      }
+      lua_pop(L, 2);
+    }
+  }
+}
+
+
+/*
+** reader(handle [, bufsize]): a buffered reader of binary data from a
+** file or any object with a read method.
+*/
+static int b_reader (lua_State *L) {
+  lua_Integer size = luaL_optinteger(L, 2, READERBUFSIZE);
+  Reader *r;
+  FILE *fp;
+  luaL_checkany(L, 1);
+  luaL_argcheck(L, size > 0, 2, "invalid buffer size");
+  lua_settop(L, 1);
+  r = (Reader *)lua_newuserdata(L, sizeof(Reader));
+  r->buf = NULL;
+  r->cap = r->start = r->end = 0;
+  r->base = 0;
+  r->handle = r->bufref = LUA_NOREF;
+  r->eof = 0;
+  luaL_getmetatable(L, READERTYPE);
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, 1);
+  r->handle = luaL_ref(L, LUA_REGISTRYINDEX);
+  /* room for the alignment of the start position as well */
+  r->buf = (char *)lua_newuserdata(L, (size_t)size + READERALIGN);
+  r->bufref = luaL_ref(L, LUA_REGISTRYINDEX);
+  r->cap = (size_t)size + READERALIGN;
+  fp = larc_tofile(L, 1);
+  if (fp != NULL) {
+    long pos = ftell(fp);
+    if (pos > 0)
+      reader_drop(r, pos);
+  }
+  else {
+    lua_getfield(L, 1, "seek");
+    if (lua_isfunction(L, -1)) {
+      lua_pushvalue(L, 1);
+      lua_pushliteral(L, "cur");
+      lua_call(L, 2, 1);
+      if (lua_isnumber(L, -1))
+        reader_drop(r, (longestint)lua_tonumber(L, -1));
+    }
+    lua_pop(L, 1);
+  }
+  return 1;
+}
+
+
+/* reader:unpack(fmt): unpack the next values; nil at the end of data */
+static int reader_unpack (lua_State *L) {
+  Reader *r = checkreader(L, 1);
+  Format *f = getformat(L, 2);
+  lua_settop(L, 2);
+  luaL_checkstack(L, f->nvalues + 1, "too many values to unpack");
+  reader_fill(L, r, f->fixed ? f->size + f->maxalign : 1);
+  if (r->start == r->end && r->eof)
+    return 0;
+  for (;;) {
+    size_t pos = r->start;
+    const char *msg = unpackformat(L, f, r->buf, r->end, &pos);
+    if (msg == NULL) {
+      r->start = pos;
+      return lua_gettop(L) - 2;
+    }
+    lua_settop(L, 2);
+    if (r->eof) {
+      lua_pushnil(L);
+      lua_pushstring(L, msg);
+      return 2;
+    }
+    reader_fill(L, r, r->end - r->start + 1);
+  }
+}
+
+
+/* the number of bytes from the position of a file to its end, or -1
+   if that is not known, e.g. for a pipe */
+static long file_remaining (FILE *fp) {
+  long pos = ftell(fp), size;
+  if (pos < 0 || fseek(fp, 0, SEEK_END) != 0)
+    return -1;
+  size = ftell(fp);
+  if (fseek(fp, pos, SEEK_SET) != 0 || size < pos)
+    return -1;
+  return size - pos;
+}
+
+
+/* reader:skip(n): skip `n' bytes; returns the new position, or nil if
+   the data ended first */
+static int reader_skip (lua_State *L) {
+  Reader *r = checkreader(L, 1);
+  lua_Integer n = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, n >= 0, 2, "invalid count");
+  if ((size_t)n <= r->end - r->start)
+    r->start += (size_t)n;
+  else {
+    FILE *fp;
+    long left = -1;
+    n -= r->end - r->start;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, r->handle);
+    fp = larc_tofile(L, -1);
+    lua_pop(L, 1);
+    if (fp != NULL)
+      left = file_remaining(fp);
+    if (left >= 0 && n > left) {  /* stop at the end of the file */
+      reader_drop(r, fseek(fp, 0, SEEK_END) == 0 ? left : 0);
+      r->eof = 1;
+      return 0;
+    }
+    if (left >= 0 && fseek(fp, (long)n, SEEK_CUR) == 0) {
+      reader_drop(r, n);
+      r->eof = 0;
+    }
+    else {
+      reader_drop(r, 0);
+      while (n > 0) {
+        size_t l;
+        reader_fill(L, r, 1);
+        l = r->end - r->start;
+        if (l == 0)
+          return 0;
+        if ((lua_Integer)l > n)
+          l = (size_t)n;
+        r->start += l;
+        n -= l;
+      }
+    }
+  }
+  pushsigned(L, r->base + r->start);
+  return 1;
+}
+
+
+/* reader:tell(): the stream position of the next unread byte */
+static int reader_tell (lua_State *L) {
+  Reader *r = checkreader(L, 1);
+  pushsigned(L, r->base + r->start);
+  return 1;
+}
+
+
+static int reader_gc (lua_State *L) {
+  Reader *r = checkreader(L, 1);
+  luaL_unref(L, LUA_REGISTRYINDEX, r->handle);
+  luaL_unref(L, LUA_REGISTRYINDEX, r->bufref);
+  r->handle = r->bufref = LUA_NOREF;
+  return 0;
+}
+
+/* }====================================================== */
+
+
+static int b_size (lua_State *L) {
+  Format *f = getformat(L, 1);
+  if (!f->fixed)
+    luaL_error(L, "format has a variable size");
+  lua_pushinteger(L, f->size);
+  return 1;
+}
+
+
+static int b_compile (lua_State *L) {
+  getformat(L, 1);
+  lua_settop(L, 1);
+  return 1;
+}
+
 #define MAKELONG(a,b,c,d)	\
 	((((unsigned long)(a))<<24)|\
 	(((unsigned long)(b))<<16)|\
@@ -970,7 +2012,11 @@ static int largeinttostring (lua_State *L) {
 
 static int largeinttonumber (lua_State *L) {
   largeinteger_t li = getlargeint(L, 1);
+#ifdef LARC_NATIVE_INTEGER
+  lua_pushinteger(L, (lua_Integer)li);
+#else
   lua_pushnumber(L, (lua_Number)li);
+#endif
   return 1;
 }
 
@@ -1011,7 +2057,12 @@ static int divlargeint (lua_State *L) {
   largeinteger_t a, b;
   a = getlargeint(L, 1);
   b = getlargeint(L, 2);
-  a /= b;
+  if (b == 0)
+    luaL_error(L, "division by zero");
+  if (b == -1)  /* the minimum divided by -1 traps */
+    a = (largeinteger_t)(0 - (ulongestint)a);
+  else
+    a /= b;
   newlargeint(L, a);
   return 1;
 }
@@ -1020,7 +2071,12 @@ static int modlargeint (lua_State *L) {
   largeinteger_t a, b;
   a = getlargeint(L, 1);
   b = getlargeint(L, 2);
-  a %= b;
+  if (b == 0)
+    luaL_error(L, "division by zero");
+  if (b == -1)
+    a = 0;
+  else
+    a %= b;
   newlargeint(L, a);
   return 1;
 }
@@ -1038,6 +2094,21 @@ static int powlargeint (lua_State *L) {
   return 1;
 }
 
+/* li:add_inplace(x): add to a large integer without a new userdata */
+static int addinplace (lua_State *L) {
+  largeinteger_t *li = (largeinteger_t*)luaL_checkudata(L, 1, LARGETYPE);
+  *li += getlargeint(L, 2);
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int subinplace (lua_State *L) {
+  largeinteger_t *li = (largeinteger_t*)luaL_checkudata(L, 1, LARGETYPE);
+  *li -= getlargeint(L, 2);
+  lua_settop(L, 1);
+  return 1;
+}
+
 static int eqlargeint (lua_State *L) {
   largeinteger_t a, b;
   a = getlargeint(L, 1);
@@ -1086,6 +2157,8 @@ static int b_packvli (lua_State *L) {
   return 1;
 }
 
+/* unpackvli(data or reader): returns the value and its length in
+   bytes, or nil and a message if the data ends inside the value */
 static int b_unpackvli (lua_State *L) {
   ulongestint ul;
   size_t nb;
@@ -1107,7 +2180,7 @@ static int b_unpackvli (lua_State *L) {
     }
     s = lua_tolstring(L, -1, &l);
     if (s == NULL || l == 0)
-      return luaL_error(L, "unterminated long integer");
+      goto tooshort;
     c = *s;
     lua_pop(L, 1);
     nb++;
@@ -1117,36 +2190,183 @@ static int b_unpackvli (lua_State *L) {
       lua_pushinteger(L, 1);
       lua_call(L, 1, 1);
       s = lua_tolstring(L, -1, &l);
-      if (s == NULL || l == 0 || nb++ >= 9)
+      if (s == NULL || l == 0)
+        goto tooshort;
+      if (nb++ >= 9)
         return luaL_error(L, "unterminated long integer");
       c = *s;
       lua_pop(L, 1);
-      ul |= (ulongestint)(c & 0x7F) << (nb * 7);
+      ul |= (ulongestint)(c & 0x7F) << ((nb - 1) * 7);
     }
   }
   else {
     size_t l;
     const char *s = luaL_checklstring(L, 1, &l);
     if (l == 0)
-      return luaL_error(L, "unterminated long integer");
-    if (l > 9)
-      l = 9;
+      goto tooshort;
     ul = 0;
     nb = 0;
     ul = (unsigned char)s[0] & 0x7F;
     while (s[nb++] & 0x80) {
-      if (nb >= l || s[nb] == 0)
+      if (nb >= l)
+        goto tooshort;
+      if (nb >= 9 || s[nb] == 0)
         return luaL_error(L, "unterminated long integer");
       ul |= (ulongestint)((unsigned char)s[nb] & 0x7F) << (nb * 7);
     }
   }
   /*ul |= (ul<<1) & (ULLONG_MAX/2 + 1);*/
-  if (ul > LONGESTMAX)
-    newlargeint(L, (longestint)ul);
-  else
-    lua_pushnumber(L, (lua_Number)(longestint)ul);
+  pushunsigned(L, ul);
   lua_pushinteger(L, nb);
   return 2;
+tooshort:
+  lua_settop(L, 1);
+  lua_pushnil(L);
+  lua_pushliteral(L, "data string too short");
+  return 2;
+}
+
+
+/* packvli_array(t [, i [, j]]): pack t[i..j] as consecutive vlis */
+static int b_packvliarray (lua_State *L) {
+  luaL_Buffer b;
+  lua_Integer i, j, k;
+  size_t size;
+  unsigned char *o, *start;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  i = luaL_optinteger(L, 2, 1);
+  j = lua_isnoneornil(L, 3) ? (lua_Integer)lua_objlen(L, 1)
+                            : luaL_checkinteger(L, 3);
+  lua_settop(L, 1);
+  if (i > j) {
+    lua_pushliteral(L, "");
+    return 1;
+  }
+  if ((ulongestint)(j - i) >= (~(size_t)0) / 9)
+    return luaL_argerror(L, 1, "too many values");
+  size = (size_t)(j - i + 1) * 9;  /* 9 bytes for the largest value */
+  o = start = (unsigned char *)prepresult(L, &b, size);
+  for (k = i; k <= j; k++) {
+    ulongestint ul;
+    largeinteger_t li;
+    lua_rawgeti(L, 1, k);
+    li = getlargeint(L, -1);
+    if (li > LLONG_MAX/2 || li < 0)
+      luaL_error(L, "integer out of range at index %d", (int)k);
+    lua_pop(L, 1);
+    ul = (ulongestint)li;
+    while (ul >= 0x80) {
+      *o++ = ((unsigned char)ul)|0x80;
+      ul >>= 7;
+    }
+    *o++ = (unsigned char)ul;
+  }
+  pushresult(L, &b, (char *)start, size, o - start);
+  return 1;
+}
+
+
+/*
+** Decode the vli at `s', with at least 8 readable bytes. The 7-bit
+** groups of up to 8 bytes are gathered without a loop. Returns the
+** length, or 0 if the vli is longer than 8 bytes.
+*/
+static int getvli8 (const unsigned char *s, ulongestint *v) {
+  uint64_t x;
+  int n;
+  uint64_t stop;
+  memcpy(&x, s, 8);
+  stop = ~x & 0x8080808080808080ULL;
+  if (stop == 0)
+    return 0;
+#if defined(__GNUC__)
+  n = __builtin_ctzll(stop) / 8 + 1;
+#else
+  for (n = 1; (stop & 0x80) == 0; n++)
+    stop >>= 8;
+#endif
+  if (n < 8)
+    x &= (1ULL << (8 * n)) - 1;
+  x = ((x & 0x7F007F007F007F00ULL) >> 1) | (x & 0x007F007F007F007FULL);
+  x = ((x & 0x3FFF00003FFF0000ULL) >> 2) | (x & 0x00003FFF00003FFFULL);
+  x = ((x & 0x0FFFFFFF00000000ULL) >> 4) | (x & 0x000000000FFFFFFFULL);
+  *v = x;
+  return n;
+}
+
+/* decode a vli of at most 9 bytes; returns the length or 0 */
+static int getvli (const unsigned char *s, size_t l, ulongestint *v) {
+  ulongestint ul = 0;
+  size_t nb = 0;
+  if (l > 9)
+    l = 9;
+  while (nb < l) {
+    unsigned char c = s[nb];
+    ul |= (ulongestint)(c & 0x7F) << (nb * 7);
+    nb++;
+    if (!(c & 0x80)) {
+      *v = ul;
+      return (int)nb;
+    }
+  }
+  return 0;
+}
+
+
+/*
+** unpackvli_array(data [, pos [, count]]): unpack `count' consecutive
+** vlis into an array, or all of them up to the end of the data. Returns
+** the array and the position after the last value, or nil and a message
+** if the data ends before `count' values.
+*/
+static int b_unpackvliarray (lua_State *L) {
+  size_t ld;
+  const unsigned char *data =
+    (const unsigned char *)larc_checkbytes(L, 1, &ld);
+  size_t pos = luaL_optinteger(L, 2, 1) - 1;
+  int all = lua_isnoneornil(L, 3);
+  size_t count = all ? ~(size_t)0 : (size_t)luaL_checkinteger(L, 3);
+  size_t n = 0;
+  lua_settop(L, 1);
+  lua_createtable(L, all || count > INT_MAX ? 0 : (int)count, 0);
+  if (pos > ld)
+    pos = ld;
+  while (n < count && pos < ld) {
+    ulongestint v;
+    int nb = 0;
+    if (native.endian == LITTLE && ld - pos >= 8) {
+      uint64_t x;
+      memcpy(&x, data + pos, 8);
+      if ((x & 0x8080808080808080ULL) == 0 && count - n >= 8) {
+        int k;  /* eight single-byte values */
+        for (k = 0; k < 8; k++) {
+          lua_pushinteger(L, data[pos + k]);
+          lua_rawseti(L, 2, ++n);
+        }
+        pos += 8;
+        continue;
+      }
+      nb = getvli8(data + pos, &v);
+    }
+    if (nb == 0) {
+      nb = getvli(data + pos, ld - pos, &v);
+      if (nb == 0) {
+        if (ld - pos >= 9)
+          return luaL_error(L, "unterminated long integer");
+        break;  /* incomplete value at the end */
+      }
+    }
+    pushunsigned(L, v);
+    lua_rawseti(L, 2, ++n);
+    pos += nb;
+  }
+  if (!all && n < count) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "data string too short");
+    return 2;
+  }
+  lua_pushinteger(L, pos + 1);
+  return 2;
 }
 
 
@@ -1235,10 +2455,7 @@ static int b_unpackmbi (lua_State *L) {
     }
     nb++;
   }
-  if ((longestint)ul > LONGESTMAX || (longestint)ul < LONGESTMIN)
-    newlargeint(L, (longestint)ul);
-  else
-    lua_pushnumber(L, (lua_Number)(longestint)ul);
+  pushsigned(L, (longestint)ul);
   lua_pushinteger(L, nb);
   return 2;
 }
@@ -1246,13 +2463,624 @@ static int b_unpackmbi (lua_State *L) {
 /* }====================================================== */
 
 
+/*
+** {======================================================
+** Bulk base64, base32 and base85 encoding
+** =======================================================
+*/
+
+#define DEC_INVALID	0xFF
+#define DEC_SPACE	0xFE
+#define DEC_PAD	0xFD
+
+static const char b64digits[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char b32digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
+static unsigned char b64values[256];
+static unsigned char b32values[256];
+#ifdef HAVE_SSSE3
+static int has_ssse3 = 0;
+#endif
+
+static void codec_init (void) {
+  int i;
+  for (i = 0; i < 256; i++) {
+    unsigned char v = DEC_INVALID;
+    if (i == ' ' || i == '\t' || i == '\r' || i == '\n')
+      v = DEC_SPACE;
+    else if (i == '=')
+      v = DEC_PAD;
+    b64values[i] = b32values[i] = v;
+  }
+  for (i = 0; i < 64; i++)
+    b64values[(unsigned char)b64digits[i]] = (unsigned char)i;
+  for (i = 0; i < 32; i++) {
+    b32values[(unsigned char)b32digits[i]] = (unsigned char)i;
+    b32values[tolower((unsigned char)b32digits[i])] = (unsigned char)i;
+  }
+#ifdef HAVE_SSSE3
+  __builtin_cpu_init();
+  has_ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+}
+
+
+#ifdef HAVE_SSSE3
+/* encode blocks of 12 bytes, reading 16; returns the bytes consumed */
+__attribute__((target("ssse3")))
+static size_t base64enc_ssse3 (const unsigned char *s, size_t len,
+                               unsigned char *o) {
+  const __m128i shuf = _mm_set_epi8(10,11,9,10, 7,8,6,7, 4,5,3,4, 1,2,0,1);
+  const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    '+' - 62, '/' - 63, 'A', 0, 0);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 12, o += 16) {
+    __m128i in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(s + i)),
+                                  shuf);
+    __m128i t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+                                 _mm_set1_epi32(0x04000040));
+    __m128i t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+                                 _mm_set1_epi32(0x01000010));
+    __m128i idx = _mm_or_si128(t0, t1);
+    __m128i r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+    r = _mm_or_si128(r, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx),
+                                      _mm_set1_epi8(13)));
+    r = _mm_add_epi8(_mm_shuffle_epi8(shift, r), idx);
+    _mm_storeu_si128((__m128i *)o, r);
+  }
+  return i;
+}
+
+/*
+** decode blocks of 16 characters into 12 bytes, writing 16; stops at
+** anything other than base64 digits. Returns the characters consumed.
+*/
+__attribute__((target("ssse3")))
+static size_t base64dec_ssse3 (const unsigned char *s, size_t len,
+                               unsigned char *o) {
+  /* bit h of mask[l] is set if (h<<4 | l) is a base64 digit */
+  const __m128i masklut = _mm_setr_epi8(
+    (char)0xA8, (char)0xF8, (char)0xF8, (char)0xF8, (char)0xF8, (char)0xF8,
+    (char)0xF8, (char)0xF8, (char)0xF8, (char)0xF8, (char)0xF0, (char)0x54,
+    0x50, 0x50, 0x50, 0x54);
+  const __m128i bitlut = _mm_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20,
+    0x40, (char)0x80, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i shiftlut = _mm_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71,
+    0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+    -1, -1, -1, -1);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16, o += 12) {
+    __m128i in = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i hi = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+    __m128i lo = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+    __m128i ok = _mm_and_si128(_mm_shuffle_epi8(masklut, lo),
+                               _mm_shuffle_epi8(bitlut, hi));
+    __m128i sh, v;
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(ok, _mm_setzero_si128())) != 0)
+      break;
+    sh = _mm_add_epi8(_mm_shuffle_epi8(shiftlut, hi),
+                      _mm_and_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8('/')),
+                                    _mm_set1_epi8(-3)));
+    v = _mm_add_epi8(in, sh);
+    v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+    v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+    _mm_storeu_si128((__m128i *)o, _mm_shuffle_epi8(v, pack));
+  }
+  return i;
+}
+#endif
+
+
+static int b_base64encode (lua_State *L) {
+  luaL_Buffer b;
+  size_t len, i = 0, size;
+  const unsigned char *s = (const unsigned char *)larc_checkbytes(L, 1, &len);
+  unsigned char *o, *start;
+  if (len / 3 >= (~(size_t)0) / 4 - 1)
+    luaL_argerror(L, 1, "string too long");
+  size = (len + 2) / 3 * 4;
+  o = start = (unsigned char *)prepresult(L, &b, size);
+#ifdef HAVE_SSSE3
+  if (has_ssse3) {
+    i = base64enc_ssse3(s, len, o);
+    o += i / 3 * 4;
+  }
+#endif
+  for (; i + 3 <= len; i += 3) {
+    unsigned long v = ((unsigned long)s[i] << 16) | (s[i+1] << 8) | s[i+2];
+    *o++ = b64digits[v >> 18];
+    *o++ = b64digits[(v >> 12) & 63];
+    *o++ = b64digits[(v >> 6) & 63];
+    *o++ = b64digits[v & 63];
+  }
+  if (i < len) {
+    unsigned long v = (unsigned long)s[i] << 16;
+    if (i + 1 < len) v |= s[i+1] << 8;
+    *o++ = b64digits[v >> 18];
+    *o++ = b64digits[(v >> 12) & 63];
+    *o++ = (i + 1 < len) ? b64digits[(v >> 6) & 63] : '=';
+    *o++ = '=';
+  }
+  pushresult(L, &b, (char *)start, size, o - start);
+  return 1;
+}
+
+
+static int b_base64decode (lua_State *L) {
+  luaL_Buffer b;
+  size_t len, size;
+  const unsigned char *s = (const unsigned char *)larc_checkbytes(L, 1, &len);
+  const unsigned char *t = s + len;
+  unsigned char *o, *start;
+  unsigned long acc = 0;
+  int n = 0, pad = 0;
+  size = len / 4 * 3 + 16;  /* room for the last block store */
+  o = start = (unsigned char *)prepresult(L, &b, size);
+  while (s < t) {
+    unsigned char v;
+#ifdef HAVE_SSSE3
+    if (has_ssse3 && n == 0 && t - s >= 16) {
+      size_t k = base64dec_ssse3(s, t - s, o);
+      s += k;
+      o += k / 4 * 3;
+      if (s >= t)
+        break;
+    }
+#endif
+    v = b64values[*s++];
+    if (v < 64) {
+      if (pad)
+        goto invalid;
+      acc = (acc << 6) | v;
+      if (++n == 4) {
+        *o++ = (unsigned char)(acc >> 16);
+        *o++ = (unsigned char)(acc >> 8);
+        *o++ = (unsigned char)acc;
+        acc = 0;
+        n = 0;
+      }
+    }
+    else if (v == DEC_PAD) {
+      if (n < 2 || ++pad > 4 - n)
+        goto invalid;
+    }
+    else if (v != DEC_SPACE)
+      goto invalid;
+  }
+  if (n == 1)
+    goto invalid;
+  if (n >= 2)
+    *o++ = (unsigned char)(acc >> (n == 2 ? 4 : 10));
+  if (n == 3)
+    *o++ = (unsigned char)(acc >> 2);
+  pushresult(L, &b, (char *)start, size, o - start);
+  return 1;
+invalid:
+  lua_pushnil(L);
+  lua_pushliteral(L, "invalid base64 data");
+  return 2;
+}
+
+
+static int b_base32encode (lua_State *L) {
+  luaL_Buffer b;
+  size_t len, i, size;
+  const unsigned char *s = (const unsigned char *)larc_checkbytes(L, 1, &len);
+  unsigned char *o, *start;
+  if (len / 5 >= (~(size_t)0) / 8 - 1)
+    luaL_argerror(L, 1, "string too long");
+  size = (len + 4) / 5 * 8;
+  o = start = (unsigned char *)prepresult(L, &b, size);
+  for (i = 0; i < len; i += 5) {
+    unsigned char g[5] = {0, 0, 0, 0, 0};
+    ulongestint v;
+    size_t n = len - i < 5 ? len - i : 5;
+    int k, digits = (int)(n * 8 + 4) / 5;
+    memcpy(g, s + i, n);
+    v = ((ulongestint)g[0] << 32) | ((ulongestint)g[1] << 24) |
+        ((ulongestint)g[2] << 16) | ((ulongestint)g[3] << 8) | g[4];
+    for (k = 0; k < 8; k++)
+      o[k] = k < digits ? b32digits[(v >> (35 - 5*k)) & 31] : '=';
+    o += 8;
+  }
+  pushresult(L, &b, (char *)start, size, o - start);
+  return 1;
+}
+
+
+static int b_base32decode (lua_State *L) {
+  /* bytes produced by a final group of n digits, -1 if invalid */
+  static const signed char tail[8] = {0, -1, 1, -1, 2, 3, -1, 4};
+  luaL_Buffer b;
+  size_t len, size;
+  const unsigned char *s = (const unsigned char *)larc_checkbytes(L, 1, &len);
+  const unsigned char *t = s + len;
+  unsigned char *o, *start;
+  ulongestint acc = 0;
+  int n = 0, pad = 0, k;
+  size = len / 8 * 5 + 5;
+  o = start = (unsigned char *)prepresult(L, &b, size);
+  while (s < t) {
+    unsigned char v = b32values[*s++];
+    if (v < 32) {
+      if (pad)
+        goto invalid;
+      acc = (acc << 5) | v;
+      if (++n == 8) {
+        for (k = 4; k >= 0; k--)
+          *o++ = (unsigned char)(acc >> (8*k));
+        acc = 0;
+        n = 0;
+      }
+    }
+    else if (v == DEC_PAD) {
+      if (tail[n] <= 0 || ++pad > 8 - n)
+        goto invalid;
+    }
+    else if (v != DEC_SPACE)
+      goto invalid;
+  }
+  if (tail[n] < 0)
+    goto invalid;
+  acc <<= 40 - 5*n;
+  for (k = 0; k < tail[n]; k++)
+    *o++ = (unsigned char)(acc >> (32 - 8*k));
+  pushresult(L, &b, (char *)start, size, o - start);
+  return 1;
+invalid:
+  lua_pushnil(L);
+  lua_pushliteral(L, "invalid base32 data");
+  return 2;
+}
+
+
+static int b_base85encode (lua_State *L) {
+  luaL_Buffer b;
+  size_t len, i, size;
+  const unsigned char *s = (const unsigned char *)larc_checkbytes(L, 1, &len);
+  unsigned char *o, *start;
+  if (len / 4 >= (~(size_t)0) / 5 - 1)
+    luaL_argerror(L, 1, "string too long");
+  size = (len + 3) / 4 * 5;
+  o = start = (unsigned char *)prepresult(L, &b, size);
+  for (i = 0; i + 4 <= len; i += 4) {
+    uint32_t v = ((uint32_t)s[i] << 24) | ((uint32_t)s[i+1] << 16) |
+                 ((uint32_t)s[i+2] << 8) | s[i+3];
+    if (v == 0)
+      *o++ = 'z';
+    else {
+      int k;
+      for (k = 4; k >= 0; k--) {
+        o[k] = '!' + v % 85;
+        v /= 85;
+      }
+      o += 5;
+    }
+  }
+  if (i < len) {  /* partial group: n bytes give n+1 digits */
+    unsigned char g[4] = {0, 0, 0, 0};
+    uint32_t v;
+    size_t n = len - i;
+    int k;
+    char d[5];
+    memcpy(g, s + i, n);
+    v = ((uint32_t)g[0] << 24) | ((uint32_t)g[1] << 16) |
+        ((uint32_t)g[2] << 8) | g[3];
+    for (k = 4; k >= 0; k--) {
+      d[k] = '!' + v % 85;
+      v /= 85;
+    }
+    memcpy(o, d, n + 1);
+    o += n + 1;
+  }
+  pushresult(L, &b, (char *)start, size, o - start);
+  return 1;
+}
+
+
+static int b_base85decode (lua_State *L) {
+  luaL_Buffer b;
+  size_t len, size;
+  const unsigned char *s = (const unsigned char *)larc_checkbytes(L, 1, &len);
+  const unsigned char *t = s + len;
+  unsigned char *o, *start;
+  ulongestint acc = 0;
+  int n = 0, k;
+  size = len * 4;  /* 'z' expands to four bytes */
+  if (len > ~(size_t)0 / 4)
+    luaL_argerror(L, 1, "string too long");
+  o = start = (unsigned char *)prepresult(L, &b, size);
+  while (s < t) {
+    unsigned char c = *s++;
+    if (c >= '!' && c <= 'u') {
+      acc = acc * 85 + (c - '!');
+      if (++n == 5) {
+        if (acc > 0xFFFFFFFFUL)
+          goto invalid;
+        for (k = 3; k >= 0; k--)
+          *o++ = (unsigned char)(acc >> (8*k));
+        acc = 0;
+        n = 0;
+      }
+    }
+    else if (c == 'z' && n == 0) {
+      memset(o, 0, 4);
+      o += 4;
+    }
+    else if (b64values[c] != DEC_SPACE)
+      goto invalid;
+  }
+  if (n == 1)
+    goto invalid;
+  if (n > 0) {  /* pad the last group with the highest digit */
+    for (k = n; k < 5; k++)
+      acc = acc * 85 + 84;
+    if (acc > 0xFFFFFFFFUL)
+      goto invalid;
+    for (k = 0; k < n - 1; k++)
+      *o++ = (unsigned char)(acc >> (24 - 8*k));
+  }
+  pushresult(L, &b, (char *)start, size, o - start);
+  return 1;
+invalid:
+  lua_pushnil(L);
+  lua_pushliteral(L, "invalid base85 data");
+  return 2;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Arrays of numbers
+** =======================================================
+*/
+
+#if defined(__GNUC__)
+#define bswap32(u)	__builtin_bswap32(u)
+#define bswap64(u)	__builtin_bswap64(u)
+#else
+static uint32_t bswap32 (uint32_t u) {
+  u = ((u & 0x00FF00FFUL) << 8) | ((u >> 8) & 0x00FF00FFUL);
+  return (u << 16) | (u >> 16);
+}
+
+static uint64_t bswap64 (uint64_t u) {
+  u = ((u & 0x00FF00FF00FF00FFULL) << 8) | ((u >> 8) & 0x00FF00FF00FF00FFULL);
+  u = ((u & 0x0000FFFF0000FFFFULL) << 16) | ((u >> 16) & 0x0000FFFF0000FFFFULL);
+  return (u << 32) | (u >> 32);
+}
+#endif
+
+
+/* reverse the bytes of `n' consecutive items of 2, 4 or 8 bytes */
+static void swapbytes_scalar (unsigned char *p, size_t n, int size) {
+  size_t i;
+  switch (size) {
+    case 2:
+      for (i = 0; i < n; i++, p += 2) {
+        unsigned char t = p[0]; p[0] = p[1]; p[1] = t;
+      }
+      break;
+    case 4:
+      for (i = 0; i < n; i++, p += 4) {
+        uint32_t u;
+        memcpy(&u, p, 4);
+        u = bswap32(u);
+        memcpy(p, &u, 4);
+      }
+      break;
+    case 8:
+      for (i = 0; i < n; i++, p += 8) {
+        uint64_t u;
+        memcpy(&u, p, 8);
+        u = bswap64(u);
+        memcpy(p, &u, 8);
+      }
+      break;
+  }
+}
+
+#ifdef HAVE_SSSE3
+__attribute__((target("ssse3")))
+static size_t swapbytes_ssse3 (unsigned char *p, size_t nb, int size) {
+  const __m128i shuf = size == 2 ?
+    _mm_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14) : size == 4 ?
+    _mm_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12) :
+    _mm_setr_epi8(7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8);
+  size_t i;
+  for (i = 0; i + 16 <= nb; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    _mm_storeu_si128((__m128i *)(p + i), _mm_shuffle_epi8(v, shuf));
+  }
+  return i;
+}
+#endif
+
+static void swapbytes (unsigned char *p, size_t n, int size) {
+#ifdef HAVE_SSSE3
+  if (has_ssse3 && (size == 2 || size == 4 || size == 8)) {
+    size_t done = swapbytes_ssse3(p, n * size, size);
+    p += done;
+    n -= done / size;
+  }
+#endif
+  swapbytes_scalar(p, n, size);
+}
+
+
+/* the only item of a format for arrays, which must be a number */
+static const FormatOp *arrayitem (lua_State *L, const Format *f) {
+  if (f->nops == 1) {
+    switch (f->ops[0].opt) {
+      case 'b': case 'B': case 'h': case 'H':
+      case 'l': case 'L': case 'i': case 'I':
+      case 'q': case 'Q': case 'f': case 'd':
+        return &f->ops[0];
+    }
+  }
+  luaL_argerror(L, 1, "format must be a single number");
+  return NULL;
+}
+
+
+/* push `n' native-order items of `op' from `p' into the array at `t' */
+static void pusharray (lua_State *L, const FormatOp *op,
+                       const unsigned char *p, size_t n, int t, size_t k) {
+  int issigned = islower(op->opt);
+  size_t i;
+  for (i = 0; i < n; i++, k++) {
+    switch (op->opt == 'f' || op->opt == 'd' ? op->opt : (int)op->size) {
+      case 'f': {
+        float v; memcpy(&v, p + 4*i, 4); lua_pushnumber(L, v); break;
+      }
+      case 'd': {
+        double v; memcpy(&v, p + 8*i, 8); lua_pushnumber(L, v); break;
+      }
+      case 1:
+        lua_pushinteger(L, issigned ? (signed char)p[i] : p[i]);
+        break;
+      case 2: {
+        uint16_t u; memcpy(&u, p + 2*i, 2);
+        lua_pushinteger(L, issigned ? (int16_t)u : u);
+        break;
+      }
+      case 4: {
+        uint32_t u; memcpy(&u, p + 4*i, 4);
+        if (issigned) pushsigned(L, (int32_t)u);
+        else pushunsigned(L, u);
+        break;
+      }
+      case 8: {
+        uint64_t u; memcpy(&u, p + 8*i, 8);
+        if (issigned) pushsigned(L, (int64_t)u);
+        else pushunsigned(L, u);
+        break;
+      }
+    }
+    lua_rawseti(L, t, k + 1);
+  }
+}
+
+
+/*
+** unpack_array(fmt, data [, pos [, count]]): unpack `count' consecutive
+** numbers of a single-item format into an array, or all of them up to
+** the end of the data. Returns the array and the position after the last
+** number.
+*/
+static int b_unpackarray (lua_State *L) {
+  const FormatOp *op = arrayitem(L, getformat(L, 1));
+  size_t ld;
+  const char *data = larc_checkbytes(L, 2, &ld);
+  size_t pos = luaL_optinteger(L, 3, 1) - 1;
+  int all = lua_isnoneornil(L, 4);
+  size_t count = all ? 0 : (size_t)luaL_checkinteger(L, 4);
+  size_t size = op->size;
+  size_t fit, i;
+  lua_settop(L, 2);
+  pos += padding(pos, op->align);
+  fit = pos < ld ? (ld - pos) / size : 0;
+  if (all)
+    count = fit;
+  else if (count > fit) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "data string too short");
+    return 2;
+  }
+  lua_createtable(L, count > INT_MAX ? 0 : (int)count, 0);
+  if (size == 1 || size == 2 || size == 4 || size == 8) {
+    uint64_t buf[COLCHUNK];
+    for (i = 0; i < count; i += COLCHUNK) {
+      size_t m = count - i < COLCHUNK ? count - i : COLCHUNK;
+      memcpy(buf, data + pos + i * size, m * size);
+      if (op->endian != native.endian && size > 1)
+        swapbytes((unsigned char *)buf, m, size);
+      pusharray(L, op, (const unsigned char *)buf, m, 3, i);
+    }
+  }
+  else {
+    for (i = 0; i < count; i++) {
+      getinteger(L, data + pos + i * size, op->endian, islower(op->opt),
+                 size);
+      lua_rawseti(L, 3, i + 1);
+    }
+  }
+  lua_pushinteger(L, pos + count * size + 1);
+  return 2;
+}
+
+
+/*
+** pack_array(fmt, t [, i [, j]]): pack t[i..j] with a single-item
+** format. The items are stored in native order and swapped in one pass.
+*/
+static int b_packarray (lua_State *L) {
+  const FormatOp *op = arrayitem(L, getformat(L, 1));
+  luaL_Buffer b;
+  lua_Integer i, j, k;
+  size_t size = op->size, total;
+  char *out, *p;
+  int isfloat = (op->opt == 'f' || op->opt == 'd');
+  luaL_checktype(L, 2, LUA_TTABLE);
+  i = luaL_optinteger(L, 3, 1);
+  j = lua_isnoneornil(L, 4) ? (lua_Integer)lua_objlen(L, 2)
+                            : luaL_checkinteger(L, 4);
+  lua_settop(L, 2);
+  if (i > j) {
+    lua_pushliteral(L, "");
+    return 1;
+  }
+  if ((ulongestint)(j - i) >= (~(size_t)0) / size)
+    return luaL_argerror(L, 2, "too many values");
+  total = (size_t)(j - i + 1) * size;
+  out = p = prepresult(L, &b, total);
+  for (k = i; k <= j; k++, p += size) {
+    lua_rawgeti(L, 2, k);
+    if (isfloat) {
+      if (!lua_isnumber(L, -1))
+        luaL_error(L, "number expected at index %d", (int)k);
+      if (op->opt == 'f') {
+        float v = (float)lua_tonumber(L, -1);
+        memcpy(p, &v, 4);
+      }
+      else {
+        double v = lua_tonumber(L, -1);
+        memcpy(p, &v, 8);
+      }
+    }
+    else {
+      ulongestint v = getlargeint(L, -1);
+      switch (size) {
+        case 1: *p = (char)v; break;
+        case 2: { uint16_t u = (uint16_t)v; memcpy(p, &u, 2); break; }
+        case 4: { uint32_t u = (uint32_t)v; memcpy(p, &u, 4); break; }
+        case 8: { uint64_t u = (uint64_t)v; memcpy(p, &u, 8); break; }
+        default: storeinteger(L, p, -1, op->endian, size); break;
+      }
+    }
+    lua_pop(L, 1);
+  }
+  if (op->endian != native.endian &&
+      (size == 2 || size == 4 || size == 8))
+    swapbytes((unsigned char *)out, (size_t)(j - i + 1), size);
+  pushresult(L, &b, out, total, total);
+  return 1;
+}
+
+/* }====================================================== */
+
+
 #ifdef _WIN32
 #undef LUAMOD_API
 #define LUAMOD_API	__declspec(dllexport)
 #endif
 
 
-static const luaL_reg largeintMT[] = {
+static const luaL_Reg largeintMT[] = {
   {"__add", addlargeint},
   {"__sub", sublargeint},
   {"__mul", mullargeint},
@@ -1266,15 +3094,60 @@ static const luaL_reg largeintMT[] = {
   {"__tostring", largeinttostring},
   {"tonumber", largeinttonumber},
   {"tostring", largeinttostring},
+  {"add_inplace", addinplace},
+  {"sub_inplace", subinplace},
+  {NULL, NULL}
+};
+
+static const luaL_Reg bufferMT[] = {
+  {"__gc", buffer_gc},
+  {"__len", buffer_len},
+  {"__tostring", buffer_tostring},
+  {"tostring", buffer_tostring},
+  {"slice", buffer_slice},
+  {NULL, NULL}
+};
+
+static const luaL_Reg readerMT[] = {
+  {"__gc", reader_gc},
+  {"unpack", reader_unpack},
+  {"skip", reader_skip},
+  {"tell", reader_tell},
+  {NULL, NULL}
+};
+
+static const luaL_Reg formatMT[] = {
+  {"pack", b_pack},
+  {"unpack", b_unpack},
+  {"size", b_size},
   {NULL, NULL}
 };
 
-static const struct luaL_reg thislib[] = {
+static const struct luaL_Reg thislib[] = {
   {"pack", b_pack},
   {"unpack", b_unpack},
+  {"compile", b_compile},
+  {"size", b_size},
+  {"unpack_many", b_unpackmany},
+  {"records", b_records},
+  {"unpack_columns", b_unpackcolumns},
+  {"unpack_array", b_unpackarray},
+  {"pack_array", b_packarray},
+  {"buffer", b_buffer},
+  {"pack_into", b_packinto},
+  {"unpack_from", b_unpack},
+  {"reader", b_reader},
+  {"base64encode", b_base64encode},
+  {"base64decode", b_base64decode},
+  {"base32encode", b_base32encode},
+  {"base32decode", b_base32decode},
+  {"base85encode", b_base85encode},
+  {"base85decode", b_base85decode},
   {"largeinteger", b_largeint},
   {"packvli", b_packvli},
   {"unpackvli", b_unpackvli},
+  {"packvli_array", b_packvliarray},
+  {"unpackvli_array", b_unpackvliarray},
   {"packmbi", b_packmbi},
   {"unpackmbi", b_unpackmbi},
   {NULL, NULL}
@@ -1289,6 +3162,35 @@ LUAMOD_API int luaopen_larc_struct (lua_State *L) {
     lua_settable(L, -3);
   }
   lua_pop(L, 1);
+  if (luaL_newmetatable(L, FORMATTYPE)) {
+    luaL_register(L, NULL, formatMT);
+    lua_pushliteral(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+  }
+  lua_pop(L, 1);
+  if (luaL_newmetatable(L, BUFFERTYPE)) {
+    luaL_register(L, NULL, bufferMT);
+    lua_pushliteral(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+  }
+  lua_pop(L, 1);
+  if (luaL_newmetatable(L, READERTYPE)) {
+    luaL_register(L, NULL, readerMT);
+    lua_pushliteral(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+  }
+  lua_pop(L, 1);
+  lua_newtable(L);  /* cache of compiled format strings */
+  lua_newtable(L);
+  lua_pushliteral(L, "v");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_setfield(L, LUA_REGISTRYINDEX, FORMATCACHE);
+  simd_init();
+  codec_init();
   luaL_register(L, "larc.struct", thislib);
   return 1;
 }
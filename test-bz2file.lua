@@ -27,3 +27,53 @@ require "larc.bz2file"
 f = larc.bz2file.open('testdata.bz2','r')
 dofile "test-datafile.lua"
 assert(f:close())
+
+f = larc.bz2file.open('testdata.bz2','r',nil,7)
+dofile "test-datafile.lua"
+assert(f:close())
+
+f = larc.bz2file.open('testdata.bz2','rp',nil,7)
+dofile "test-datafile.lua"
+assert(f:close())
+
+f = larc.bz2file.open('testdata.bz2','r',nil,7)
+local n, size = 0, 0
+for line in f:lines() do
+  n = n + 1
+  size = size + #line + 1
+end
+assert(f:read() == nil and f:read("*a") == "")
+assert(f:seek("set", 0) == 0)
+local all = f:read("*a")
+local _, nl = string.gsub(all, "\n", "")
+assert(n == nl + (string.sub(all, -1) == "\n" and 0 or 1))
+assert(f:close())
+
+local name = os.tmpname()
+local w = assert(larc.bz2file.open(name, 'w', 9, 100))
+for i = 1, 1000 do assert(w:write(i, ",") == w) end
+assert(w:flush() == w)
+assert(w:seek() == 3893)
+assert(w:close())
+f = larc.bz2file.open(name)
+local all = f:read("*a")
+assert(f:close())
+assert(#all == 3893 and all:sub(1, 8) == "1,2,3,4,")
+os.remove(name)
+
+-- a flush finishes the stream, later writes go to a new one
+name = os.tmpname()
+w = assert(larc.bz2file.open(name, 'w'))
+assert(w:write("hello\n"):flush() == w)
+assert(w:flush() == w)
+f = larc.bz2file.open(name)
+assert(f:read("*a") == "hello\n")
+assert(f:close())
+assert(w:write("world\n"):close())
+for _, mode in ipairs{'r', 'rp'} do
+  f = larc.bz2file.open(name, mode)
+  assert(f:read("*a") == "hello\nworld\n")
+  assert(f:close())
+end
+os.remove(name)
+print("OK!")
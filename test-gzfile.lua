@@ -29,3 +29,217 @@ assert(f.filename == 'testdata')
 assert(f.os == 'unix')
 dofile "test-datafile.lua"
 assert(f:close())
+
+f = larc.gzfile.open('testdata.gz','r',nil,7)
+dofile "test-datafile.lua"
+assert(f:close())
+
+f = larc.gzfile.open('testdata.gz','rp',nil,7)
+dofile "test-datafile.lua"
+assert(f:close())
+
+-- the readahead thread has its own stream on the file
+local fh = assert(io.open('testdata.gz','rb'))
+local ra = larc.zlib.readahead(fh, {wbits=31})
+if ra then
+  fh:close()
+  local out = {}
+  for chunk in ra.read, ra do out[#out+1] = chunk end
+  f = larc.gzfile.open('testdata.gz')
+  assert(table.concat(out) == f:read('*a'))
+  f:close()
+  ra:close()
+end
+fh = assert(io.open('testdata.gz','rb'))
+ra = larc.zlib.readahead(fh, {wbits=31, bufsize=16})
+if ra then
+  assert(ra:read())
+  assert(fh:seek() == 0)
+  ra:close()
+  assert(fh:seek() > 0)
+end
+fh:close()
+-- only regular files are read ahead
+fh = io.open('/dev/null','rb')
+if fh then
+  assert(larc.zlib.readahead(fh) == nil)
+  fh:close()
+end
+
+require "larc.zlib"
+f = larc.zlib.gzopen('testdata.gz')
+assert(f.filename == 'testdata')
+assert(f.os == 'unix')
+dofile "test-datafile.lua"
+assert(f:close())
+
+-- Run a test on a temporary file, which is removed even if it fails.
+local function withtemp(test)
+  local name = os.tmpname()
+  local ok, err = pcall(test, name)
+  os.remove(name)
+  assert(ok, err)
+end
+
+-- gzopen writes and reads lines
+withtemp(function(name)
+  local w = assert(larc.zlib.gzopen(name, 'w'))
+  for i = 1, 1000 do w:write("line ", i, "\n") end
+  assert(w:close())
+  local n = 0
+  for line in larc.zlib.gzopen(name):lines() do
+    n = n + 1
+    assert(line == "line " .. n)
+  end
+  assert(n == 1000)
+end)
+print("OK!")
+
+-- reading in small chunks
+withtemp(function(name)
+  local w = assert(larc.gzfile.open(name, 'w'))
+  for i = 1, 1000 do w:write("line ", i, "\n") end
+  assert(w:close())
+  local gz = larc.gzfile.open(name)
+  assert(gz:read(10) == "line 1\nlin")
+  gz:close()
+  gz = larc.gzfile.open(name, 'r', nil, 7)
+  local n = 0
+  for line in gz:lines() do
+    n = n + 1
+    assert(line == "line " .. n)
+    if n == 500 then break end
+  end
+  assert(gz:read("*l") == "line 501")
+  assert(gz:seek() == #"line 1\n" * 9 + #"line 10\n" * 90 + #"line 100\n" * 402)
+  assert(gz:read(9) == "line 502\n")
+  assert(gz:seek("set", 7) == 7)
+  assert(gz:read() == "line 2")
+  gz:close()
+end)
+print("OK!")
+
+-- writes are buffered up to bufsize
+withtemp(function(name)
+  local w = assert(larc.gzfile.open(name, 'w', 6, 100))
+  for i = 1, 1000 do assert(w:write(i, ",") == w) end
+  assert(w:seek() == 3893)
+  assert(w:flush() == w)
+  assert(w:seek("cur", 6.5) == 3899)
+  assert(w:seek("set", 3900.25) == 3900)
+  w:write("end")
+  assert(w:close())
+  local gz = larc.gzfile.open(name)
+  local all = gz:read("*a")
+  gz:close()
+  assert(#all == 3903 and all:sub(1, 8) == "1,2,3,4," and all:sub(-10) == "\0\0\0\0\0\0\0end")
+  assert(select(2, all:gsub(",", "")) == 1000)
+end)
+print("OK!")
+
+-- a seek forward while writing fills with zeros
+withtemp(function(name)
+  local w = assert(larc.gzfile.open(name, 'w'))
+  w:write("start")
+  assert(w:seek("set", 2^26) == 2^26)
+  w:write("end")
+  assert(w:close())
+  local gz = larc.gzfile.open(name)
+  assert(gz:read(5) == "start")
+  assert(gz:seek("set", 2^26 - 2) == 2^26 - 2)
+  assert(gz:read("*a") == "\0\0end")
+  gz:close()
+end)
+print("OK!")
+
+-- BGZF files
+withtemp(function(name)
+  local w = assert(larc.gzfile.open_bgzf(name, 'w', 6, 2))
+  local voffsets, size = {}, 0
+  for i = 1, 30000 do
+    if i % 1000 == 0 then voffsets[i] = w:vtell() end
+    w:write("line ", i, "\n")
+    size = size + #tostring(i) + 6
+  end
+  assert(w:seek("cur", 70000) == size + 70000)
+  w:write("end")
+  assert(w:close())
+  local gz = larc.gzfile.open(name)
+  local data = gz:read("*a")
+  gz:close()
+  assert(data:sub(1, 7) == "line 1\n" and data:sub(-10) == "\0\0\0\0\0\0\0end")
+  local fh = io.open(name, "rb")
+  local raw = fh:read("*a")
+  fh:close()
+  assert(raw:sub(-28) == larc.zlib.bgzf_compress(""))
+  assert(larc.zlib.bgzf_decompress(raw, {threads=3}) == data)
+  gz = assert(larc.gzfile.open_bgzf(name, 'r', nil, 3))
+  for i = 1000, 30000, 1000 do
+    assert(gz:vseek(voffsets[i]) == voffsets[i])
+    assert(gz:read() == "line " .. i)
+  end
+  assert(gz:seek() == select(2, data:find("line 30000\n", 1, true)))
+  assert(gz:seek("set", 7) == 7)
+  assert(gz:read() == "line 2")
+  local n = 2
+  for line in gz:lines() do
+    n = n + 1
+    if n == 20000 then
+      assert(line == "line 20000")
+      break
+    end
+  end
+  local v = gz:vtell()
+  assert(gz:read() == "line 20001")
+  assert(gz:vseek(v) == v)
+  assert(gz:seek() == #data:match("^(.-line 20000\n)"))
+  assert(gz:read() == "line 20001")
+  gz:close()
+  gz = assert(larc.gzfile.open_bgzf(name))
+  assert(gz:vseek(voffsets[30000]) == voffsets[30000])
+  assert(gz:seek() == nil)
+  assert(gz:read() == "line 30000")
+  assert(gz:seek("set", 7) == 7)
+  assert(gz:read() == "line 2")
+  gz:close()
+  gz = larc.gzfile.open(name, 'rp')
+  assert(gz:read("*a") == data)
+  gz:close()
+  assert(larc.gzfile.open_bgzf('testdata.gz') == nil)
+end)
+print("OK!")
+
+-- seeks in both directions resume from the checkpoints
+withtemp(function(name)
+  local lines = {}
+  for i = 1, 10007 do lines[i] = i .. ":" .. (i * 7919 % 65536) .. "\n" end
+  local data = table.concat(lines):rep(110)
+  for _, open in ipairs{larc.gzfile.open, larc.gzfile.open_bgzf} do
+    local w = assert(open(name, 'w', 1))
+    w:write(data)
+    assert(w:close())
+    local gz = assert(open(name, 'r'))
+    assert(gz:read("*a") == data)
+    for _, f in ipairs{0.9, 0.01, 0.5, 0.7, 0.69, 0.49, 0, 0.95} do
+      local p = math.floor(#data * f)
+      assert(gz:seek("set", p) == p)
+      assert(gz:read(30) == data:sub(p+1, p+30))
+    end
+    gz:close()
+  end
+end)
+print("OK!")
+
+-- everything written before a flush can be read back
+withtemp(function(name)
+  local w = assert(larc.gzfile.open(name, 'w'))
+  assert(w:write("hello\n"):flush() == w)
+  local gz = assert(larc.gzfile.open(name))
+  assert(gz:read("*a") == "hello\n")
+  gz:close()
+  assert(w:write("world\n"):close())
+  gz = assert(larc.gzfile.open(name))
+  assert(gz:read("*a") == "hello\nworld\n")
+  gz:close()
+end)
+print("OK!")
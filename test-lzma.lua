@@ -46,4 +46,139 @@ for i=1,#hello do
   c = larc.lzma.crc64(c, hello:sub(i,i))
 end
 assert(c==crc64)
+c = larc.lzma.crc64_combine(
+    larc.lzma.crc64(hello:sub(1,-7)),
+    larc.lzma.crc64(hello:sub(-6)), 6)
+assert(c==crc64)
+print("OK!")
+
+dict = string.rep("hello, world! ", 8)
+filter = larc.lzma.filter("lzma2", {preset=6, dictionary=dict})
+assert(filter.dictionary==dict)
+compr = assert(larc.lzma.compress(hello, {format="raw", filter=filter}))
+plain = assert(larc.lzma.compress(hello, {format="raw", filter=larc.lzma.filter("lzma2", {preset=6})}))
+assert(#compr <= #plain)
+uncompr = assert(larc.lzma.decompress(compr, {format="raw", filter=filter}))
+assert(uncompr==hello)
+filter.dictionary = nil
+assert(filter.dictionary==nil)
+print("OK!")
+
+data = {}
+for i=1,2048 do
+  data[i] = string.char(i%256, math.floor(i/256), 0, 0)
+end
+data = table.concat(data)
+-- the ID of the first filter of the first block in an xz stream
+local function first_filter(xz)
+  local pos, flags = 15, xz:byte(14)
+  local function vli()
+    local n, scale, b = 0, 1
+    repeat
+      b = xz:byte(pos)
+      pos = pos + 1
+      n = n + b % 128 * scale
+      scale = scale * 128
+    until b < 128
+    return n
+  end
+  if flags % 128 >= 64 then vli() end -- compressed size
+  if flags >= 128 then vli() end -- uncompressed size
+  return vli()
+end
+local DELTA, X86, LZMA2 = 3, 4, 33
+compr = assert(larc.lzma.compress(data, {format="xz", auto_filter=true}))
+assert(larc.lzma.decompress(compr, {format="xz"})==data)
+plain = assert(larc.lzma.compress(data, {format="xz"}))
+assert(first_filter(compr)==DELTA and first_filter(plain)==LZMA2)
+assert(#compr < #plain)
+-- a table of 8-byte records gets a delta filter
+local records = {}
+for i=1,8192 do
+  local x, y = i*3 % 65536, math.floor(i*i/64) % 65536
+  records[i] = string.char(i%256, math.floor(i/256), 0, 0,
+      x%256, math.floor(x/256), y%256, math.floor(y/256))
+end
+records = table.concat(records)
+compr = assert(larc.lzma.compress(records, {format="xz", auto_filter=true}))
+assert(larc.lzma.decompress(compr, {format="xz"})==records)
+plain = assert(larc.lzma.compress(records, {format="xz"}))
+assert(first_filter(compr)==DELTA and #compr < #plain)
+-- x86-64 code in an ELF file gets the x86 BCJ filter
+local code = {}
+for i=1,4096 do
+  -- mov rdi,rax; call to one of 64 functions
+  local rel = ((i*37) % 64 * 16 - (64 + (i-1)*8 + 8)) % 4294967296
+  code[i] = "\72\137\199\232" .. string.char(rel%256, math.floor(rel/256)%256,
+      math.floor(rel/65536)%256, math.floor(rel/16777216))
+end
+local elf = "\127ELF\2\1\1" .. string.rep("\0", 11) .. "\62\0" ..
+    string.rep("\0", 44) .. table.concat(code)
+compr = assert(larc.lzma.compress(elf, {format="xz", auto_filter=true}))
+assert(larc.lzma.decompress(compr, {format="xz"})==elf)
+plain = assert(larc.lzma.compress(elf, {format="xz"}))
+assert(first_filter(compr)==X86 and #compr < #plain)
+print("OK!")
+
+compr,used,status = assert(larc.lzma.compress(data, {format="xz", preset=1}))
+assert(used==#data and status==larc.lzma.LZMA_STREAM_END)
+uncompr,used,status = assert(larc.lzma.decompress(compr.."\0\0\0\0", {format="xz"}))
+assert(uncompr==data and used==#compr and status==larc.lzma.LZMA_STREAM_END)
+print("OK!")
+
+f = io.open("testdata.xz", "rb")
+info = assert(larc.lzma.list(f))
+f:close()
+assert(info.streams==1 and info.blocks==1 and info.check=="crc64")
+assert(info.compressed_size==104 and info.uncompressed_size==1010)
+assert(info[1].compressed_offset==12 and info[1].uncompressed_size==1010)
+-- a failed read leaves the handle where it was
+local xz = compr
+local h = {pos=5}
+function h:seek(whence, off)
+  if whence == "set" then self.pos = off
+  elseif whence == "end" then self.pos = #xz + off
+  else self.pos = self.pos + off end
+  return self.pos
+end
+function h:read(n)
+  local s = self.pos == 0 and xz:sub(1, 3) or xz:sub(self.pos + 1, self.pos + n)
+  self.pos = self.pos + #s
+  return s
+end
+assert(not pcall(larc.lzma.list, h))
+assert(h.pos == 5)
+print("OK!")
+
+-- the size in the index is not trusted for the output buffer
+local xz = assert(larc.lzma.compress("hello world", {format="xz"}))
+local function u32(s, i)
+  local a, b, c, d = s:byte(i, i+3)
+  return a + b*256 + c*65536 + d*16777216
+end
+local function le32(n)
+  local t = {}
+  for i=1,4 do t[i] = string.char(n % 256); n = math.floor(n / 256) end
+  return table.concat(t)
+end
+local backward = (u32(xz, #xz-7) + 1) * 4
+local index = xz:sub(#xz-11-backward, #xz-12)
+assert(index:byte(1) == 0 and index:byte(2) == 1 and index:byte(4) == 11)
+-- one record of 2^40 bytes, padded to 12 bytes
+index = "\0\1" .. index:sub(3, 3) .. "\128\128\128\128\128\32\0\0\0"
+index = index .. le32(larc.lzma.crc32(index))
+local footer = le32(#index/4 - 1) .. xz:sub(-4, -3)
+footer = le32(larc.lzma.crc32(footer)) .. footer .. "YZ"
+xz = xz:sub(1, #xz-12-backward) .. index .. footer
+uncompr,used,status = larc.lzma.decompress(xz, {format="xz"})
+assert(status == larc.lzma.LZMA_DATA_ERROR)
+print("OK!")
+
+do
+  local encode = compressor{format="xz"}
+  local decode = decompressor{format="xz"}
+  assert(decode(encode("hello world", true)) == "hello world")
+  assert(decode(encode("1", true)) == "1")
+  assert(decode(encode(nil)) == "")
+end
 print("OK!")
@@ -0,0 +1,330 @@
+--[==========================================================================[
+   LArc library
+   Copyright (C) 2010 Tom N Harris. All rights reserved.
+  
+    This software is provided 'as-is', without any express or implied
+    warranty.  In no event will the authors be held liable for any damages
+    arising from the use of this software.
+  
+    Permission is granted to anyone to use this software for any purpose,
+    including commercial applications, and to alter it and redistribute it
+    freely, subject to the following restrictions:
+  
+    1. The origin of this software must not be misrepresented; you must not
+       claim that you wrote the original software. If you use this software
+       in a product, an acknowledgment in the product documentation would be
+       appreciated but is not required.
+    2. Altered source versions must be plainly marked as such, and must not be
+       misrepresented as being the original software.
+    3. This notice may not be removed or altered from any source distribution.
+    4. Neither the names of the authors nor the names of any of the software 
+       contributors may be used to endorse or promote products derived from 
+       this software without specific prior written permission.
+--]==========================================================================]
+require"larc.struct"
+
+local pack,unpack = larc.struct.pack,larc.struct.unpack
+local compile = larc.struct.compile
+
+local header = compile"<c4HHL"
+assert(header:size() == 12)
+local s = header:pack("LArc", 1, 2, 3)
+assert(#s == 12)
+assert(s == pack("<c4HHL", "LArc", 1, 2, 3))
+local magic,a,b,c,pos = header:unpack(s)
+assert(magic == "LArc" and a == 1 and b == 2 and c == 3 and pos == 13)
+assert(select('#', header:unpack(s..s, 13)) == 5)
+assert(header:unpack(s:sub(1,11)) == nil)
+-- compiled formats are accepted in place of strings
+assert(pack(header, "LArc", 1, 2, 3) == s)
+assert(select(4, unpack(header, s)) == 3)
+
+-- alignment is resolved relative to the data position
+local aligned = compile"!4 B L"
+assert(aligned:size() == 8)
+local t = "\1\0\0\0"..pack("<B", 7)..string.rep("\0", 3)..pack("<L", 9)
+assert(select(2, aligned:unpack(t, 5)) == 9)
+assert(select(2, unpack("!4 B L", t, 5)) == 9)
+
+-- variable-size items
+local varstr = compile">Hc0s"
+assert(not pcall(varstr.size, varstr))
+local v = varstr:pack(3, "xyz", "name")
+local rest,name,p = varstr:unpack(v)
+assert(rest == "xyz" and name == "name" and p == #v + 1)
+assert(select(2, compile"s":unpack("abc")) == "unfinished string in data")
+print("OK!")
+
+local u = compile"<uU"
+local w = u:pack("h\195\169", "\240\159\152\128")
+assert(#w == 6 + 8)
+local s1,s2 = u:unpack(w)
+assert(s1 == "h\195\169" and s2 == "\240\159\152\128")
+print("OK!")
+
+local rec = compile"<HB"
+local data = {}
+for i = 1, 100 do data[i] = rec:pack(i, i % 7) end
+data = table.concat(data)
+local list,npos = larc.struct.unpack_many(rec, data)
+assert(#list == 100 and npos == #data + 1)
+assert(list[42][1] == 42 and list[42][2] == 0 and #list[42] == 2)
+list,npos = larc.struct.unpack_many("<HB", data, 4, 2)
+assert(#list == 2 and list[2][1] == 3 and npos == 10)
+assert(larc.struct.unpack_many(rec, data, 1, 101) == nil)
+-- an incomplete trailing record is left for the caller
+list,npos = larc.struct.unpack_many(rec, data .. "\1")
+assert(#list == 100 and npos == #data + 1)
+local count = 0
+for p,n,m in larc.struct.records(rec, data) do
+  count = count + 1
+  assert(n == count and m == count % 7 and p == count * 3 + 1)
+end
+assert(count == 100)
+assert(not pcall(function() for p in larc.struct.records(rec, "\1\2\3\4") do end end))
+print("OK!")
+
+local row = compile">!4 h B x L f c2 q"
+local rows = {}
+for i = 1, 600 do
+  rows[i] = row:pack(-i, i % 256, i * 65537, i / 4, "r"..(i % 10), -i * 1000)
+end
+rows = table.concat(rows)
+local c1,c2,c3,c4,c5,c6,cpos = larc.struct.unpack_columns(row, rows)
+assert(#c1 == 600 and #c6 == 600 and cpos == #rows + 1)
+for i = 1, 600 do
+  assert(c1[i] == -i and c2[i] == i % 256 and c3[i] == i * 65537)
+  assert(c4[i] == i / 4 and c5[i] == "r"..(i % 10) and c6[i] == -i * 1000)
+end
+c1,c2,c3,c4,c5,c6,cpos = larc.struct.unpack_columns(row, rows, row:size() + 1, 2)
+assert(#c1 == 2 and c1[1] == -2 and cpos == row:size() * 3 + 1)
+assert(larc.struct.unpack_columns(row, rows, 1, 601) == nil)
+assert(not pcall(larc.struct.unpack_columns, "s", rows))
+local dbl = {larc.struct.unpack_columns("<dH", larc.struct.pack("<dHdH", 1.5, 2, -3.25, 4))}
+assert(dbl[1][2] == -3.25 and dbl[2][1] == 2 and dbl[2][2] == 4)
+print("OK!")
+
+local buf = larc.struct.buffer(16)
+assert(#buf == 16 and buf:tostring() == string.rep("\0", 16))
+assert(larc.struct.pack_into("<HL", buf, 3, 0x1234, 0xdeadbeef) == 9)
+assert(buf:tostring(3, 8) == pack("<HL", 0x1234, 0xdeadbeef))
+local h,l = larc.struct.unpack_from("<HL", buf, 3)
+assert(h == 0x1234 and l == 0xdeadbeef)
+local view = buf:slice(9, 16)
+assert(#view == 8)
+larc.struct.pack_into("s", view, 1, "abc")
+assert(buf:tostring(9, 12) == "abc\0")
+view = nil
+collectgarbage()
+assert(unpack("s", buf, 9) == "abc")
+assert(not pcall(larc.struct.pack_into, "<q", buf, 10, 1))
+assert(not pcall(larc.struct.pack_into, "c0", buf, 1, string.rep("x", 17)))
+assert(larc.struct.pack_into("!4 B u0", buf, 2, 1, "\195\169") == 7)
+assert(select(2, larc.struct.unpack_from("!4 B u0", buf, 2)) == "\195\169")
+assert(tostring(larc.struct.buffer("xyz")) == "xyz")
+print("OK!")
+
+-- 64-bit values are native integers on Lua 5.3 and large integers before
+local big = pack("<q", larc.struct.largeinteger("0x123456789abcdef"))
+local v = unpack("<q", big)
+if math.type then
+  assert(math.type(v) == "integer" and v == 81985529216486895)
+  assert(pack("<q", v) == big)
+  assert(math.type(unpack("<H", "\1\0")) == "integer")
+else
+  assert(type(v) == "userdata" and v == larc.struct.largeinteger("0x123456789abcdef"))
+end
+assert(unpack("<q", pack("<q", -5)) == -5)
+print("OK!")
+
+-- long strings take the block transcoding paths
+local text = string.rep("plain ascii text ", 5) .. string.rep("\208\148\208\190\208\188", 9) ..
+             "\228\184\173\240\159\152\128" .. string.rep("x", 33)
+for _,fmt in ipairs{"<u0", ">u0", "<U0", ">U0"} do
+  local packed = pack(fmt, text)
+  assert(unpack(fmt, packed) == text)
+  assert(unpack(fmt, packed .. string.rep("\0", 40)) == text)
+end
+assert(pack(">U0", "AB") == "\0\0\0A\0\0\0B\0\0\0\0")
+assert(pack("<u0", string.rep("\195\169", 8)) == string.rep("\233\0", 8) .. "\0\0")
+assert(unpack("<u20", pack("<u20", string.rep("a", 10))) == string.rep("a", 10))
+assert(not pcall(pack, "<u0", string.rep("\195\169", 7) .. "\195(" .. string.rep("a", 20)))
+print("OK!")
+
+local msg = "hello world, this is a test of base64 encoding!!"
+local b64 = "aGVsbG8gd29ybGQsIHRoaXMgaXMgYSB0ZXN0IG9mIGJhc2U2NCBlbmNvZGluZyEh"
+assert(larc.struct.base64encode(msg) == b64)
+assert(larc.struct.base64decode(b64) == msg)
+assert(larc.struct.base64encode("ab") == "YWI=" and larc.struct.base64decode("YWI") == "ab")
+assert(larc.struct.base64decode("YW\r\nI=") == "ab")
+assert(larc.struct.base64decode("YWI=x") == nil)
+assert(larc.struct.base64decode(string.rep("QUJD", 8) .. "!" .. string.rep("QUJD", 8)) == nil)
+assert(larc.struct.base32encode(msg) ==
+  "NBSWY3DPEB3W64TMMQWCA5DINFZSA2LTEBQSA5DFON2CA33GEBRGC43FGY2CAZLOMNXWI2LOM4QSC===")
+assert(larc.struct.base32decode(larc.struct.base32encode(msg)) == msg)
+assert(larc.struct.base32decode("MFRA====") == "ab")
+assert(larc.struct.base32decode("MFR") == nil)
+assert(larc.struct.base85encode("\0\0\0\0ab") == "z@:B")
+assert(larc.struct.base85decode("z@:B") == "\0\0\0\0ab")
+assert(larc.struct.base85encode(msg) ==
+  "BOu!rD]j7BEbo8;+EV:2F!,1<+CQC7ATMr9De:,$@<6!<1a$@I@rGmlDJ(+9")
+assert(larc.struct.base85decode(larc.struct.base85encode(msg)) == msg)
+assert(larc.struct.base85decode("s8W-\"") == nil)
+local blob = {}
+for i = 0, 1000 do blob[#blob+1] = string.char(i % 256, (i * 7) % 256) end
+blob = table.concat(blob)
+for _,c in ipairs{"64", "32", "85"} do
+  assert(larc.struct["base"..c.."decode"](larc.struct["base"..c.."encode"](blob)) == blob)
+end
+assert(larc.struct.base64encode(larc.struct.buffer(msg)) == b64)
+print("OK!")
+
+local vals = {0, 1, 127, 128, 300, 16383, 16384, 2^31, 2^40 + 5, 2^47 - 1}
+for i = 1, 20 do vals[#vals+1] = i end
+local vli = larc.struct.packvli_array(vals)
+local single = {}
+for i,v in ipairs(vals) do single[i] = larc.struct.packvli(v) end
+assert(vli == table.concat(single))
+local t, nextpos = larc.struct.unpackvli_array(vli)
+assert(#t == #vals and nextpos == #vli + 1)
+for i,v in ipairs(vals) do assert(t[i] == v) end
+t, nextpos = larc.struct.unpackvli_array(vli, 1, 3)
+assert(#t == 3 and t[3] == 127 and nextpos == 4)
+t, nextpos = larc.struct.unpackvli_array(vli .. "\128", 1)
+assert(#t == #vals and nextpos == #vli + 1)
+assert(larc.struct.unpackvli_array(vli, 1, #vals + 1) == nil)
+assert(not pcall(larc.struct.unpackvli_array, string.rep("\255", 12)))
+assert(larc.struct.packvli_array({}) == "")
+assert(#larc.struct.packvli_array({1, 2, 3, 4}, 2, 3) == 2)
+local bytes = {}
+local reader = function() return table.remove(bytes, 1) end
+bytes = {"\172", "\2"}
+assert(larc.struct.unpackvli(reader) == 300)
+-- truncated values give nil and a message
+local a, msg = larc.struct.unpackvli_array(vli .. "\128", 1, #vals + 1)
+assert(a == nil and msg == "data string too short")
+a, msg = larc.struct.unpackvli("\172")
+assert(a == nil and msg == "data string too short")
+assert(larc.struct.unpackvli("") == nil)
+bytes = {"\172"}
+a, msg = larc.struct.unpackvli(reader)
+assert(a == nil and msg == "data string too short")
+assert(not pcall(larc.struct.unpackvli, string.rep("\255", 12)))
+print("OK!")
+
+local nums = {}
+for i = 1, 300 do nums[i] = (i * 37) % 1000 - 500 end
+for _,fmt in ipairs{">h", "<h", ">l", "<i3", ">i3", "<q", ">q"} do
+  local s = larc.struct.pack_array(fmt, nums)
+  local parts = {}
+  for i,v in ipairs(nums) do parts[i] = pack(fmt, v) end
+  assert(s == table.concat(parts))
+  local t, nextpos = larc.struct.unpack_array(fmt, s)
+  assert(#t == #nums and nextpos == #s + 1)
+  for i,v in ipairs(nums) do assert(t[i] == v) end
+end
+local reals = {}
+for i = 1, 100 do reals[i] = i / 8 - 3 end
+for _,fmt in ipairs{">d", "<d", ">f", "<f"} do
+  local s = larc.struct.pack_array(fmt, reals)
+  local parts = {}
+  for i,v in ipairs(reals) do parts[i] = pack(fmt, v) end
+  assert(s == table.concat(parts))
+  local t = larc.struct.unpack_array(fmt, s)
+  for i,v in ipairs(reals) do assert(t[i] == v) end
+end
+local t, nextpos = larc.struct.unpack_array(">H", "\0\1\0\2\0\3\0", 3, 2)
+assert(#t == 2 and t[1] == 2 and t[2] == 3 and nextpos == 7)
+assert(larc.struct.unpack_array(">H", "\0\1\0", 1, 2) == nil)
+t = larc.struct.unpack_array(">H", "\0\1\0")
+assert(#t == 1 and t[1] == 1)
+assert(larc.struct.pack_array(">H", {1, 2, 3}, 2, 3) == "\0\2\0\3")
+assert(not pcall(larc.struct.pack_array, ">HH", {1}))
+assert(not pcall(larc.struct.unpack_array, "s", "abc"))
+assert(not pcall(larc.struct.pack_array, "<d", {"x"}))
+print("OK!")
+
+local recfile = os.tmpname()
+local out = assert(io.open(recfile, "wb"))
+for i = 1, 5000 do out:write(pack(">Hs", i, "name" .. i)) end
+out:write(pack(">I", 0xDEADBEEF), "tail")
+out:close()
+local fh = assert(io.open(recfile, "rb"))
+local rd = larc.struct.reader(fh, 100)
+for i = 1, 4999 do
+  local n, s = rd:unpack(">Hs")
+  assert(n == i and s == "name" .. i)
+end
+local pos5000 = rd:tell()
+assert(rd:skip(#pack(">Hs", 5000, "name5000")) == pos5000 + 11)
+assert(rd:unpack(">I") == 0xDEADBEEF)
+assert(rd:tell() == pos5000 + 15)
+local a, msg = rd:unpack(">Q")
+assert(a == nil and msg)
+assert(rd:unpack("c4") == "tail")
+assert(rd:unpack("B") == nil)
+fh:close()
+local chunks = {pack("<i", -7), pack("<d", 1.5) .. "xyz\0"}
+local src = {read = function(self, n)
+  local s = table.remove(chunks, 1)
+  return s and s:sub(1, n)
+end}
+rd = larc.struct.reader(src)
+local i, d, z = rd:unpack("<i<d")
+assert(i == -7 and d == 1.5 and z == nil)
+assert(rd:unpack("s") == "xyz" and rd:tell() == 16)
+assert(rd:skip(1) == nil)
+-- a small buffer with an unaligned start
+fh = assert(io.open(recfile, "rb"))
+local head = fh:read(200)
+for _, start in ipairs{40, 60} do
+  for _, size in ipairs{8, 16} do
+    fh:seek("set", start)
+    rd = larc.struct.reader(fh, size)
+    assert(rd:tell() == start)
+    assert(rd:unpack("c4") == head:sub(start + 1, start + 4))
+    assert(rd:unpack("c30") == head:sub(start + 5, start + 34))
+    assert(rd:skip(3) == start + 37)
+    assert(rd:unpack("c2") == head:sub(start + 38, start + 39))
+  end
+end
+-- a skip past the end of a file stops there
+local size = fh:seek("end")
+fh:seek("set", 0)
+rd = larc.struct.reader(fh, 16)
+assert(rd:skip(size - 4) == size - 4)
+assert(rd:skip(5) == nil)
+assert(rd:tell() == size and rd:unpack("B") == nil)
+fh:seek("set", 0)
+rd = larc.struct.reader(fh, 16)
+assert(rd:skip(2^40) == nil and rd:tell() == size)
+fh:close()
+os.remove(recfile)
+print("OK!")
+
+local L = larc.struct.largeinteger
+local huge = L("0x1000000000000")
+assert(huge - 1 == L(2^48 - 1) and (huge - 1):tonumber() == 2^48 - 1)
+assert(huge * 4 / 8 == L(2^47))
+assert((huge % 7):tonumber() == 2^48 % 7)
+assert((huge + 1):tostring(16) == "1000000000001")
+assert(not pcall(function() return huge / 0 end))
+local min = L("-0x8000000000000000")
+assert(min / -1 == min and min % -1 == L(0))
+local acc = L(0)
+for i = 1, 1000 do assert(acc:add_inplace(2^40) == acc) end
+assert(acc == L("0x3E80000000000"))
+acc:sub_inplace(L("0x3E80000000000"))
+assert(acc:tonumber() == 0)
+print("OK!")
+
+assert(larc.struct.size(">!4 b i") == 8)
+assert(larc.struct.size("<h d") == 10)
+assert(not pcall(larc.struct.size, "s"))
+local long = string.rep("x", 20000)
+assert(pack(">c0 s", long, "!") == long .. "!\0")
+local many = {}
+for i = 1, 1000 do many[i] = i end
+assert(pack("!4 b" .. string.rep(" d", 1000), 1, (table.unpack or _G.unpack)(many)) ==
+  "\1\0\0\0" .. larc.struct.pack_array("d", many))
+print("OK!")
@@ -41,6 +41,11 @@ c = larc.zlib.crc32_combine(
     larc.zlib.crc32(hello:sub(1,-7)),
     larc.zlib.crc32(hello:sub(-6)), 6)
 assert(c==crc32)
+for _,n in ipairs{0, 1, 100, 100000} do
+  local zeros = string.rep("\0", n)
+  assert(larc.zlib.crc32_zeros(n) == larc.zlib.crc32(zeros))
+  assert(larc.zlib.crc32_zeros(crc32, n) == larc.zlib.crc32(crc32, zeros))
+end
 print("OK!")
 adler32 = larc.zlib.adler32(hello)
 assert(adler32==0x21700496)
@@ -54,3 +59,88 @@ a = larc.zlib.adler32_combine(
     larc.zlib.adler32(hello:sub(-6)), 6)
 assert(a==adler32)
 print("OK!")
+
+require"larc.struct"
+local zbuf = larc.struct.buffer(compress(hello))
+assert(decompress(zbuf) == hello)
+print("OK!")
+
+for _,n in ipairs{10, 65536, 65536+258, 1000000} do
+  local deflate = larc.zlib.compressor{wbits=-15}
+  local z = { deflate(hello), deflate(n), deflate(hello), deflate(nil) }
+  assert(decompress(table.concat(z), {wbits=-15}) == hello .. string.rep("\0", n) .. hello)
+end
+do
+  local deflate = larc.zlib.compressor{wbits=-15}
+  local z = { deflate(1.5), deflate(65536.75), deflate(nil) }
+  assert(decompress(table.concat(z), {wbits=-15}) == string.rep("\0", 65537))
+  assert(not pcall(deflate, -1))
+end
+print("OK!")
+
+do
+  local inflate = decompressor{wbits=-15}
+  local z = compress(hello:rep(1000), {wbits=-15})
+  local a = inflate(z:sub(1, 100))
+  local copy = assert(larc.zlib.copy(inflate))
+  local b = inflate(z:sub(101))
+  assert(copy(z:sub(101)) == b and a .. b == hello:rep(1000))
+  local deflate = compressor{}
+  local head = deflate(hello)
+  copy = larc.zlib.copy(deflate)
+  assert(decompress(head .. deflate("1") .. deflate()) == hello .. "1")
+  assert(decompress(head .. copy("2") .. copy()) == hello .. "2")
+  assert(not pcall(larc.zlib.copy, print))
+end
+print("OK!")
+
+do
+  -- a sync flush makes all input so far decompressible
+  local deflate = compressor{}
+  local inflate = decompressor{}
+  assert(inflate(deflate(hello, true)) == hello)
+  assert(inflate(deflate("1", true)) == "1")
+  assert(inflate(deflate(nil)) == "")
+end
+print("OK!")
+
+do
+  -- a pool is used for one call after another
+  local pool = larc.zlib.bgzf_pool(3)
+  local data = hello:rep(20000)
+  local z = assert(larc.zlib.bgzf_compress(data, {level=1, pool=pool}))
+  assert(larc.zlib.bgzf_decompress(z, {pool=pool}) == data)
+  assert(larc.zlib.bgzf_compress(data, {pool=pool}) == larc.zlib.bgzf_compress(data))
+  assert(larc.zlib.bgzf_decompress(z, {pool=pool}) == data)
+  pool:close()
+  pool:close()
+  assert(not pcall(larc.zlib.bgzf_decompress, z, {pool=pool}))
+  assert(not pcall(larc.zlib.bgzf_pool, 0))
+end
+print("OK!")
+
+-- chunk sizes and lines of the compressed file readers
+do
+  local f = assert(io.open("test-zlib.lua", "rb"))
+  f:seek("set", 10)
+  assert(larc.zlib.bufsize(f) == 16384)
+  assert(f:seek("cur") == 10)
+  f:close()
+  local big = {seek = function(self, whence, off)
+    if whence == "end" then return 4194304 end
+    return 0
+  end}
+  assert(larc.zlib.bufsize(big) == 524288)
+  assert(larc.zlib.bufsize({}) == 65536)
+  assert(larc.zlib.bufsize({seek = function() error("no seek") end}) == 65536)
+  local chunks = {"b\nc", "c\n", "d"}
+  local t = {_buffer="a\n", _offset=0, _pos=0}
+  local function fill() return table.remove(chunks, 1) end
+  assert(larc.zlib.readline(t, fill) == "a")
+  local lines = {}
+  for line in larc.zlib.lines(t, fill) do lines[#lines+1] = line end
+  assert(table.concat(lines, ",") == "b,cc,d" and t._pos == 8)
+  assert(larc.zlib.readline(t, fill) == nil)
+  assert(not math.type or math.type(t._pos) == "integer")
+end
+print("OK!")